@@ -1,5 +1,7 @@
 #include "certificatestoreproviderplugin.h"
 
+#include <QtCore/QMetaClassInfo>
+
 namespace Gravity {
 
 CertificateStoreProviderPlugin::CertificateStoreProviderPlugin(QObject* parent)
@@ -12,4 +14,22 @@ CertificateStoreProviderPlugin::~CertificateStoreProviderPlugin()
 {
 }
 
+bool CertificateStoreProviderPlugin::clientCredentials(QByteArray *privateKey, QByteArray *certificate)
+{
+    *privateKey = this->privateKey();
+    if (privateKey->isEmpty()) {
+        certificate->clear();
+        return false;
+    }
+
+    *certificate = this->certificate();
+    return !certificate->isEmpty();
+}
+
+bool CertificateStoreProviderPlugin::notifiesChanges() const
+{
+    int index = metaObject()->indexOfClassInfo("NotifiesChanges");
+    return index >= 0 && qstrcmp(metaObject()->classInfo(index).value(), "true") == 0;
+}
+
 }
@@ -20,6 +20,29 @@ public:
     virtual QByteArray privateKey() = 0;
     virtual QByteArray certificate() = 0;
 
+    /**
+     * Retrieves the client private key and its certificate in a single call.
+     *
+     * The certificate is not queried at all when there is no private key to go with it.
+     *
+     * @returns Whether both the private key and the certificate are available.
+     */
+    bool clientCredentials(QByteArray *privateKey, QByteArray *certificate);
+
+    /**
+     * Whether the provider emits changed() whenever its key material changes. Providers declare it with
+     * Q_CLASSINFO("NotifiesChanges", "true"), and only their material is cached by consumers: everything else
+     * is queried again on every request.
+     */
+    bool notifiesChanges() const;
+
+Q_SIGNALS:
+    /**
+     * Emitted whenever the key material held by the provider changes. Only meaningful for providers
+     * declaring NotifiesChanges, see notifiesChanges().
+     */
+    void changed();
+
 private:
     class Private;
     Private * const d;
@@ -3,6 +3,8 @@
 #include <HemeraCore/CommonOperations>
 #include <HemeraCore/Literals>
 
+#include <QtCore/QElapsedTimer>
+
 #include "applicationinterface.h"
 #include "dbusobjectinterface.h"
 
@@ -25,6 +27,10 @@ public:
 
     // Remote properties
     Hemera::Application::ApplicationStatus status;
+
+    // Lifecycle timing
+    QElapsedTimer pendingStart;
+    QElapsedTimer pendingStop;
 };
 
 Application::Application(const QString &name, bool isSatellite, const QDBusConnection &connection, QObject* parent)
@@ -97,6 +103,19 @@ void Application::initImpl()
         if (changed.contains(QStringLiteral("applicationStatus"))) {
             d->status = static_cast<Hemera::Application::ApplicationStatus>(changed.value(QStringLiteral("applicationStatus")).toUInt());
 
+            // Close any pending lifecycle request
+            if (d->status == Hemera::Application::ApplicationStatus::Running && d->pendingStart.isValid()) {
+                Q_EMIT lifecycleStageCompleted(LifecycleStage::Start, d->pendingStart.elapsed());
+                d->pendingStart.invalidate();
+            } else if (d->status == Hemera::Application::ApplicationStatus::Stopped && d->pendingStop.isValid()) {
+                Q_EMIT lifecycleStageCompleted(LifecycleStage::Stop, d->pendingStop.elapsed());
+                d->pendingStop.invalidate();
+            } else if (d->status == Hemera::Application::ApplicationStatus::Failed) {
+                // Failures would just skew the figures
+                d->pendingStart.invalidate();
+                d->pendingStop.invalidate();
+            }
+
             // Verify if we are initialized
             if (!isReady() && d->status == Hemera::Application::ApplicationStatus::Stopped) {
                 setOnePartIsReady();
@@ -130,11 +149,15 @@ bool Application::isSatellite() const
 
 Hemera::Operation *Application::start()
 {
+    d->pendingStart.start();
+    d->pendingStop.invalidate();
     return new Hemera::DBusVoidOperation(d->interface->start());
 }
 
 Hemera::Operation *Application::stop()
 {
+    d->pendingStop.start();
+    d->pendingStart.invalidate();
     return new Hemera::DBusVoidOperation(d->interface->stop());
 }
 
@@ -16,6 +16,14 @@ class HEMERA_GRAVITY_EXPORT Application : public Hemera::AsyncInitObject
     Q_DISABLE_COPY(Application)
 
 public:
+    enum class LifecycleStage {
+        Registration = 0,
+        Start = 1,
+        Stop = 2,
+        // From process creation to registration
+        Launch = 3
+    };
+
     explicit Application(const QString &id, bool isSatellite, const QDBusConnection &connection = QDBusConnection::sessionBus(), QObject* parent = 0);
     virtual ~Application();
 
@@ -33,6 +41,7 @@ protected Q_SLOTS:
 
 Q_SIGNALS:
     void applicationStatusChanged(Hemera::Application::ApplicationStatus status);
+    void lifecycleStageCompleted(Gravity::Application::LifecycleStage stage, qint64 msecs);
 
 private:
     class Private;
@@ -5,6 +5,7 @@
 #include "gravityapplicationhandler.h"
 
 #include "gravityapplication.h"
+#include "gravitylatencyhistogram_p.h"
 
 #include <HemeraCore/CommonOperations>
 #include <HemeraCore/Literals>
@@ -12,8 +13,18 @@
 #include <HemeraCore/Planet>
 #include <HemeraCore/ServiceManager>
 
+#include <QtCore/QDateTime>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QVector>
+
 #include <QtDBus/QDBusServiceWatcher>
 
+#include <algorithm>
+
+#include <time.h>
+#include <unistd.h>
+
 #include "fdodbusinterface.h"
 #include "applicationhandleradaptor.h"
 #include "satellitemanagerinterface.h"
@@ -22,10 +33,73 @@
 namespace Gravity
 {
 
+class SatelliteEvictionOperation : public Hemera::Operation
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(SatelliteEvictionOperation)
+
+public:
+    explicit SatelliteEvictionOperation(const QString &orbit, ApplicationHandler *handler)
+        : Operation(handler), m_orbit(orbit), m_handler(handler) {}
+    virtual ~SatelliteEvictionOperation() {}
+
+protected:
+    virtual void startImpl() override final;
+
+private:
+    void shutdownSatellite();
+
+    QString m_orbit;
+    ApplicationHandler *m_handler;
+};
+
+static QString lifecycleStageName(Application::LifecycleStage stage)
+{
+    switch (stage) {
+        case Application::LifecycleStage::Registration:
+            return QStringLiteral("registration");
+        case Application::LifecycleStage::Start:
+            return QStringLiteral("start");
+        case Application::LifecycleStage::Stop:
+            return QStringLiteral("stop");
+        case Application::LifecycleStage::Launch:
+            return QStringLiteral("launch");
+    }
+
+    return QString();
+}
+
+static qint64 msecsSinceBoot()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    return static_cast<qint64>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+}
+
+// Returns when the process was created, in msecs since boot, or -1
+static qint64 processStartTime(uint pid)
+{
+    QFile stat(QStringLiteral("/proc/%1/stat").arg(pid));
+    if (!stat.open(QIODevice::ReadOnly)) {
+        return -1;
+    }
+
+    // The command name might contain spaces: count fields from its closing parenthesis, starting at state (3).
+    QByteArray line = stat.readAll();
+    QList< QByteArray > fields = line.mid(line.lastIndexOf(')') + 2).split(' ');
+    if (fields.size() < 20) {
+        return -1;
+    }
+
+    // starttime (22), in clock ticks since boot
+    return fields.at(19).toLongLong() * 1000 / sysconf(_SC_CLK_TCK);
+}
+
 class ApplicationHandler::Private
 {
 public:
-    Private(const QDBusConnection &dbus) : dbus(dbus) {}
+    Private(const QDBusConnection &dbus) : dbus(dbus), failedRegistrations(0), satelliteManagerInterface(Q_NULLPTR)
+                                         , satelliteManagerObjectInterface(Q_NULLPTR) {}
 
     QString star;
 
@@ -39,12 +113,88 @@ public:
     QStringList activeSatellites;
     Hemera::Planet::ActivationPolicies activationPolicies;
 
+    // Last time (msecs since epoch) each launched satellite had one of its applications activated
+    QHash< QString, qint64 > satelliteLastActivation;
+
+    QString satelliteForApplication(const QString &application) const;
+
+    // Lifecycle latencies, kept across restarts of the same application so slow ones stand out
+    QHash< QString, QHash< QString, LatencyHistogram > > applicationLatencies;
+    QHash< QString, LatencyHistogram > aggregateLatencies;
+    quint64 failedRegistrations;
+
+    void recordLatency(const QString &application, Application::LifecycleStage stage, qint64 msecs);
+
     org::freedesktop::DBus *fdoDBus;
 
     com::ispirata::Hemera::Gravity::SatelliteManager *satelliteManagerInterface;
     com::ispirata::Hemera::DBusObject *satelliteManagerObjectInterface;
 };
 
+void SatelliteEvictionOperation::startImpl()
+{
+    // Deactivate running applications first, so they get a chance to stop gracefully. Anything else (starting
+    // ones included) can't be deactivated, and goes down with the satellite.
+    QList< Hemera::Operation* > deactivateOperations;
+    for (const QString &app : m_handler->applicationsForSatellite(m_orbit)) {
+        Application *a = m_handler->livingApplications().value(app);
+        if (!a || a->status() != Hemera::Application::Running) {
+            continue;
+        }
+
+        deactivateOperations << m_handler->setActive(a, false);
+    }
+
+    if (deactivateOperations.isEmpty()) {
+        shutdownSatellite();
+        return;
+    }
+
+    connect(new Hemera::CompositeOperation(deactivateOperations, this), &Hemera::Operation::finished, this, [this] (Hemera::Operation *op) {
+        if (op->isError()) {
+            // Go on anyway: we need the memory back, and the orbit is going down regardless.
+            qWarning() << "Could not deactivate satellite" << m_orbit << "before eviction:" << op->errorMessage();
+        }
+
+        shutdownSatellite();
+    });
+}
+
+void SatelliteEvictionOperation::shutdownSatellite()
+{
+    // The link to Gravity Center might have changed since we started: always go through the current one.
+    connect(new Hemera::DBusVoidOperation(m_handler->d->satelliteManagerInterface->ShutdownSatellite(m_orbit), this), &Hemera::Operation::finished,
+            this, [this] (Hemera::Operation *op) {
+        if (op->isError()) {
+            setFinishedWithError(op->errorName(), op->errorMessage());
+        } else {
+            setFinished();
+        }
+    });
+}
+
+QString ApplicationHandler::Private::satelliteForApplication(const QString &application) const
+{
+    for (const QString &satellite : satellites) {
+        if (serviceManager->applicationsForService(serviceManager->findServiceById(satellite)).contains(application)) {
+            return satellite;
+        }
+    }
+
+    return QString();
+}
+
+void ApplicationHandler::Private::recordLatency(const QString &application, Application::LifecycleStage stage, qint64 msecs)
+{
+    QString stageName = lifecycleStageName(stage);
+    applicationLatencies[application][stageName].record(msecs);
+    aggregateLatencies[stageName].record(msecs);
+
+    if (msecs > 5000) {
+        qWarning() << "Application" << application << "took" << msecs << "ms to complete its" << stageName << "stage";
+    }
+}
+
 ApplicationHandler::ApplicationHandler(const QString &starName, const QDBusConnection& connection, QObject* parent)
     : AsyncInitDBusObject(parent)
     , d(new Private(connection))
@@ -78,17 +228,7 @@ void ApplicationHandler::initImpl()
     }
 
     // Create connection to the Satellite Manager
-    QString satelliteManagerPath = QString::fromLatin1(Hemera::Literals::DBus::satelliteManagerPath()).arg(d->star);
-    d->satelliteManagerInterface = new com::ispirata::Hemera::Gravity::SatelliteManager(Hemera::Literals::literal(Hemera::Literals::DBus::gravityCenterService()),
-                                                                                        satelliteManagerPath, QDBusConnection::systemBus(), this);
-    if (!d->satelliteManagerInterface->isValid()) {
-        setInitError(Hemera::Literals::literal(Hemera::Literals::Errors::interfaceNotAvailable()),
-                     QStringLiteral("The remote Satellite Manager is not available. The daemon is probably not running."));
-        return;
-    }
-    d->satelliteManagerObjectInterface = new com::ispirata::Hemera::DBusObject(Hemera::Literals::literal(Hemera::Literals::DBus::gravityCenterService()),
-                                                                               satelliteManagerPath, QDBusConnection::systemBus(), this);
-    if (!d->satelliteManagerObjectInterface->isValid()) {
+    if (!setupSatelliteManagerInterfaces()) {
         setInitError(Hemera::Literals::literal(Hemera::Literals::Errors::interfaceNotAvailable()),
                      QStringLiteral("The remote Satellite Manager is not available. The daemon is probably not running."));
         return;
@@ -115,22 +255,6 @@ void ApplicationHandler::initImpl()
         setOnePartIsReady();
     });
 
-    connect(d->satelliteManagerObjectInterface, &com::ispirata::Hemera::DBusObject::propertiesChanged, [this] (const QVariantMap &changed) {
-        if (changed.contains(QStringLiteral("ActiveSatellites"))) {
-                d->activeSatellites = changed.value(QStringLiteral("ActiveSatellites")).toStringList();
-                Q_EMIT activeSatellitesChanged();
-            }
-            if (changed.contains(QStringLiteral("LaunchedSatellites"))) {
-                d->satellites = changed.value(QStringLiteral("LaunchedSatellites")).toStringList();
-                // Update list of applications as satellites
-                d->applicationsInSatellites.clear();
-                for (const QString & satellite : d->satellites) {
-                    d->applicationsInSatellites << d->serviceManager->applicationsForService(d->serviceManager->findServiceById(satellite));
-                }
-                Q_EMIT launchedSatellitesChanged();
-            }
-    });
-
     d->serviceManager = new Hemera::ServiceManager(this);
     connect(d->serviceManager->init(), &Hemera::Operation::finished, [this] (Hemera::Operation *op) {
         if (op->isError()) {
@@ -186,6 +310,12 @@ Hemera::Operation *ApplicationHandler::setActive(Application *application, bool
             if (active) {
                 // All fine. Activate!
                 Hemera::Operation *op = application->start();
+                if (application->isSatellite()) {
+                    QString satellite = d->satelliteForApplication(application->id());
+                    if (!satellite.isEmpty()) {
+                        d->satelliteLastActivation.insert(satellite, QDateTime::currentMSecsSinceEpoch());
+                    }
+                }
                 // Do we need to take some action, too?
                 if (application->isSatellite() && d->activationPolicies & Hemera::Planet::ActivationPolicy::KeepAtMostOneActive) {
                     // Each active application needs to be stopped.
@@ -275,16 +405,36 @@ Hemera::Operation *ApplicationHandler::registerApplication(const QString& servic
     // Verify if it is a satellite
     bool isSatellite = d->applicationsInSatellites.contains(service);
 
+    QElapsedTimer registrationTimer;
+    registrationTimer.start();
+
     Application *application = new Application(service, isSatellite, d->dbus, this);
     Hemera::Operation *op = application->init();
-    connect(op, &Hemera::Operation::finished, [this, service, application, op] {
+    connect(op, &Hemera::Operation::finished, [this, service, application, op, registrationTimer] {
         if (op->isError()) {
+            ++d->failedRegistrations;
             qWarning() << "The DBus service" << service << "asked to register an application, but the"
                        << "initialization of DBus communications failed! This is either a bug in the SDK or an hijacking attempt.";
             qWarning() << "The error reported was: " << op->errorName() << op->errorMessage();
             return;
         }
 
+        d->recordLatency(service, Application::LifecycleStage::Registration, registrationTimer.elapsed());
+
+        // Find out how long it took from the process creation
+        qint64 registeredAt = msecsSinceBoot();
+        Hemera::DBusUIntOperation *pidOp = new Hemera::DBusUIntOperation(d->fdoDBus->GetConnectionUnixProcessID(service), this);
+        connect(pidOp, &Hemera::Operation::finished, this, [this, service, pidOp, registeredAt] {
+            qint64 startedAt = pidOp->isError() ? -1 : processStartTime(pidOp->result());
+            if (startedAt >= 0) {
+                d->recordLatency(service, Application::LifecycleStage::Launch, registeredAt - startedAt);
+            }
+        });
+
+        connect(application, &Application::lifecycleStageCompleted, this, [this, service] (Application::LifecycleStage stage, qint64 msecs) {
+            d->recordLatency(service, stage, msecs);
+        });
+
         d->livingApplications.insert(service, application);
         Q_EMIT applicationRegistered(service, application);
 
@@ -499,4 +649,128 @@ QStringList ApplicationHandler::launchedSatellites() const
     return d->satellites;
 }
 
+QStringList ApplicationHandler::applicationsForSatellite(const QString &orbit) const
+{
+    if (!d->satellites.contains(orbit)) {
+        return QStringList();
+    }
+
+    return d->serviceManager->applicationsForService(d->serviceManager->findServiceById(orbit));
+}
+
+QStringList ApplicationHandler::satellitesByActivation() const
+{
+    // Least recently activated first.
+    QStringList result = d->satellites;
+    std::stable_sort(result.begin(), result.end(), [this] (const QString &a, const QString &b) {
+        return d->satelliteLastActivation.value(a) < d->satelliteLastActivation.value(b);
+    });
+
+    return result;
+}
+
+QVariantMap ApplicationHandler::lifecycleMetrics() const
+{
+    QVariantMap aggregate;
+    for (QHash< QString, LatencyHistogram >::const_iterator i = d->aggregateLatencies.constBegin(); i != d->aggregateLatencies.constEnd(); ++i) {
+        aggregate.insert(i.key(), i.value().toVariantMap());
+    }
+
+    QVariantMap applications;
+    for (QHash< QString, QHash< QString, LatencyHistogram > >::const_iterator i = d->applicationLatencies.constBegin();
+         i != d->applicationLatencies.constEnd(); ++i) {
+        QVariantMap stages;
+        for (QHash< QString, LatencyHistogram >::const_iterator j = i.value().constBegin(); j != i.value().constEnd(); ++j) {
+            stages.insert(j.key(), j.value().toVariantMap());
+        }
+        applications.insert(i.key(), stages);
+    }
+
+    QVariantMap result;
+    result.insert(QStringLiteral("histogramBounds"), LatencyHistogram::bounds());
+    result.insert(QStringLiteral("failedRegistrations"), d->failedRegistrations);
+    result.insert(QStringLiteral("aggregate"), aggregate);
+    result.insert(QStringLiteral("applications"), applications);
+    return result;
+}
+
+bool ApplicationHandler::setupSatelliteManagerInterfaces()
+{
+    // Prefer the private link to Gravity Center, if Parsec established it.
+    QDBusConnection gravityCenterConnection(QStringLiteral("gravitycenter"));
+    QString gravityCenterService;
+    if (!gravityCenterConnection.isConnected()) {
+        gravityCenterConnection = QDBusConnection::systemBus();
+        gravityCenterService = Hemera::Literals::literal(Hemera::Literals::DBus::gravityCenterService());
+    }
+
+    if (d->satelliteManagerInterface) {
+        d->satelliteManagerInterface->deleteLater();
+        d->satelliteManagerObjectInterface->deleteLater();
+    }
+
+    QString satelliteManagerPath = QString::fromLatin1(Hemera::Literals::DBus::satelliteManagerPath()).arg(d->star);
+    d->satelliteManagerInterface = new com::ispirata::Hemera::Gravity::SatelliteManager(gravityCenterService, satelliteManagerPath,
+                                                                                        gravityCenterConnection, this);
+    d->satelliteManagerObjectInterface = new com::ispirata::Hemera::DBusObject(gravityCenterService, satelliteManagerPath, gravityCenterConnection, this);
+
+    connect(d->satelliteManagerObjectInterface, &com::ispirata::Hemera::DBusObject::propertiesChanged,
+            this, &ApplicationHandler::updateSatelliteManagerProperties);
+
+    return d->satelliteManagerInterface->isValid() && d->satelliteManagerObjectInterface->isValid();
+}
+
+void ApplicationHandler::updateSatelliteManagerProperties(const QVariantMap &changed)
+{
+    if (changed.contains(QStringLiteral("ActiveSatellites"))) {
+        d->activeSatellites = changed.value(QStringLiteral("ActiveSatellites")).toStringList();
+        Q_EMIT activeSatellitesChanged();
+    }
+    if (changed.contains(QStringLiteral("LaunchedSatellites"))) {
+        d->satellites = changed.value(QStringLiteral("LaunchedSatellites")).toStringList();
+        // Update list of applications as satellites
+        d->applicationsInSatellites.clear();
+        for (const QString & satellite : d->satellites) {
+            d->applicationsInSatellites << d->serviceManager->applicationsForService(d->serviceManager->findServiceById(satellite));
+            if (!d->satelliteLastActivation.contains(satellite)) {
+                d->satelliteLastActivation.insert(satellite, QDateTime::currentMSecsSinceEpoch());
+            }
+        }
+        for (const QString &satellite : d->satelliteLastActivation.keys()) {
+            if (!d->satellites.contains(satellite)) {
+                d->satelliteLastActivation.remove(satellite);
+            }
+        }
+        Q_EMIT launchedSatellitesChanged();
+    }
+}
+
+void ApplicationHandler::reconnectToGravityCenter()
+{
+    if (!setupSatelliteManagerInterfaces()) {
+        qWarning() << "The remote Satellite Manager is not available after reconnecting to Gravity Center";
+        return;
+    }
+
+    // Catch up with whatever happened while we were not listening
+    Hemera::DBusVariantMapOperation *operation = new Hemera::DBusVariantMapOperation(d->satelliteManagerObjectInterface->allProperties(), this);
+    connect(operation, &Hemera::Operation::finished, this, [this, operation] {
+        if (!operation->isError()) {
+            updateSatelliteManagerProperties(operation->result());
+        }
+    });
 }
+
+Hemera::Operation *ApplicationHandler::evictSatellite(const QString &orbit)
+{
+    if (!d->satellites.contains(orbit)) {
+        return new Hemera::FailureOperation(Hemera::Literals::literal(Hemera::Literals::Errors::notFound()),
+                                            QStringLiteral("Satellite %1 has not been launched!").arg(orbit));
+    }
+
+    return new SatelliteEvictionOperation(orbit, this);
+}
+
+}
+
+#include "gravityapplicationhandler.moc"
@@ -12,6 +12,7 @@
 namespace Gravity {
 
 class Application;
+class SatelliteEvictionOperation;
 
 class ApplicationHandler : public Hemera::AsyncInitDBusObject
 {
@@ -35,6 +36,16 @@ public:
     QStringList launchedSatellites() const;
     uint activationPolicies() const;
 
+    QStringList applicationsForSatellite(const QString &orbit) const;
+    QStringList satellitesByActivation() const;
+
+    QVariantMap lifecycleMetrics() const;
+
+    Hemera::Operation *evictSatellite(const QString &orbit);
+
+    /// Moves to the current link to Gravity Center: the "gravitycenter" peer connection if it is up, the system bus otherwise.
+    void reconnectToGravityCenter();
+
 public Q_SLOTS:
     Hemera::Operation *setActive(Application *application, bool active);
     Hemera::Operation *registerApplication(const QString &service);
@@ -61,8 +72,13 @@ Q_SIGNALS:
     void activationPoliciesChanged();
 
 private:
+    bool setupSatelliteManagerInterfaces();
+    void updateSatelliteManagerProperties(const QVariantMap &changed);
+
     class Private;
     Private * const d;
+
+    friend class SatelliteEvictionOperation;
 };
 
 }
@@ -0,0 +1,47 @@
+#include "gravityblockprobe_p.h"
+
+#include <QtCore/QDebug>
+
+#include <blkid.h>
+
+namespace Gravity
+{
+
+BlockProbe::Info BlockProbe::probe(const QByteArray &deviceNode)
+{
+    Info info;
+
+    blkid_probe probe = blkid_new_probe_from_filename(deviceNode.constData());
+    if (!probe) {
+        qDebug() << "Could not open" << deviceNode << "for probing";
+        return info;
+    }
+
+    blkid_probe_enable_superblocks(probe, 1);
+    blkid_probe_set_superblocks_flags(probe, BLKID_SUBLKS_TYPE | BLKID_SUBLKS_USAGE | BLKID_SUBLKS_LABEL | BLKID_SUBLKS_UUID);
+    // We only care about the filesystem, not about what is around it.
+    blkid_probe_enable_partitions(probe, 0);
+
+    // 0 means found, 1 nothing found, -2 ambiguous, -1 error. Ambiguous devices are not safe to mount.
+    if (blkid_do_safeprobe(probe) == 0) {
+        auto lookup = [probe] (const char *name) -> QString {
+            const char *value = Q_NULLPTR;
+            if (blkid_probe_lookup_value(probe, name, &value, Q_NULLPTR) == 0 && value) {
+                return QString::fromUtf8(value);
+            }
+            return QString();
+        };
+
+        info.valid = true;
+        info.filesystem = lookup("TYPE");
+        info.usage = lookup("USAGE");
+        info.label = lookup("LABEL");
+        info.uuid = lookup("UUID");
+        info.size = blkid_probe_get_size(probe);
+    }
+
+    blkid_free_probe(probe);
+    return info;
+}
+
+}
@@ -0,0 +1,34 @@
+#ifndef GRAVITY_BLOCKPROBE_P_H
+#define GRAVITY_BLOCKPROBE_P_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QString>
+
+namespace Gravity
+{
+
+/**
+ * Reads filesystem metadata straight from a block device through libblkid.
+ *
+ * Probing reads a few sectors from the device: it is fast, but it is I/O nonetheless.
+ */
+class BlockProbe
+{
+public:
+    struct Info {
+        Info() : valid(false), size(0) {}
+
+        bool valid;
+        QString filesystem;
+        QString usage;
+        QString label;
+        QString uuid;
+        qint64 size;
+    };
+
+    static Info probe(const QByteArray &deviceNode);
+};
+
+}
+
+#endif // GRAVITY_BLOCKPROBE_P_H
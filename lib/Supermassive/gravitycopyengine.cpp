@@ -0,0 +1,453 @@
+#include "gravitycopyengine_p.h"
+
+#include <HemeraCore/Literals>
+#include <HemeraCore/RemovableStorage>
+
+#include <QtCore/QDebug>
+#include <QtCore/QFile>
+#include <QtCore/QList>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/fsuid.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+namespace Gravity
+{
+
+namespace {
+
+// setfsuid(2) and setfsgid(2) only affect the calling thread: the rest of Gravity keeps running as root.
+class FilesystemCredentials
+{
+public:
+    FilesystemCredentials(uid_t uid, gid_t gid)
+        : m_gid(::setfsgid(gid)), m_uid(::setfsuid(uid)) {}
+    ~FilesystemCredentials() {
+        ::setfsuid(m_uid);
+        ::setfsgid(m_gid);
+    }
+
+private:
+    int m_gid;
+    int m_uid;
+};
+
+// Opens a directory below dirFd one component at a time. Symlinks and ".." are refused at every step.
+int openDirectoryBeneath(int dirFd, const QByteArray &path)
+{
+    int fd = ::fcntl(dirFd, F_DUPFD_CLOEXEC, 0);
+    for (const QByteArray &component : path.split('/')) {
+        if (fd < 0) {
+            return -1;
+        }
+        if (component.isEmpty() || component == ".") {
+            continue;
+        }
+        if (component == "..") {
+            ::close(fd);
+            errno = EPERM;
+            return -1;
+        }
+
+        int next = ::openat(fd, component.constData(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int error = errno;
+        ::close(fd);
+        errno = error;
+        fd = next;
+    }
+
+    return fd;
+}
+
+// Opens an entry of dirFd only if it is still the regular file or directory we expect.
+int openEntry(int dirFd, const QByteArray &name, mode_t type, struct stat *entryStat)
+{
+    int fd = ::openat(dirFd, name.constData(), O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int error = 0;
+    if (::fstat(fd, entryStat) < 0) {
+        error = errno;
+    } else if ((entryStat->st_mode & S_IFMT) != type) {
+        error = EPERM;
+    }
+
+    if (error) {
+        ::close(fd);
+        errno = error;
+        return -1;
+    }
+
+    return fd;
+}
+
+// Creates a directory below dirFd owned by the requesting user, or opens it if it is already there.
+int makeDirectory(int dirFd, const QByteArray &name, mode_t mode, uid_t uid, gid_t gid)
+{
+    bool created = ::mkdirat(dirFd, name.constData(), mode | S_IRWXU) == 0;
+    if (!created && errno != EEXIST) {
+        return -1;
+    }
+
+    int fd = ::openat(dirFd, name.constData(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd >= 0 && created) {
+        // Best effort: filesystems without ownership (vfat & co.) have it fixed at mount time.
+        Q_UNUSED(::fchown(fd, uid, gid));
+    }
+    return fd;
+}
+
+QString childPath(const QString &path, const char *name)
+{
+    return QStringLiteral("%1/%2").arg(path, QFile::decodeName(name));
+}
+
+}
+
+CopyEngine::Result CopyEngine::errorResult(int error, const QString &path)
+{
+    Result result;
+    result.error = error;
+    result.errorMessage = QStringLiteral("%1: %2").arg(path, QString::fromLocal8Bit(strerror(error)));
+
+    switch (error) {
+        case ECANCELED:
+            result.errorName = QLatin1String(Hemera::Literals::Errors::canceled());
+            break;
+        case ENOENT:
+            result.errorName = QLatin1String(Hemera::Literals::Errors::notFound());
+            break;
+        case EROFS:
+        case ENOSPC:
+            result.errorName = Hemera::RemovableStorage::Errors::notWriteable();
+            break;
+        case EPERM:
+        case EACCES:
+            result.errorName = QLatin1String(Hemera::Literals::Errors::notAllowed());
+            break;
+        default:
+            result.errorName = QLatin1String(Hemera::Literals::Errors::failedRequest());
+            break;
+    }
+
+    return result;
+}
+
+CopyEngine::Result CopyEngine::copyFile(Job *job, int sourceFd, int destinationDirectoryFd, const QByteArray &name,
+                                        const QString &sourcePath, const QString &destinationPath)
+{
+    struct stat sourceStat;
+    if (::fstat(sourceFd, &sourceStat) < 0) {
+        int error = errno;
+        ::close(sourceFd);
+        return errorResult(error, sourcePath);
+    }
+
+    int destinationFd = ::openat(destinationDirectoryFd, name.constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW,
+                                 sourceStat.st_mode & 0777);
+    if (destinationFd < 0) {
+        int error = errno;
+        ::close(sourceFd);
+        return errorResult(error, destinationPath);
+    }
+
+    // Best effort, as for directories.
+    Q_UNUSED(::fchown(destinationFd, job->uid, job->gid));
+
+    // We read each block exactly once: tell the kernel to read ahead aggressively.
+    ::posix_fadvise(sourceFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    enum class Method { CopyFileRange, SendFile, ReadWrite };
+#ifdef SYS_copy_file_range
+    Method method = Method::CopyFileRange;
+#else
+    Method method = Method::SendFile;
+#endif
+    QByteArray buffer;
+
+    int error = 0;
+    qint64 remaining = sourceStat.st_size;
+    while (remaining > 0) {
+        if (job->cancelled.load()) {
+            error = ECANCELED;
+            break;
+        }
+
+        size_t chunk = static_cast< size_t >(qMin(remaining, job->blockSize));
+        ssize_t copied = -1;
+
+        switch (method) {
+            case Method::CopyFileRange:
+#ifdef SYS_copy_file_range
+                copied = syscall(SYS_copy_file_range, sourceFd, Q_NULLPTR, destinationFd, Q_NULLPTR, chunk, 0);
+                if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                    // Different filesystems, or an old kernel
+                    method = Method::SendFile;
+                    continue;
+                }
+#endif
+                break;
+            case Method::SendFile:
+                copied = ::sendfile(destinationFd, sourceFd, Q_NULLPTR, chunk);
+                if (copied < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                    method = Method::ReadWrite;
+                    continue;
+                }
+                break;
+            case Method::ReadWrite:
+                buffer.resize(static_cast< int >(chunk));
+                copied = ::read(sourceFd, buffer.data(), chunk);
+                if (copied > 0) {
+                    ssize_t written = 0;
+                    while (written < copied) {
+                        ssize_t ret = ::write(destinationFd, buffer.constData() + written, copied - written);
+                        if (ret < 0 && errno != EINTR) {
+                            copied = -1;
+                            break;
+                        }
+                        written += qMax(ret, static_cast< ssize_t >(0));
+                    }
+                }
+                break;
+        }
+
+        if (copied < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error = errno;
+            break;
+        } else if (copied == 0) {
+            // The file shrunk under our feet
+            break;
+        }
+
+        remaining -= copied;
+        job->bytesCopied.fetchAndAddRelaxed(copied);
+    }
+
+    // Whatever we copied is not going to be read again anytime soon, keep it out of the page cache.
+    ::posix_fadvise(sourceFd, 0, 0, POSIX_FADV_DONTNEED);
+    if (!error && ::fdatasync(destinationFd) == 0) {
+        ::posix_fadvise(destinationFd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+    ::close(sourceFd);
+    if (::close(destinationFd) < 0 && !error) {
+        error = errno;
+    }
+
+    if (error) {
+        // Don't leave half copied files around
+        ::unlinkat(destinationDirectoryFd, name.constData(), 0);
+        return errorResult(error, error == ECANCELED ? sourcePath : destinationPath);
+    }
+
+    job->filesCopied.fetchAndAddRelaxed(1);
+    return Result();
+}
+
+CopyEngine::Result CopyEngine::scanTree(Job *job, int directoryFd, const QString &path, qint64 *totalBytes, int *totalFiles)
+{
+    DIR *dir = ::fdopendir(::fcntl(directoryFd, F_DUPFD_CLOEXEC, 0));
+    if (!dir) {
+        return errorResult(errno, path);
+    }
+    // The duplicate shares its offset with the original descriptor
+    ::rewinddir(dir);
+
+    Result result;
+    while (struct dirent *entry = ::readdir(dir)) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+        if (job->cancelled.load()) {
+            result = errorResult(ECANCELED, path);
+            break;
+        }
+
+        struct stat entryStat;
+        if (::fstatat(directoryFd, entry->d_name, &entryStat, AT_SYMLINK_NOFOLLOW) < 0) {
+            result = errorResult(errno, childPath(path, entry->d_name));
+            break;
+        }
+
+        if (S_ISREG(entryStat.st_mode)) {
+            *totalBytes += entryStat.st_size;
+            ++*totalFiles;
+        } else if (S_ISDIR(entryStat.st_mode)) {
+            int childFd = ::openat(directoryFd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (childFd < 0) {
+                result = errorResult(errno, childPath(path, entry->d_name));
+                break;
+            }
+            result = scanTree(job, childFd, childPath(path, entry->d_name), totalBytes, totalFiles);
+            ::close(childFd);
+            if (result.isError()) {
+                break;
+            }
+        } else {
+            qDebug() << "Skipping" << childPath(path, entry->d_name) << "while copying: not a regular file";
+        }
+    }
+
+    ::closedir(dir);
+    return result;
+}
+
+CopyEngine::Result CopyEngine::copyTree(Job *job, int sourceFd, int destinationFd, const QString &sourcePath, const QString &destinationPath)
+{
+    DIR *dir = ::fdopendir(::fcntl(sourceFd, F_DUPFD_CLOEXEC, 0));
+    if (!dir) {
+        return errorResult(errno, sourcePath);
+    }
+    // The duplicate shares its offset with the original descriptor
+    ::rewinddir(dir);
+
+    Result result;
+    while (struct dirent *entry = ::readdir(dir)) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+        if (job->cancelled.load()) {
+            result = errorResult(ECANCELED, sourcePath);
+            break;
+        }
+
+        QByteArray name(entry->d_name);
+        QString childSourcePath = childPath(sourcePath, entry->d_name);
+        QString childDestinationPath = childPath(destinationPath, entry->d_name);
+
+        struct stat entryStat;
+        if (::fstatat(sourceFd, name.constData(), &entryStat, AT_SYMLINK_NOFOLLOW) < 0) {
+            result = errorResult(errno, childSourcePath);
+            break;
+        }
+
+        if (S_ISREG(entryStat.st_mode)) {
+            int childFd = openEntry(sourceFd, name, S_IFREG, &entryStat);
+            if (childFd < 0) {
+                result = errorResult(errno, childSourcePath);
+                break;
+            }
+            result = copyFile(job, childFd, destinationFd, name, childSourcePath, childDestinationPath);
+        } else if (S_ISDIR(entryStat.st_mode)) {
+            int childSourceFd = openEntry(sourceFd, name, S_IFDIR, &entryStat);
+            if (childSourceFd < 0) {
+                result = errorResult(errno, childSourcePath);
+                break;
+            }
+            int childDestinationFd = makeDirectory(destinationFd, name, entryStat.st_mode & 0777, job->uid, job->gid);
+            if (childDestinationFd < 0) {
+                result = errorResult(errno, childDestinationPath);
+                ::close(childSourceFd);
+                break;
+            }
+            result = copyTree(job, childSourceFd, childDestinationFd, childSourcePath, childDestinationPath);
+            ::close(childDestinationFd);
+            ::close(childSourceFd);
+        }
+
+        if (result.isError()) {
+            break;
+        }
+    }
+
+    ::closedir(dir);
+    return result;
+}
+
+CopyEngine::Result CopyEngine::copy(Job *job)
+{
+    // The roots have been verified by whoever queued the job: open them with our own credentials...
+    int sourceRootFd = ::open(QFile::encodeName(job->sourceRoot).constData(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (sourceRootFd < 0) {
+        return errorResult(errno, job->sourceRoot);
+    }
+    int destinationRootFd = ::open(QFile::encodeName(job->destinationRoot).constData(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (destinationRootFd < 0) {
+        int error = errno;
+        ::close(sourceRootFd);
+        return errorResult(error, job->destinationRoot);
+    }
+
+    // ...and everything below them with the ones of the user who asked for the copy.
+    FilesystemCredentials credentials(job->uid, job->gid);
+
+    QString sourcePath = job->source.isEmpty() ? job->sourceRoot : QStringLiteral("%1/%2").arg(job->sourceRoot, job->source);
+    QString destinationPath = QStringLiteral("%1/%2").arg(job->destinationRoot, job->destination);
+    QByteArray source = QFile::encodeName(job->source);
+    QByteArray destination = QFile::encodeName(job->destination);
+
+    Result result;
+    int sourceFd = -1;
+    int sourceParentFd = -1;
+    int destinationParentFd = -1;
+    struct stat sourceStat;
+
+    int slash = destination.lastIndexOf('/');
+    QByteArray destinationName = destination.mid(slash + 1);
+    destinationParentFd = openDirectoryBeneath(destinationRootFd, destination.left(qMax(slash, 0)));
+    if (destinationParentFd < 0) {
+        result = errorResult(errno, destinationPath);
+    } else if (source.isEmpty()) {
+        sourceFd = ::fcntl(sourceRootFd, F_DUPFD_CLOEXEC, 0);
+        ::fstat(sourceFd, &sourceStat);
+    } else {
+        slash = source.lastIndexOf('/');
+        sourceParentFd = openDirectoryBeneath(sourceRootFd, source.left(qMax(slash, 0)));
+        if (sourceParentFd >= 0 && ::fstatat(sourceParentFd, source.mid(slash + 1).constData(), &sourceStat, AT_SYMLINK_NOFOLLOW) == 0) {
+            sourceFd = openEntry(sourceParentFd, source.mid(slash + 1), sourceStat.st_mode & S_IFMT, &sourceStat);
+        }
+        if (sourceFd < 0) {
+            result = errorResult(errno == ELOOP ? ENOENT : errno, sourcePath);
+        }
+    }
+
+    if (result.isError()) {
+        // Nothing to do
+    } else if (S_ISREG(sourceStat.st_mode)) {
+        job->totalFiles.store(1);
+        job->totalBytes.store(sourceStat.st_size);
+        result = copyFile(job, sourceFd, destinationParentFd, destinationName, sourcePath, destinationPath);
+        sourceFd = -1;
+    } else if (!S_ISDIR(sourceStat.st_mode)) {
+        result = errorResult(EPERM, sourcePath);
+    } else {
+        // Scan first: it is cheap, and gives meaningful progress.
+        qint64 totalBytes = 0;
+        int totalFiles = 0;
+        result = scanTree(job, sourceFd, sourcePath, &totalBytes, &totalFiles);
+        if (!result.isError()) {
+            job->totalFiles.store(totalFiles);
+            job->totalBytes.store(totalBytes);
+
+            int destinationFd = makeDirectory(destinationParentFd, destinationName, sourceStat.st_mode & 0777, job->uid, job->gid);
+            if (destinationFd < 0) {
+                result = errorResult(errno, destinationPath);
+            } else {
+                result = copyTree(job, sourceFd, destinationFd, sourcePath, destinationPath);
+                ::close(destinationFd);
+            }
+        }
+    }
+
+    for (int fd : { sourceFd, sourceParentFd, destinationParentFd, sourceRootFd, destinationRootFd }) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    return result;
+}
+
+}
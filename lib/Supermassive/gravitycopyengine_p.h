@@ -0,0 +1,71 @@
+#ifndef GRAVITY_COPYENGINE_P_H
+#define GRAVITY_COPYENGINE_P_H
+
+#include <QtCore/QAtomicInteger>
+#include <QtCore/QString>
+
+#include <sys/types.h>
+
+namespace Gravity
+{
+
+/**
+ * Copies files and directory trees keeping the data in the kernel whenever possible.
+ *
+ * copy_file_range(2) is tried first, then sendfile(2), and a plain read/write loop only as a last resort.
+ * Symbolic links and special files are never copied: removable media are not trusted.
+ *
+ * Paths are given relative to two roots which the caller has already verified. Everything below them is opened one
+ * component at a time with openat(2) and O_NOFOLLOW, so swapping a directory for a symlink midway can't take the copy
+ * anywhere else. The worker thread also switches its filesystem credentials to the requesting user, so the kernel
+ * checks every access as it would for that user, and whatever gets created belongs to them.
+ *
+ * copy() blocks until the whole tree has been copied: never invoke it from the main thread.
+ */
+class CopyEngine
+{
+public:
+    struct Result {
+        Result() : error(0) {}
+
+        inline bool isError() const { return error != 0; }
+
+        int error;
+        QString errorName;
+        QString errorMessage;
+    };
+
+    /// Shared between the worker and whoever is watching it. Counters can be read at any time.
+    struct Job {
+        Job() : uid(0), gid(0), blockSize(4 * 1024 * 1024), bytesCopied(0), totalBytes(0), filesCopied(0), totalFiles(0), cancelled(0) {}
+
+        /// Canonical directories, opened before dropping privileges
+        QString sourceRoot;
+        QString destinationRoot;
+        /// Relative to their roots. An empty source is the source root itself.
+        QString source;
+        QString destination;
+        uid_t uid;
+        gid_t gid;
+        qint64 blockSize;
+
+        QAtomicInteger< qint64 > bytesCopied;
+        QAtomicInteger< qint64 > totalBytes;
+        QAtomicInt filesCopied;
+        QAtomicInt totalFiles;
+        QAtomicInt cancelled;
+    };
+
+    static Result copy(Job *job);
+
+private:
+    static Result scanTree(Job *job, int directoryFd, const QString &path, qint64 *totalBytes, int *totalFiles);
+    static Result copyTree(Job *job, int sourceFd, int destinationFd, const QString &sourcePath, const QString &destinationPath);
+    static Result copyFile(Job *job, int sourceFd, int destinationDirectoryFd, const QByteArray &name,
+                           const QString &sourcePath, const QString &destinationPath);
+    static Result errorResult(int error, const QString &path);
+};
+
+}
+
+#endif // GRAVITY_COPYENGINE_P_H
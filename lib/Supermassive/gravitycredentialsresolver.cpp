@@ -0,0 +1,199 @@
+#include "gravitycredentialsresolver.h"
+
+#include <HemeraCore/Literals>
+
+#include <QtCore/QDebug>
+#include <QtCore/QFile>
+#include <QtCore/QFileSystemWatcher>
+#include <QtCore/QHash>
+#include <QtCore/QVarLengthArray>
+
+#include <QtDBus/QDBusPendingCallWatcher>
+#include <QtDBus/QDBusPendingReply>
+
+#include <errno.h>
+#include <pwd.h>
+#include <sys/types.h>
+
+#include "fdodbusinterface.h"
+
+#define PASSWD_PATH "/etc/passwd"
+#define PASSWD_DIR "/etc"
+
+namespace Gravity
+{
+
+class CredentialsResolver::Private
+{
+public:
+    Private(CredentialsResolver *q) : q(q) {}
+
+    CredentialsResolver *q;
+
+    org::freedesktop::DBus *fdoDBus;
+    QFileSystemWatcher *passwdWatcher;
+
+    // Bus name -> uid, until the name changes owner
+    QHash< QString, uint > uids;
+    // uid -> user name, until the user database changes
+    QHash< uint, QString > userNames;
+
+    void watchPasswd();
+};
+
+void CredentialsResolver::Private::watchPasswd()
+{
+    // passwd is usually replaced rather than written: the watch on the file goes away with it.
+    if (!passwdWatcher->files().contains(QStringLiteral(PASSWD_PATH)) && QFile::exists(QStringLiteral(PASSWD_PATH))) {
+        passwdWatcher->addPath(QStringLiteral(PASSWD_PATH));
+    }
+}
+
+class CredentialsOperation::Private
+{
+public:
+    Private() : uid(0) {}
+
+    CredentialsResolver *resolver;
+    QString service;
+    uint uid;
+    QString userName;
+};
+
+CredentialsOperation::CredentialsOperation(const QString &service, CredentialsResolver *parent)
+    : Operation(parent)
+    , d(new Private)
+{
+    d->resolver = parent;
+    d->service = service;
+}
+
+CredentialsOperation::~CredentialsOperation()
+{
+    delete d;
+}
+
+uint CredentialsOperation::uid() const
+{
+    return d->uid;
+}
+
+QString CredentialsOperation::userName() const
+{
+    return d->userName;
+}
+
+void CredentialsOperation::startImpl()
+{
+    QHash< QString, uint >::const_iterator cached = d->resolver->d->uids.constFind(d->service);
+    if (cached != d->resolver->d->uids.constEnd()) {
+        d->uid = cached.value();
+        d->userName = d->resolver->userName(d->uid);
+        setFinished();
+        return;
+    }
+
+    auto onUid = [this] (uint uid) {
+        d->resolver->d->uids.insert(d->service, uid);
+        d->uid = uid;
+        d->userName = d->resolver->userName(uid);
+        setFinished();
+    };
+
+    QDBusPendingCallWatcher *watcher = new QDBusPendingCallWatcher(d->resolver->d->fdoDBus->GetConnectionCredentials(d->service), this);
+    connect(watcher, &QDBusPendingCallWatcher::finished, this, [this, watcher, onUid] {
+        QDBusPendingReply< QVariantMap > reply = *watcher;
+        watcher->deleteLater();
+
+        if (!reply.isError()) {
+            onUid(reply.value().value(QStringLiteral("UnixUserID")).toUInt());
+            return;
+        }
+
+        if (reply.error().type() != QDBusError::UnknownMethod) {
+            setFinishedWithError(reply.error().name(), reply.error().message());
+            return;
+        }
+
+        // The bus predates GetConnectionCredentials
+        QDBusPendingCallWatcher *uidWatcher = new QDBusPendingCallWatcher(d->resolver->d->fdoDBus->GetConnectionUnixUser(d->service), this);
+        connect(uidWatcher, &QDBusPendingCallWatcher::finished, this, [this, uidWatcher, onUid] {
+            QDBusPendingReply< uint > uidReply = *uidWatcher;
+            uidWatcher->deleteLater();
+
+            if (uidReply.isError()) {
+                setFinishedWithError(uidReply.error().name(), uidReply.error().message());
+                return;
+            }
+
+            onUid(uidReply.value());
+        });
+    });
+}
+
+CredentialsResolver::CredentialsResolver(const QDBusConnection &connection, QObject *parent)
+    : QObject(parent)
+    , d(new Private(this))
+{
+    d->fdoDBus = new org::freedesktop::DBus(QStringLiteral("org.freedesktop.DBus"), QStringLiteral("/org/freedesktop/DBus"), connection, this);
+    connect(d->fdoDBus, &org::freedesktop::DBus::NameOwnerChanged, this, [this] (const QString &name) {
+        d->uids.remove(name);
+    });
+
+    d->passwdWatcher = new QFileSystemWatcher(this);
+    d->passwdWatcher->addPath(QStringLiteral(PASSWD_DIR));
+    d->watchPasswd();
+    connect(d->passwdWatcher, &QFileSystemWatcher::fileChanged, this, [this] {
+        d->userNames.clear();
+        d->watchPasswd();
+    });
+    connect(d->passwdWatcher, &QFileSystemWatcher::directoryChanged, this, [this] {
+        if (!d->passwdWatcher->files().contains(QStringLiteral(PASSWD_PATH))) {
+            // It has just been replaced
+            d->userNames.clear();
+            d->watchPasswd();
+        }
+    });
+}
+
+CredentialsResolver::~CredentialsResolver()
+{
+    delete d;
+}
+
+CredentialsOperation *CredentialsResolver::resolve(const QString &service)
+{
+    return new CredentialsOperation(service, this);
+}
+
+QString CredentialsResolver::userName(uint uid)
+{
+    QHash< uint, QString >::const_iterator cached = d->userNames.constFind(uid);
+    if (cached != d->userNames.constEnd()) {
+        return cached.value();
+    }
+
+    struct passwd pwd;
+    struct passwd *result = Q_NULLPTR;
+    QVarLengthArray< char, 1024 > buffer(1024);
+
+    int ret;
+    while ((ret = getpwuid_r(uid, &pwd, buffer.data(), buffer.size(), &result)) == ERANGE) {
+        buffer.resize(buffer.size() * 2);
+    }
+
+    if (!result) {
+        if (ret == 0) {
+            qWarning() << "User" << uid << "not found!";
+        } else {
+            qWarning() << "getpwuid_r failed," << ret;
+        }
+        return QString();
+    }
+
+    QString name = QString::fromLatin1(pwd.pw_name);
+    d->userNames.insert(uid, name);
+    return name;
+}
+
+}
@@ -0,0 +1,69 @@
+#ifndef GRAVITY_CREDENTIALSRESOLVER_H
+#define GRAVITY_CREDENTIALSRESOLVER_H
+
+#include <HemeraCore/Operation>
+
+#include <QtDBus/QDBusConnection>
+
+#include <GravitySupermassive/Global>
+
+namespace Gravity {
+
+class CredentialsResolver;
+
+class HEMERA_GRAVITY_EXPORT CredentialsOperation : public Hemera::Operation
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(CredentialsOperation)
+
+public:
+    virtual ~CredentialsOperation();
+
+    uint uid() const;
+    /// Empty if the user could not be found
+    QString userName() const;
+
+protected:
+    virtual void startImpl() override final;
+
+private:
+    explicit CredentialsOperation(const QString &service, CredentialsResolver *parent);
+
+    class Private;
+    Private * const d;
+
+    friend class CredentialsResolver;
+};
+
+/**
+ * @brief Resolves who is behind a bus name, without ever blocking
+ *
+ * CredentialsResolver asks the bus for the credentials of a caller asynchronously, and remembers them until the name
+ * changes owner. User names are looked up locally, and remembered until the user database changes.
+ *
+ * Services should use it together with delayed replies when they need to know who is calling them.
+ */
+class HEMERA_GRAVITY_EXPORT CredentialsResolver : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(CredentialsResolver)
+
+public:
+    explicit CredentialsResolver(const QDBusConnection &connection = QDBusConnection::systemBus(), QObject *parent = Q_NULLPTR);
+    virtual ~CredentialsResolver();
+
+    CredentialsOperation *resolve(const QString &service);
+
+    /// Empty if uid does not exist
+    QString userName(uint uid);
+
+private:
+    class Private;
+    Private * const d;
+
+    friend class CredentialsOperation;
+};
+
+}
+
+#endif // GRAVITY_CREDENTIALSRESOLVER_H
@@ -0,0 +1,158 @@
+#include "gravitydevicemonitor_p.h"
+
+#include <QtCore/QDebug>
+#include <QtCore/QSocketNotifier>
+
+#include <libudev.h>
+
+namespace Gravity
+{
+
+DeviceMonitor::DeviceMonitor(QObject *parent)
+    : QObject(parent)
+{
+}
+
+DeviceMonitor::~DeviceMonitor()
+{
+}
+
+UdevDeviceMonitor::UdevDeviceMonitor(QObject *parent)
+    : DeviceMonitor(parent)
+    , m_udev(nullptr)
+    , m_monitor(nullptr)
+{
+}
+
+UdevDeviceMonitor::~UdevDeviceMonitor()
+{
+    if (m_monitor) {
+        udev_monitor_unref(m_monitor);
+    }
+
+    if (m_udev) {
+        udev_unref(m_udev);
+    }
+}
+
+bool UdevDeviceMonitor::removableDeviceType(struct udev_device *device, Hemera::RemovableStorage::Device::Type *type)
+{
+    if (qstrcmp(udev_device_get_property_value(device, "ID_BUS"), "usb") == 0) {
+        *type = Hemera::RemovableStorage::Device::Type::USB;
+        return true;
+    }
+
+    // Only SD cards: an MMC is soldered on the board, and most likely holds our own root.
+    struct udev_device *card = udev_device_get_parent_with_subsystem_devtype(device, "mmc", nullptr);
+    if (card && qstrcmp(udev_device_get_sysattr_value(card, "type"), "SD") == 0) {
+        *type = Hemera::RemovableStorage::Device::Type::SDCard;
+        return true;
+    }
+
+    return false;
+}
+
+DeviceMonitor::Device UdevDeviceMonitor::device(struct udev_device *device)
+{
+    Device result;
+    result.action = udev_device_get_action(device);
+    result.name = QLatin1String(udev_device_get_property_value(device, "DEVNAME"));
+    result.node = udev_device_get_devnode(device);
+    result.number = udev_device_get_devnum(device);
+
+    // DISKSEQ lives on the disk, not on its partitions
+    const char *diskSeq = udev_device_get_property_value(device, "DISKSEQ");
+    if (!diskSeq) {
+        struct udev_device *disk = udev_device_get_parent_with_subsystem_devtype(device, "block", "disk");
+        diskSeq = disk ? udev_device_get_property_value(disk, "DISKSEQ") : nullptr;
+    }
+    result.diskSequence = diskSeq ? QByteArray(diskSeq).toULongLong() : 0;
+
+    // A device which went away has nothing left to read in sysfs
+    if (result.action == "remove") {
+        return result;
+    }
+
+    result.removable = removableDeviceType(device, &result.type);
+
+    // The size is in 512 bytes sectors, whatever the device
+    result.info.size = QByteArray(udev_device_get_sysattr_value(device, "size")).toLongLong() * 512;
+
+    // udev's blkid builtin has almost always been there before us: no need to read the device again.
+    if (udev_device_get_property_value(device, "ID_FS_TYPE")) {
+        result.info.valid = true;
+        result.info.filesystem = QLatin1String(udev_device_get_property_value(device, "ID_FS_TYPE"));
+        result.info.usage = QLatin1String(udev_device_get_property_value(device, "ID_FS_USAGE"));
+        result.info.label = QString::fromUtf8(udev_device_get_property_value(device, "ID_FS_LABEL"));
+        result.info.uuid = QString::fromLatin1(udev_device_get_property_value(device, "ID_FS_UUID"));
+    }
+
+    return result;
+}
+
+bool UdevDeviceMonitor::start(QList< Device > *present, QString *errorMessage)
+{
+    /* Create the udev object */
+    m_udev = udev_new();
+    if (!m_udev) {
+        qWarning() << "Can't create udev manager, this is really weird.";
+        *errorMessage = QStringLiteral("Could not create udev manager");
+        return false;
+    }
+
+    /* This section sets up a monitor which will report events when
+       devices attached to the system change.  Events include "add",
+       "remove", "change", "online", and "offline".
+    */
+    m_monitor = udev_monitor_new_from_netlink(m_udev, "udev");
+    if (!m_monitor) {
+        qWarning() << "Could not create netlink udev monitor!";
+        *errorMessage = QStringLiteral("Could not create netlink udev monitor");
+        return false;
+    }
+
+    /* Filtering for added devices without additional checks is perfectly fine. If a block partition
+     * gets added at runtime it is obviously removable storage, unless something really creepy is
+     * happening.
+     */
+    udev_monitor_filter_add_match_subsystem_devtype(m_monitor, "block", "partition");
+    udev_monitor_enable_receiving(m_monitor);
+
+    /* Create a list of the devices in the 'block' subsystem. The monitor is already underway,
+       so nothing gets lost in between. */
+    struct udev_enumerate *enumerate = udev_enumerate_new(m_udev);
+    udev_enumerate_add_match_subsystem(enumerate, "block");
+    udev_enumerate_add_match_property(enumerate, "ID_FS_USAGE", "filesystem");
+    udev_enumerate_scan_devices(enumerate);
+
+    struct udev_list_entry *entry;
+    udev_list_entry_foreach (entry, udev_enumerate_get_list_entry(enumerate)) {
+        struct udev_device *dev = udev_device_new_from_syspath(m_udev, udev_list_entry_get_name(entry));
+        if (dev) {
+            present->append(device(dev));
+            udev_device_unref(dev);
+        }
+    }
+    udev_enumerate_unref(enumerate);
+
+    /* The monitor socket is non blocking: takeEvents reads until it is empty. */
+    QSocketNotifier *notifier = new QSocketNotifier(udev_monitor_get_fd(m_monitor), QSocketNotifier::Read, this);
+    connect(notifier, &QSocketNotifier::activated, this, &DeviceMonitor::eventsPending);
+
+    return true;
+}
+
+QList< DeviceMonitor::Device > UdevDeviceMonitor::takeEvents()
+{
+    QList< Device > events;
+
+    struct udev_device *dev;
+    while ((dev = udev_monitor_receive_device(m_monitor)) != nullptr) {
+        events.append(device(dev));
+        udev_device_unref(dev);
+    }
+
+    return events;
+}
+
+}
@@ -0,0 +1,84 @@
+#ifndef GRAVITY_DEVICEMONITOR_P_H
+#define GRAVITY_DEVICEMONITOR_P_H
+
+#include "gravityblockprobe_p.h"
+
+#include <GravitySupermassive/Global>
+
+#include <HemeraCore/RemovableStorage>
+
+#include <QtCore/QList>
+#include <QtCore/QObject>
+
+struct udev;
+struct udev_device;
+struct udev_monitor;
+
+namespace Gravity
+{
+
+/**
+ * Tells RemovableStorageManager about block partitions coming and going.
+ *
+ * udev is the only source on a real system. Tests and benchmarks provide their own events instead,
+ * so that the manager can be driven without plugging physical media.
+ */
+class HEMERA_GRAVITY_EXPORT DeviceMonitor : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(DeviceMonitor)
+
+public:
+    struct Device {
+        Device() : number(0), diskSequence(0), removable(false), type(Hemera::RemovableStorage::Device::Type::USB) {}
+
+        /// add, change or remove. Empty for devices which were there already.
+        QByteArray action;
+        /// DEVNAME, which is also the device id on the bus
+        QString name;
+        QByteArray node;
+        quint64 number;
+        /// Bumped every time a new medium shows up in the same slot. 0 if the kernel doesn't tell.
+        quint64 diskSequence;
+        bool removable;
+        Hemera::RemovableStorage::Device::Type type;
+        /// The size is always there. The filesystem is valid only if somebody (e.g. udev's blkid builtin) has probed it already.
+        BlockProbe::Info info;
+    };
+
+    explicit DeviceMonitor(QObject *parent = nullptr);
+    virtual ~DeviceMonitor();
+
+    /// Starts monitoring, and fills present with the partitions which are there already
+    virtual bool start(QList< Device > *present, QString *errorMessage) = 0;
+    /// Everything which happened since the last call, oldest first
+    virtual QList< Device > takeEvents() = 0;
+
+Q_SIGNALS:
+    /// Emitted once for any number of events: takeEvents() returns all of them
+    void eventsPending();
+};
+
+class UdevDeviceMonitor : public DeviceMonitor
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(UdevDeviceMonitor)
+
+public:
+    explicit UdevDeviceMonitor(QObject *parent = nullptr);
+    virtual ~UdevDeviceMonitor();
+
+    virtual bool start(QList< Device > *present, QString *errorMessage) override final;
+    virtual QList< Device > takeEvents() override final;
+
+private:
+    static Device device(struct udev_device *device);
+    static bool removableDeviceType(struct udev_device *device, Hemera::RemovableStorage::Device::Type *type);
+
+    struct udev *m_udev;
+    struct udev_monitor *m_monitor;
+};
+
+}
+
+#endif // GRAVITY_DEVICEMONITOR_P_H
@@ -0,0 +1,62 @@
+#ifndef GRAVITY_LATENCYHISTOGRAM_P_H
+#define GRAVITY_LATENCYHISTOGRAM_P_H
+
+#include <QtCore/QVariantList>
+#include <QtCore/QVariantMap>
+#include <QtCore/QVector>
+
+namespace Gravity
+{
+
+// Upper bounds (msecs) of the latency histogram buckets. Anything slower falls in the last bucket.
+static const qint64 s_latencyBucketBounds[] = { 10, 50, 100, 250, 500, 1000, 2500, 5000, 10000 };
+static const int s_latencyBucketCount = sizeof(s_latencyBucketBounds) / sizeof(qint64) + 1;
+
+struct LatencyHistogram
+{
+    LatencyHistogram() : count(0), total(0), max(0), buckets(s_latencyBucketCount, 0) {}
+
+    void record(qint64 msecs) {
+        ++count;
+        total += msecs;
+        max = qMax(max, msecs);
+
+        int bucket = 0;
+        while (bucket < s_latencyBucketCount - 1 && msecs > s_latencyBucketBounds[bucket]) {
+            ++bucket;
+        }
+        ++buckets[bucket];
+    }
+
+    QVariantMap toVariantMap() const {
+        QVariantList histogram;
+        for (quint64 bucket : buckets) {
+            histogram.append(bucket);
+        }
+
+        QVariantMap result;
+        result.insert(QStringLiteral("count"), count);
+        result.insert(QStringLiteral("total"), total);
+        result.insert(QStringLiteral("max"), max);
+        result.insert(QStringLiteral("average"), count > 0 ? total / static_cast<qint64>(count) : 0);
+        result.insert(QStringLiteral("histogram"), histogram);
+        return result;
+    }
+
+    static QVariantList bounds() {
+        QVariantList result;
+        for (qint64 bound : s_latencyBucketBounds) {
+            result.append(bound);
+        }
+        return result;
+    }
+
+    quint64 count;
+    qint64 total;
+    qint64 max;
+    QVector< quint64 > buckets;
+};
+
+}
+
+#endif // GRAVITY_LATENCYHISTOGRAM_P_H
@@ -0,0 +1,302 @@
+#include "gravitymemorypressuremanager.h"
+
+#include "gravityapplicationhandler.h"
+
+#include <HemeraCore/CommonOperations>
+#include <HemeraCore/Literals>
+
+#include <QtCore/QDebug>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QLoggingCategory>
+#include <QtCore/QSet>
+#include <QtCore/QSettings>
+#include <QtCore/QSocketNotifier>
+#include <QtCore/QTimer>
+
+#include <gravityconfig.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fdodbusinterface.h"
+#include "memorypressuremanageradaptor.h"
+
+#define PSI_MEMORY_PATH "/proc/pressure/memory"
+#define CGROUP_ROOT_PATH "/sys/fs/cgroup"
+#define MEMORY_PRESSURE_MANAGER_PATH "/com/ispirata/Hemera/Gravity/MemoryPressureManager"
+
+Q_LOGGING_CATEGORY(LOG_MEMORYPRESSUREMANAGER, "Gravity::MemoryPressureManager")
+
+namespace Gravity
+{
+
+class MemoryPressureManager::Private
+{
+public:
+    Private(MemoryPressureManager *q, ApplicationHandler *handler, const QDBusConnection &connection)
+        : q(q), handler(handler), dbus(connection), psiFd(-1), evicting(false) {}
+
+    MemoryPressureManager *q;
+    ApplicationHandler *handler;
+    QDBusConnection dbus;
+
+    org::freedesktop::DBus *fdoDBus;
+
+    int psiFd;
+    QElapsedTimer lastEviction;
+    bool evicting;
+
+    // Configuration
+    int stallThresholdUs;
+    int stallWindowUs;
+    double averageThreshold;
+    int pollInterval;
+    int evictionCooldown;
+    quint64 satelliteMemoryLimit;
+
+    // application id -> cgroup of the orbit unit it lives in
+    QHash< QString, QString > applicationCGroups;
+
+    bool setupTrigger();
+    double currentAverage() const;
+    void resolveCGroup(const QString &application);
+    void onPressure(const QString &reason);
+
+    static quint64 readMemoryCurrent(const QString &cgroup);
+};
+
+bool MemoryPressureManager::Private::setupTrigger()
+{
+    psiFd = ::open(PSI_MEMORY_PATH, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (psiFd < 0) {
+        qCDebug(LOG_MEMORYPRESSUREMANAGER) << "Could not open" << PSI_MEMORY_PATH << "for writing:" << strerror(errno);
+        return false;
+    }
+
+    QByteArray trigger = QByteArray("some ") + QByteArray::number(stallThresholdUs) + ' ' + QByteArray::number(stallWindowUs);
+    // The trigger must be written including the terminating NUL.
+    if (::write(psiFd, trigger.constData(), trigger.size() + 1) < 0) {
+        qCDebug(LOG_MEMORYPRESSUREMANAGER) << "Could not register the memory pressure trigger:" << strerror(errno);
+        ::close(psiFd);
+        psiFd = -1;
+        return false;
+    }
+
+    // PSI triggers are signalled as POLLPRI, which is what an Exception notifier waits for.
+    QSocketNotifier *notifier = new QSocketNotifier(psiFd, QSocketNotifier::Exception, q);
+    QObject::connect(notifier, &QSocketNotifier::activated, q, [this] {
+        onPressure(QStringLiteral("Memory stall exceeded %1us over %2us").arg(stallThresholdUs).arg(stallWindowUs));
+    });
+
+    return true;
+}
+
+double MemoryPressureManager::Private::currentAverage() const
+{
+    QFile psi(QStringLiteral(PSI_MEMORY_PATH));
+    if (!psi.open(QIODevice::ReadOnly)) {
+        return -1;
+    }
+
+    // some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+    QByteArray line = psi.readLine();
+    int index = line.indexOf("avg10=");
+    if (index < 0) {
+        return -1;
+    }
+
+    return line.mid(index + 6, line.indexOf(' ', index) - index - 6).toDouble();
+}
+
+void MemoryPressureManager::Private::resolveCGroup(const QString &application)
+{
+    Hemera::DBusUIntOperation *op = new Hemera::DBusUIntOperation(fdoDBus->GetConnectionUnixProcessID(application), q);
+    QObject::connect(op, &Hemera::Operation::finished, q, [this, op, application] {
+        if (op->isError()) {
+            qCDebug(LOG_MEMORYPRESSUREMANAGER) << "Could not retrieve the pid of" << application << op->errorMessage();
+            return;
+        }
+
+        QFile cgroupFile(QStringLiteral("/proc/%1/cgroup").arg(op->result()));
+        if (!cgroupFile.open(QIODevice::ReadOnly)) {
+            return;
+        }
+
+        // We only support the unified hierarchy: 0::/system.slice/hemera-orbit-foo@star.service/...
+        for (const QByteArray &line : cgroupFile.readAll().split('\n')) {
+            if (!line.startsWith("0::")) {
+                continue;
+            }
+
+            // Account the whole orbit unit, not just the application's own scope.
+            QStringList components = QString::fromLatin1(line.mid(3)).split(QLatin1Char('/'), QString::SkipEmptyParts);
+            QStringList orbitComponents;
+            for (const QString &component : components) {
+                orbitComponents.append(component);
+                if (component.endsWith(QStringLiteral(".service"))) {
+                    break;
+                }
+            }
+
+            applicationCGroups.insert(application, QStringLiteral(CGROUP_ROOT_PATH "/%1").arg(orbitComponents.join(QLatin1Char('/'))));
+            return;
+        }
+    });
+}
+
+quint64 MemoryPressureManager::Private::readMemoryCurrent(const QString &cgroup)
+{
+    QFile memoryCurrent(QStringLiteral("%1/memory.current").arg(cgroup));
+    if (!memoryCurrent.open(QIODevice::ReadOnly)) {
+        return 0;
+    }
+
+    return memoryCurrent.readAll().trimmed().toULongLong();
+}
+
+void MemoryPressureManager::Private::onPressure(const QString &reason)
+{
+    if (evicting || (lastEviction.isValid() && lastEviction.elapsed() < evictionCooldown)) {
+        // Give the previous eviction the time to make a difference.
+        return;
+    }
+
+    QStringList candidates = handler->satellitesByActivation();
+    if (candidates.isEmpty()) {
+        qCDebug(LOG_MEMORYPRESSUREMANAGER) << "Under memory pressure, but there are no satellites to evict.";
+        return;
+    }
+
+    // Least recently activated wins, unless somebody is exceeding its own budget.
+    QString victim = candidates.first();
+    if (satelliteMemoryLimit > 0) {
+        for (const QString &candidate : candidates) {
+            if (q->satelliteMemoryCurrent(candidate) > satelliteMemoryLimit) {
+                victim = candidate;
+                break;
+            }
+        }
+    }
+
+    quint64 memoryCurrent = q->satelliteMemoryCurrent(victim);
+    qCWarning(LOG_MEMORYPRESSUREMANAGER) << "Memory pressure detected:" << reason << "- evicting satellite" << victim
+                                          << "which is using" << memoryCurrent << "bytes";
+
+    evicting = true;
+    Hemera::Operation *op = handler->evictSatellite(victim);
+    QObject::connect(op, &Hemera::Operation::finished, q, [this, op, victim, reason, memoryCurrent] {
+        evicting = false;
+        lastEviction.restart();
+
+        if (op->isError()) {
+            qCWarning(LOG_MEMORYPRESSUREMANAGER) << "Could not evict satellite" << victim << op->errorName() << op->errorMessage();
+            return;
+        }
+
+        Q_EMIT q->SatelliteEvicted(victim, reason, memoryCurrent);
+    });
+}
+
+MemoryPressureManager::MemoryPressureManager(ApplicationHandler *handler, const QDBusConnection &connection, QObject *parent)
+    : AsyncInitDBusObject(parent)
+    , d(new Private(this, handler, connection))
+{
+}
+
+MemoryPressureManager::~MemoryPressureManager()
+{
+    if (d->psiFd >= 0) {
+        ::close(d->psiFd);
+    }
+
+    delete d;
+}
+
+void MemoryPressureManager::initImpl()
+{
+    QSettings settings(QStringLiteral("%1/memorypressure.conf").arg(QLatin1String(StaticConfig::configGravityPath())), QSettings::NativeFormat);
+    settings.beginGroup(QStringLiteral("MemoryPressure")); {
+        if (!settings.value(QStringLiteral("Enabled"), true).toBool()) {
+            qCDebug(LOG_MEMORYPRESSUREMANAGER) << "Memory pressure management is disabled.";
+            setReady();
+            return;
+        }
+
+        d->stallThresholdUs = settings.value(QStringLiteral("StallThresholdUs"), 150000).toInt();
+        d->stallWindowUs = settings.value(QStringLiteral("StallWindowUs"), 1000000).toInt();
+        d->averageThreshold = settings.value(QStringLiteral("AverageThreshold"), 10.0).toDouble();
+        d->pollInterval = settings.value(QStringLiteral("PollInterval"), 2000).toInt();
+        d->evictionCooldown = settings.value(QStringLiteral("EvictionCooldown"), 5000).toInt();
+        d->satelliteMemoryLimit = settings.value(QStringLiteral("SatelliteMemoryLimit"), 0).toULongLong();
+    } settings.endGroup();
+
+    if (d->currentAverage() < 0) {
+        qCWarning(LOG_MEMORYPRESSUREMANAGER) << "The kernel does not expose memory pressure information. Satellites will not be evicted.";
+        setReady();
+        return;
+    }
+
+    d->fdoDBus = new org::freedesktop::DBus(QStringLiteral("org.freedesktop.DBus"), QString(), d->dbus, this);
+    if (!d->fdoDBus->isValid()) {
+        setInitError(Hemera::Literals::literal(Hemera::Literals::Errors::interfaceNotAvailable()),
+                     QStringLiteral("The remote DBus interface is not available."));
+        return;
+    }
+
+    if (!d->dbus.registerObject(QStringLiteral(MEMORY_PRESSURE_MANAGER_PATH), this)) {
+        setInitError(Hemera::Literals::literal(Hemera::Literals::Errors::registerObjectFailed()),
+                     QStringLiteral("Failed to register the object on the bus"));
+        return;
+    }
+    new MemoryPressureManagerAdaptor(this);
+
+    // Keep track of where applications live, so we know how much each satellite is using.
+    for (const QString &id : d->handler->livingApplications().keys()) {
+        d->resolveCGroup(id);
+    }
+    connect(d->handler, &ApplicationHandler::applicationRegistered, this, [this] (const QString &id) {
+        d->resolveCGroup(id);
+    });
+    connect(d->handler, &ApplicationHandler::applicationUnregistered, this, [this] (const QString &id) {
+        d->applicationCGroups.remove(id);
+    });
+
+    if (!d->setupTrigger()) {
+        // Unprivileged or old kernel: fall back to sampling the average.
+        qCDebug(LOG_MEMORYPRESSUREMANAGER) << "Falling back to polling memory pressure every" << d->pollInterval << "ms";
+        QTimer *pollTimer = new QTimer(this);
+        pollTimer->setInterval(d->pollInterval);
+        connect(pollTimer, &QTimer::timeout, this, [this] {
+            double average = d->currentAverage();
+            if (average >= d->averageThreshold) {
+                d->onPressure(QStringLiteral("Memory pressure average %1% exceeded %2%").arg(average).arg(d->averageThreshold));
+            }
+        });
+        pollTimer->start();
+    }
+
+    setReady();
+}
+
+quint64 MemoryPressureManager::satelliteMemoryCurrent(const QString &satellite) const
+{
+    // Applications of the same orbit share the same unit, count it once.
+    QSet< QString > cgroups;
+    for (const QString &application : d->handler->applicationsForSatellite(satellite)) {
+        if (d->applicationCGroups.contains(application)) {
+            cgroups.insert(d->applicationCGroups.value(application));
+        }
+    }
+
+    quint64 result = 0;
+    for (const QString &cgroup : cgroups) {
+        result += Private::readMemoryCurrent(cgroup);
+    }
+
+    return result;
+}
+
+}
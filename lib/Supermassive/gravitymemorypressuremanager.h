@@ -0,0 +1,49 @@
+#ifndef GRAVITY_MEMORYPRESSUREMANAGER_H
+#define GRAVITY_MEMORYPRESSUREMANAGER_H
+
+#include <HemeraCore/AsyncInitDBusObject>
+
+#include <QtDBus/QDBusConnection>
+
+#include <GravitySupermassive/Global>
+
+namespace Gravity {
+
+class ApplicationHandler;
+
+/**
+ * @brief Evicts satellites when the system runs low on memory
+ *
+ * MemoryPressureManager watches the kernel's memory pressure stall information and, when the configured
+ * thresholds are crossed, deactivates and shuts down the least recently activated satellite of the star.
+ * Every eviction is advertised on the bus through SatelliteEvicted.
+ *
+ * Thresholds are read from memorypressure.conf in Gravity's configuration directory.
+ */
+class HEMERA_GRAVITY_EXPORT MemoryPressureManager : public Hemera::AsyncInitDBusObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(MemoryPressureManager)
+    Q_CLASSINFO("D-Bus Interface", "com.ispirata.Hemera.Gravity.MemoryPressureManager")
+
+public:
+    explicit MemoryPressureManager(ApplicationHandler *handler, const QDBusConnection &connection = QDBusConnection(QStringLiteral("starbus")),
+                                   QObject *parent = Q_NULLPTR);
+    virtual ~MemoryPressureManager();
+
+    quint64 satelliteMemoryCurrent(const QString &satellite) const;
+
+protected:
+    virtual void initImpl() override final;
+
+Q_SIGNALS:
+    void SatelliteEvicted(const QString &satellite, const QString &reason, qulonglong memoryCurrent);
+
+private:
+    class Private;
+    Private * const d;
+};
+
+}
+
+#endif // GRAVITY_MEMORYPRESSUREMANAGER_H
@@ -0,0 +1,429 @@
+#include "gravitymountbackend_p.h"
+
+#include <HemeraCore/Literals>
+#include <HemeraCore/RemovableStorage>
+
+#include <QtCore/QDebug>
+#include <QtCore/QList>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/syscall.h>
+
+#include <linux/loop.h>
+
+#include <libcryptsetup.h>
+
+// The new mount API might be missing from the C library headers: bring in what we need.
+#if defined(SYS_fsopen) && defined(SYS_fsconfig) && defined(SYS_fsmount) && defined(SYS_move_mount)
+#define GRAVITY_HAVE_FS_CONTEXT 1
+
+#ifndef FSOPEN_CLOEXEC
+#define FSOPEN_CLOEXEC 0x00000001
+#endif
+#ifndef FSMOUNT_CLOEXEC
+#define FSMOUNT_CLOEXEC 0x00000001
+#endif
+#ifndef FSCONFIG_SET_FLAG
+#define FSCONFIG_SET_FLAG 0
+#define FSCONFIG_SET_STRING 1
+#define FSCONFIG_CMD_CREATE 6
+#endif
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY 0x00000001
+#define MOUNT_ATTR_NOSUID 0x00000002
+#define MOUNT_ATTR_NODEV 0x00000004
+#define MOUNT_ATTR_NOEXEC 0x00000008
+#endif
+#ifndef MOUNT_ATTR_NOATIME
+#define MOUNT_ATTR_NOATIME 0x00000010
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#endif
+
+// LOOP_CONFIGURE sets up a loop device in a single call, but it is fairly recent.
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE 0x4C0A
+struct loop_config {
+    __u32 fd;
+    __u32 block_size;
+    struct loop_info64 info;
+    __u64 __reserved[8];
+};
+#endif
+#ifndef LO_FLAGS_DIRECT_IO
+#define LO_FLAGS_DIRECT_IO 16
+#endif
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+
+namespace Gravity
+{
+
+MountBackend::Profile MountBackend::defaultProfile(const QString &filesystem)
+{
+    Profile profile;
+
+    if (filesystem == QStringLiteral("vfat")) {
+        // flush writes back as soon as a file is closed: sticks get yanked out without unmounting all the time.
+        profile.ownerOption = true;
+        profile.data << "utf8" << "shortname=mixed" << "flush" << "errors=remount-ro";
+    } else if (filesystem == QStringLiteral("exfat")) {
+        profile.ownerOption = true;
+        profile.data << "iocharset=utf8" << "errors=remount-ro";
+    } else if (filesystem == QStringLiteral("ntfs3")) {
+        profile.ownerOption = true;
+        profile.data << "iocharset=utf8";
+    } else if (filesystem == QStringLiteral("ntfs")) {
+        profile.ownerOption = true;
+    } else if (filesystem == QStringLiteral("iso9660") || filesystem == QStringLiteral("udf")) {
+        profile.ownerOption = true;
+        profile.readOnly = true;
+    } else if (filesystem.startsWith(QStringLiteral("ext"))) {
+        // No online discard: cheap flash controllers choke on it. Batch it with fstrim instead.
+        profile.data << "nodiscard" << "errors=remount-ro";
+    }
+    // Other POSIX filesystems (btrfs, xfs, f2fs...) carry their own ownership and are fine with their defaults.
+
+    return profile;
+}
+
+MountBackend::Options MountBackend::removableOptions(const Profile &profile, uid_t owner, bool readOnly)
+{
+    Options options;
+    // Removable media are never trusted, whatever the profile says
+    options.flags = MS_NOSUID | MS_NODEV;
+    if (readOnly || profile.readOnly) {
+        options.flags |= MS_RDONLY;
+    }
+    if (profile.noAtime) {
+        options.flags |= MS_NOATIME;
+    }
+
+    QList< QByteArray > data;
+    if (profile.ownerOption) {
+        data << "uid=" + QByteArray::number(owner);
+    }
+    data << profile.data;
+
+    options.data = data.isEmpty() ? QByteArray() : data.at(0);
+    for (int i = 1; i < data.size(); ++i) {
+        options.data.append(',').append(data.at(i));
+    }
+
+    return options;
+}
+
+MountBackend::Options MountBackend::removableOptions(const QString &filesystem, uid_t owner, bool readOnly)
+{
+    return removableOptions(defaultProfile(filesystem), owner, readOnly);
+}
+
+MountBackend::Result MountBackend::errorResult(int error, bool unmounting)
+{
+    Result result;
+    result.error = error;
+    result.errorMessage = QString::fromLocal8Bit(strerror(error));
+
+    switch (error) {
+        case ENODEV:
+            // The kernel does not know this filesystem
+            result.errorName = unmounting ? QLatin1String(Hemera::Literals::Errors::failedRequest())
+                                          : Hemera::RemovableStorage::Errors::unsupportedFilesystem();
+            break;
+        case ENOENT:
+        case ENXIO:
+        case ENOTBLK:
+            result.errorName = Hemera::RemovableStorage::Errors::noSuchDevice();
+            break;
+        case EBUSY:
+            result.errorName = unmounting ? QLatin1String(Hemera::Literals::Errors::failedRequest())
+                                          : Hemera::RemovableStorage::Errors::alreadyMounted();
+            break;
+        case EINVAL:
+            if (unmounting) {
+                result.errorName = Hemera::RemovableStorage::Errors::notMounted();
+            } else {
+                // Bad superblock, or options the filesystem does not understand
+                result.errorName = Hemera::RemovableStorage::Errors::unsupportedFilesystem();
+            }
+            break;
+        case EROFS:
+        case EACCES:
+            result.errorName = unmounting ? QLatin1String(Hemera::Literals::Errors::notAllowed())
+                                          : Hemera::RemovableStorage::Errors::notWriteable();
+            break;
+        case EPERM:
+            result.errorName = QLatin1String(Hemera::Literals::Errors::notAllowed());
+            break;
+        default:
+            result.errorName = QLatin1String(Hemera::Literals::Errors::failedRequest());
+            break;
+    }
+
+    return result;
+}
+
+MountBackend::Result MountBackend::mount(const QString &source, const QString &target, const QString &filesystem, const Options &options)
+{
+    QByteArray nativeSource = source.toLocal8Bit();
+    QByteArray nativeTarget = target.toLocal8Bit();
+    QByteArray nativeFilesystem = filesystem.toLatin1();
+
+#ifdef GRAVITY_HAVE_FS_CONTEXT
+    Result result = mountWithFsContext(nativeSource, nativeTarget, nativeFilesystem, options);
+    if (result.error != ENOSYS) {
+        return result;
+    }
+#endif
+
+    if (::mount(nativeSource.constData(), nativeTarget.constData(), nativeFilesystem.constData(), options.flags,
+                options.data.isEmpty() ? Q_NULLPTR : options.data.constData()) < 0) {
+        return errorResult(errno, false);
+    }
+
+    return Result();
+}
+
+MountBackend::Result MountBackend::mountWithFsContext(const QByteArray &source, const QByteArray &target, const QByteArray &filesystem,
+                                                      const Options &options)
+{
+#ifdef GRAVITY_HAVE_FS_CONTEXT
+    int fsFd = syscall(SYS_fsopen, filesystem.constData(), FSOPEN_CLOEXEC);
+    if (fsFd < 0) {
+        // ENOSYS makes the caller fall back to mount(2)
+        return errorResult(errno, false);
+    }
+
+    auto fail = [fsFd] () -> Result {
+        int error = errno;
+        ::close(fsFd);
+        return errorResult(error, false);
+    };
+
+    if (syscall(SYS_fsconfig, fsFd, FSCONFIG_SET_STRING, "source", source.constData(), 0) < 0) {
+        return fail();
+    }
+    if ((options.flags & MS_RDONLY) && syscall(SYS_fsconfig, fsFd, FSCONFIG_SET_FLAG, "ro", Q_NULLPTR, 0) < 0) {
+        return fail();
+    }
+    if (!options.data.isEmpty()) {
+        for (const QByteArray &option : options.data.split(',')) {
+            int separator = option.indexOf('=');
+            int ret = separator < 0 ? syscall(SYS_fsconfig, fsFd, FSCONFIG_SET_FLAG, option.constData(), Q_NULLPTR, 0)
+                                    : syscall(SYS_fsconfig, fsFd, FSCONFIG_SET_STRING, option.left(separator).constData(),
+                                              option.mid(separator + 1).constData(), 0);
+            if (ret < 0) {
+                return fail();
+            }
+        }
+    }
+    if (syscall(SYS_fsconfig, fsFd, FSCONFIG_CMD_CREATE, Q_NULLPTR, Q_NULLPTR, 0) < 0) {
+        return fail();
+    }
+
+    unsigned int attributes = 0;
+    if (options.flags & MS_RDONLY) {
+        attributes |= MOUNT_ATTR_RDONLY;
+    }
+    if (options.flags & MS_NOSUID) {
+        attributes |= MOUNT_ATTR_NOSUID;
+    }
+    if (options.flags & MS_NODEV) {
+        attributes |= MOUNT_ATTR_NODEV;
+    }
+    if (options.flags & MS_NOEXEC) {
+        attributes |= MOUNT_ATTR_NOEXEC;
+    }
+    if (options.flags & MS_NOATIME) {
+        attributes |= MOUNT_ATTR_NOATIME;
+    }
+
+    int mountFd = syscall(SYS_fsmount, fsFd, FSMOUNT_CLOEXEC, attributes);
+    if (mountFd < 0) {
+        return fail();
+    }
+    ::close(fsFd);
+
+    int ret = syscall(SYS_move_mount, mountFd, "", AT_FDCWD, target.constData(), MOVE_MOUNT_F_EMPTY_PATH);
+    int error = errno;
+    ::close(mountFd);
+
+    return ret < 0 ? errorResult(error, false) : Result();
+#else
+    Q_UNUSED(source)
+    Q_UNUSED(target)
+    Q_UNUSED(filesystem)
+    Q_UNUSED(options)
+    return errorResult(ENOSYS, false);
+#endif
+}
+
+MountBackend::Result MountBackend::unmount(const QString &target, int flags)
+{
+    if (::umount2(target.toLocal8Bit().constData(), flags) < 0) {
+        return errorResult(errno, true);
+    }
+
+    return Result();
+}
+
+MountBackend::Result MountBackend::syncFilesystem(const QString &target)
+{
+    int fd = ::open(target.toLocal8Bit().constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return errorResult(errno, true);
+    }
+
+    int ret = ::syncfs(fd);
+    int error = errno;
+    ::close(fd);
+
+    return ret < 0 ? errorResult(error, true) : Result();
+}
+
+MountBackend::Result MountBackend::attachLoopDevice(const QString &file, int readAheadKb, QString *loopDevice, int *loopFd)
+{
+    QByteArray nativeFile = file.toLocal8Bit();
+
+    // Squashfs caches decompressed blocks on its own: going through the page cache for the image too is just waste.
+    bool directIO = true;
+    int backingFd = ::open(nativeFile.constData(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+    if (backingFd < 0 && errno == EINVAL) {
+        directIO = false;
+        backingFd = ::open(nativeFile.constData(), O_RDONLY | O_CLOEXEC);
+    }
+    if (backingFd < 0) {
+        return errorResult(errno, false);
+    }
+
+    int controlFd = ::open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+    if (controlFd < 0) {
+        int error = errno;
+        ::close(backingFd);
+        return errorResult(error, false);
+    }
+
+    int fd = -1;
+    int error = 0;
+    // Somebody else might grab the same free device in the meanwhile: just try the next one.
+    for (int attempt = 0; attempt < 16 && fd < 0; ++attempt) {
+        int number = ::ioctl(controlFd, LOOP_CTL_GET_FREE);
+        if (number < 0) {
+            error = errno;
+            break;
+        }
+
+        *loopDevice = QStringLiteral("/dev/loop%1").arg(number);
+        fd = ::open(loopDevice->toLatin1().constData(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            error = errno;
+            break;
+        }
+
+        struct loop_config config;
+        memset(&config, 0, sizeof(config));
+        config.fd = backingFd;
+        config.info.lo_flags = LO_FLAGS_READ_ONLY | LO_FLAGS_AUTOCLEAR | (directIO ? LO_FLAGS_DIRECT_IO : 0);
+        strncpy(reinterpret_cast< char* >(config.info.lo_file_name), nativeFile.constData(), LO_NAME_SIZE - 1);
+
+        if (::ioctl(fd, LOOP_CONFIGURE, &config) == 0) {
+            break;
+        } else if (errno == EBUSY) {
+            ::close(fd);
+            fd = -1;
+            continue;
+        } else if (errno != EINVAL && errno != ENOTTY) {
+            error = errno;
+            ::close(fd);
+            fd = -1;
+            break;
+        }
+
+        // Older kernel: do it the long way.
+        if (::ioctl(fd, LOOP_SET_FD, backingFd) < 0) {
+            error = errno;
+            ::close(fd);
+            fd = -1;
+            if (error == EBUSY) {
+                continue;
+            }
+            break;
+        }
+        if (::ioctl(fd, LOOP_SET_STATUS64, &config.info) < 0) {
+            error = errno;
+            ::ioctl(fd, LOOP_CLR_FD, 0);
+            ::close(fd);
+            fd = -1;
+            break;
+        }
+        if (directIO) {
+            // Best effort
+            ::ioctl(fd, LOOP_SET_DIRECT_IO, 1);
+        }
+    }
+
+    ::close(controlFd);
+    ::close(backingFd);
+
+    if (fd < 0) {
+        return errorResult(error ? error : EBUSY, false);
+    }
+
+    if (readAheadKb > 0 && ::ioctl(fd, BLKRASET, static_cast< unsigned long >(readAheadKb * 2)) < 0) {
+        qDebug() << "Could not set readahead on" << *loopDevice << strerror(errno);
+    }
+
+    *loopFd = fd;
+    return Result();
+}
+
+MountBackend::Result MountBackend::openCryptDevice(const QString &device, const QString &name, const QByteArray &key)
+{
+    struct crypt_device *cd = Q_NULLPTR;
+    int ret = crypt_init(&cd, device.toLatin1().constData());
+    if (ret < 0) {
+        return errorResult(-ret, false);
+    }
+
+    ret = crypt_load(cd, CRYPT_LUKS, Q_NULLPTR);
+    if (ret >= 0) {
+        ret = crypt_activate_by_passphrase(cd, name.toLatin1().constData(), CRYPT_ANY_SLOT, key.constData(), key.size(),
+                                           CRYPT_ACTIVATE_READONLY);
+    }
+    crypt_free(cd);
+
+    if (ret < 0) {
+        // A wrong key gives EPERM
+        return errorResult(-ret, false);
+    }
+
+    return Result();
+}
+
+MountBackend::Result MountBackend::closeCryptDevice(const QString &name, bool deferred)
+{
+    struct crypt_device *cd = Q_NULLPTR;
+    int ret = crypt_init_by_name(&cd, name.toLatin1().constData());
+    if (ret == -ENODEV) {
+        // Nothing to close
+        return Result();
+    } else if (ret < 0) {
+        return errorResult(-ret, true);
+    }
+
+    ret = crypt_deactivate_by_name(cd, name.toLatin1().constData(), deferred ? CRYPT_DEACTIVATE_DEFERRED : 0);
+    crypt_free(cd);
+
+    return ret < 0 ? errorResult(-ret, true) : Result();
+}
+
+}
@@ -0,0 +1,85 @@
+#ifndef GRAVITY_MOUNTBACKEND_P_H
+#define GRAVITY_MOUNTBACKEND_P_H
+
+#include <GravitySupermassive/Global>
+
+#include <QtCore/QByteArray>
+#include <QtCore/QList>
+#include <QtCore/QString>
+
+#include <sys/types.h>
+
+namespace Gravity
+{
+
+/**
+ * Mounts and unmounts filesystems straight from the kernel, without going through mount(8).
+ *
+ * All of these calls might block for a long time on slow devices: never invoke them from the main thread.
+ */
+class HEMERA_GRAVITY_EXPORT MountBackend
+{
+public:
+    struct Result {
+        Result() : error(0) {}
+
+        inline bool isError() const { return error != 0; }
+
+        int error;
+        QString errorName;
+        QString errorMessage;
+    };
+
+    struct Options {
+        Options() : flags(0) {}
+
+        unsigned long flags;
+        QByteArray data;
+    };
+
+    /// How a given filesystem should be mounted when it comes from removable media
+    struct Profile {
+        Profile() : noAtime(true), ownerOption(false), readOnly(false) {}
+
+        /// Don't turn every read into a write
+        bool noAtime;
+        /// The filesystem has no notion of ownership: it needs uid= to be accessible by the owner
+        bool ownerOption;
+        /// The filesystem can't be written anyway
+        bool readOnly;
+        /// Filesystem specific options, e.g. flush, iocharset=utf8, commit=30
+        QList< QByteArray > data;
+    };
+
+    /// The built in profile for filesystem, tuned for throughput on flash media
+    static Profile defaultProfile(const QString &filesystem);
+
+    /// Builds the flags and filesystem specific data for mounting a removable device on behalf of owner
+    static Options removableOptions(const Profile &profile, uid_t owner, bool readOnly);
+    static Options removableOptions(const QString &filesystem, uid_t owner, bool readOnly);
+
+    static Result mount(const QString &source, const QString &target, const QString &filesystem, const Options &options);
+    static Result unmount(const QString &target, int flags = 0);
+    /// Flushes the filesystem mounted on target, and only that one
+    static Result syncFilesystem(const QString &target);
+
+    /**
+     * Attaches file, read only, to a free loop device. Direct I/O is used whenever the backing filesystem allows it.
+     *
+     * The device detaches itself as soon as its last user goes away: keep loopFd open until it is in use,
+     * then close it.
+     */
+    static Result attachLoopDevice(const QString &file, int readAheadKb, QString *loopDevice, int *loopFd);
+    /// Opens the LUKS volume on device as /dev/mapper/name, read only
+    static Result openCryptDevice(const QString &device, const QString &name, const QByteArray &key);
+    /// Closes /dev/mapper/name. If deferred, removal happens once its last user goes away.
+    static Result closeCryptDevice(const QString &name, bool deferred = false);
+
+private:
+    static Result mountWithFsContext(const QByteArray &source, const QByteArray &target, const QByteArray &filesystem, const Options &options);
+    static Result errorResult(int error, bool unmounting);
+};
+
+}
+
+#endif // GRAVITY_MOUNTBACKEND_P_H
@@ -1,13 +1,23 @@
 #include "gravityoperations.h"
 
+#include "gravitymountbackend_p.h"
+
+#include <QtConcurrent/QtConcurrentRun>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDir>
 #include <QtCore/QProcess>
 #include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QFutureWatcher>
 #include <QtCore/QLoggingCategory>
+#include <QtCore/QSharedPointer>
 
 #include <HemeraCore/Literals>
 #include <HemeraCore/CommonOperations>
 
 #include <libudev.h>
+#include <unistd.h>
+#include <sys/mount.h>
 #include <sys/stat.h>
 
 #include "systemdmanagerinterface.h"
@@ -19,6 +29,10 @@
 
 Q_LOGGING_CATEGORY(LOG_TOOLOPERATION, "Gravity::ToolOperation")
 Q_LOGGING_CATEGORY(LOG_FACTORYRESETOPERATION, "Gravity::RestoreFactoryResetOperation")
+Q_LOGGING_CATEGORY(LOG_PACKAGEOPERATION, "Gravity::PackageOperation")
+
+// Squashfs reads in large sequential chunks
+#define PACKAGE_LOOP_READAHEAD_KB 512
 
 namespace Gravity
 {
@@ -353,4 +367,155 @@ QPair<QString, QString> RestoreFactoryResetOperation::diskNameAndPartitionFromLa
     return qMakePair(diskName, partition);
 }
 
+class MountPackageOperation::Private
+{
+public:
+    Private() : failedStep(new Step(Step::None)) {}
+
+    QString packageFile;
+    QString mountPoint;
+    QByteArray deviceKey;
+    // Written by the worker, which might outlive us
+    QSharedPointer< Step > failedStep;
+};
+
+MountPackageOperation::MountPackageOperation(const QString &packageFile, const QString &mountPoint, const QByteArray &deviceKey, QObject *parent)
+    : Operation(parent)
+    , d(new Private)
+{
+    d->packageFile = packageFile;
+    d->mountPoint = mountPoint;
+    d->deviceKey = deviceKey;
+}
+
+MountPackageOperation::~MountPackageOperation()
+{
+    delete d;
+}
+
+MountPackageOperation::Step MountPackageOperation::failedStep() const
+{
+    return *d->failedStep;
+}
+
+QString MountPackageOperation::cryptDeviceName(const QString &mountPoint)
+{
+    // Different spellings of the same mount point must get the same name, or unmounting would miss the mapping.
+    QString canonicalMountPoint = QFileInfo(mountPoint).canonicalFilePath();
+    if (canonicalMountPoint.isEmpty()) {
+        canonicalMountPoint = QDir::cleanPath(mountPoint);
+    }
+
+    return QStringLiteral("hemerapkg-%1").arg(QString::fromLatin1(
+        QCryptographicHash::hash(canonicalMountPoint.toUtf8(), QCryptographicHash::Sha1).toHex().left(16)));
+}
+
+void MountPackageOperation::startImpl()
+{
+    QString packageFile = d->packageFile;
+    QString mountPoint = d->mountPoint;
+    QByteArray deviceKey = d->deviceKey;
+    QSharedPointer< Step > failedStep = d->failedStep;
+
+    QFutureWatcher< MountBackend::Result > *watcher = new QFutureWatcher< MountBackend::Result >(this);
+    connect(watcher, &QFutureWatcher< MountBackend::Result >::finished, this, [this, watcher] {
+        MountBackend::Result result = watcher->result();
+        watcher->deleteLater();
+
+        if (result.isError()) {
+            qCWarning(LOG_PACKAGEOPERATION) << "Could not mount package" << d->packageFile << result.errorMessage;
+            setFinishedWithError(result.errorName, result.errorMessage);
+        } else {
+            setFinished();
+        }
+    });
+
+    watcher->setFuture(QtConcurrent::run([packageFile, mountPoint, deviceKey, failedStep] () -> MountBackend::Result {
+        QString loopDevice;
+        int loopFd = -1;
+        MountBackend::Result result = MountBackend::attachLoopDevice(packageFile, PACKAGE_LOOP_READAHEAD_KB, &loopDevice, &loopFd);
+        if (result.isError()) {
+            *failedStep = Step::LoopDevice;
+            return result;
+        }
+
+        QString source = loopDevice;
+        QString cryptName;
+        if (!deviceKey.isEmpty()) {
+            cryptName = cryptDeviceName(mountPoint);
+            result = MountBackend::openCryptDevice(loopDevice, cryptName, deviceKey);
+            if (result.isError()) {
+                *failedStep = Step::CryptDevice;
+                ::close(loopFd);
+                return result;
+            }
+            source = QStringLiteral("/dev/mapper/%1").arg(cryptName);
+        }
+
+        MountBackend::Options options;
+        options.flags = MS_RDONLY;
+        result = MountBackend::mount(source, mountPoint, QStringLiteral("squashfs"), options);
+        if (result.isError()) {
+            *failedStep = Step::Mount;
+            if (!cryptName.isEmpty()) {
+                MountBackend::closeCryptDevice(cryptName);
+            }
+        }
+
+        // From now on, the loop device goes away together with its last user.
+        ::close(loopFd);
+        return result;
+    }));
+}
+
+class UnmountPackageOperation::Private
+{
+public:
+    QString mountPoint;
+};
+
+UnmountPackageOperation::UnmountPackageOperation(const QString &mountPoint, QObject *parent)
+    : Operation(parent)
+    , d(new Private)
+{
+    d->mountPoint = mountPoint;
+}
+
+UnmountPackageOperation::~UnmountPackageOperation()
+{
+    delete d;
+}
+
+void UnmountPackageOperation::startImpl()
+{
+    QString mountPoint = d->mountPoint;
+
+    QFutureWatcher< MountBackend::Result > *watcher = new QFutureWatcher< MountBackend::Result >(this);
+    connect(watcher, &QFutureWatcher< MountBackend::Result >::finished, this, [this, watcher] {
+        MountBackend::Result result = watcher->result();
+        watcher->deleteLater();
+
+        if (result.isError()) {
+            qCWarning(LOG_PACKAGEOPERATION) << "Could not unmount package from" << d->mountPoint << result.errorMessage;
+            setFinishedWithError(result.errorName, result.errorMessage);
+        } else {
+            setFinished();
+        }
+    });
+
+    watcher->setFuture(QtConcurrent::run([mountPoint] () -> MountBackend::Result {
+        MountBackend::Result result = MountBackend::unmount(mountPoint);
+        bool lazy = false;
+        if (result.isError()) {
+            // This shouldn't happen, but a lazy umount is still better than no umount
+            lazy = true;
+            MountBackend::unmount(mountPoint, MNT_DETACH);
+        }
+
+        // Not encrypted packages have no mapping: that's fine. The loop device clears itself.
+        MountBackend::Result closeResult = MountBackend::closeCryptDevice(MountPackageOperation::cryptDeviceName(mountPoint), lazy);
+        return result.isError() ? result : closeResult;
+    }));
+}
+
 }
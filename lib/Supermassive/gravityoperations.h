@@ -81,6 +81,64 @@ private:
     bool checkFactoryReset(const QString &devicePath, struct udev *udevContext);
 };
 
+/**
+ * @brief Mounts a squashfs package, optionally LUKS encrypted, read only
+ *
+ * Everything happens in process: the loop device is set up with LOOP_CONFIGURE and direct I/O, the encrypted
+ * volume is opened through libcryptsetup under a name unique to the mount point, and squashfs is mounted directly.
+ * Several packages can hence be mounted at the same time.
+ *
+ * gravity-package-mount, and the mount-squash-package and umount-squash-package wrappers around it, expose this
+ * and UnmountPackageOperation to whoever mounts packages from outside Gravity.
+ */
+class HEMERA_GRAVITY_EXPORT MountPackageOperation : public Hemera::Operation
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(MountPackageOperation)
+
+public:
+    enum class Step {
+        None,
+        LoopDevice,
+        CryptDevice,
+        Mount
+    };
+
+    explicit MountPackageOperation(const QString &packageFile, const QString &mountPoint, const QByteArray &deviceKey = QByteArray(),
+                                   QObject *parent = nullptr);
+    virtual ~MountPackageOperation();
+
+    /// The step which failed, if any
+    Step failedStep() const;
+
+    /// The device mapper name used for an encrypted package mounted on mountPoint
+    static QString cryptDeviceName(const QString &mountPoint);
+
+protected:
+    virtual void startImpl() override final;
+
+private:
+    class Private;
+    Private * const d;
+};
+
+class HEMERA_GRAVITY_EXPORT UnmountPackageOperation : public Hemera::Operation
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(UnmountPackageOperation)
+
+public:
+    explicit UnmountPackageOperation(const QString &mountPoint, QObject *parent = nullptr);
+    virtual ~UnmountPackageOperation();
+
+protected:
+    virtual void startImpl() override final;
+
+private:
+    class Private;
+    Private * const d;
+};
+
 }
 
 #endif // GRAVITY_GRAVITYOPERATIONS_H
@@ -0,0 +1,177 @@
+#include "gravitypropertychangebatcher.h"
+
+#include <QtCore/QDebug>
+#include <QtCore/QHash>
+#include <QtCore/QMetaProperty>
+#include <QtCore/QSet>
+#include <QtCore/QTimer>
+
+namespace Gravity
+{
+
+class PropertyChangeBatcher::Private
+{
+public:
+    Private(QObject *target) : target(target) {}
+
+    QObject *target;
+    QTimer flushTimer;
+
+    // Property indexes, in the order they were first dirtied
+    QList< int > dirtyProperties;
+    QSet< int > immediateProperties;
+    // The SDK slot relaying each NOTIFY signal to the bus, by property index
+    QHash< int, QMetaMethod > relays;
+
+    int propertyIndex(const char *property) const;
+    QMetaMethod suspendRelay(int index, const QMetaMethod &notifySignal);
+    void notify(int index, const QMetaProperty &property, const QVariant &value);
+    void broadcast(const QVariantMap &changed);
+};
+
+int PropertyChangeBatcher::Private::propertyIndex(const char *property) const
+{
+    int index = target->metaObject()->indexOfProperty(property);
+    if (index < 0) {
+        qWarning() << "Property" << property << "does not exist in" << target->metaObject()->className();
+    } else if (!target->metaObject()->property(index).hasNotifySignal()) {
+        qWarning() << "Property" << property << "of" << target->metaObject()->className() << "has no NOTIFY signal";
+        return -1;
+    }
+
+    return index;
+}
+
+QMetaMethod PropertyChangeBatcher::Private::suspendRelay(int index, const QMetaMethod &notifySignal)
+{
+    QHash< int, QMetaMethod >::const_iterator known = relays.constFind(index);
+    if (known != relays.constEnd()) {
+        QObject::disconnect(target, notifySignal, target, known.value());
+        return known.value();
+    }
+
+    // Hemera's DBusObject connects every NOTIFY signal to a slot of its own, which emits a propertiesChanged
+    // for that property alone. Find out which one: it's the one we can disconnect. Until the object is
+    // initialized there might be none yet, so keep looking until there is.
+    for (const QMetaObject *metaObject = target->metaObject(); metaObject; metaObject = metaObject->superClass()) {
+        if (!QByteArray(metaObject->className()).startsWith("Hemera::")) {
+            continue;
+        }
+        for (int i = metaObject->methodOffset(); i < metaObject->methodCount(); ++i) {
+            QMetaMethod method = metaObject->method(i);
+            if (method.methodType() == QMetaMethod::Slot && QObject::disconnect(target, notifySignal, target, method)) {
+                relays.insert(index, method);
+                return method;
+            }
+        }
+    }
+
+    return QMetaMethod();
+}
+
+void PropertyChangeBatcher::Private::notify(int index, const QMetaProperty &property, const QVariant &value)
+{
+    QMetaMethod notifySignal = property.notifySignal();
+
+    // In-process users get the NOTIFY signal, the bus gets the batch only
+    QMetaMethod relay = suspendRelay(index, notifySignal);
+
+    if (notifySignal.parameterCount() == 0) {
+        notifySignal.invoke(target, Qt::DirectConnection);
+    } else {
+        // Signals carrying the new value get the current one, whatever happened in between.
+        notifySignal.invoke(target, Qt::DirectConnection, QGenericArgument(value.typeName(), value.constData()));
+    }
+
+    if (relay.isValid()) {
+        QObject::connect(target, notifySignal, target, relay);
+    }
+}
+
+void PropertyChangeBatcher::Private::broadcast(const QVariantMap &changed)
+{
+    // The DBusObject signal reaches every connection the object is registered on.
+    int index = target->metaObject()->indexOfSignal("propertiesChanged(QVariantMap)");
+    if (index < 0) {
+        qWarning() << target->metaObject()->className() << "is not a DBusObject, can't broadcast its property changes";
+        return;
+    }
+
+    target->metaObject()->method(index).invoke(target, Qt::DirectConnection, Q_ARG(QVariantMap, changed));
+}
+
+PropertyChangeBatcher::PropertyChangeBatcher(QObject *target)
+    : QObject(target)
+    , d(new Private(target))
+{
+    d->flushTimer.setSingleShot(true);
+    d->flushTimer.setInterval(0);
+    connect(&d->flushTimer, &QTimer::timeout, this, &PropertyChangeBatcher::flush);
+}
+
+PropertyChangeBatcher::~PropertyChangeBatcher()
+{
+    delete d;
+}
+
+void PropertyChangeBatcher::setImmediate(const char *property, bool immediate)
+{
+    int index = d->propertyIndex(property);
+    if (index < 0) {
+        return;
+    }
+
+    if (immediate) {
+        d->immediateProperties.insert(index);
+    } else {
+        d->immediateProperties.remove(index);
+    }
+}
+
+bool PropertyChangeBatcher::isImmediate(const char *property) const
+{
+    return d->immediateProperties.contains(d->target->metaObject()->indexOfProperty(property));
+}
+
+void PropertyChangeBatcher::markDirty(const char *property)
+{
+    int index = d->propertyIndex(property);
+    if (index < 0) {
+        return;
+    }
+
+    if (!d->dirtyProperties.contains(index)) {
+        d->dirtyProperties.append(index);
+    }
+
+    if (d->immediateProperties.contains(index)) {
+        flush();
+    } else if (!d->flushTimer.isActive()) {
+        d->flushTimer.start();
+    }
+}
+
+void PropertyChangeBatcher::flush()
+{
+    d->flushTimer.stop();
+
+    // Notifications might dirty other properties: those will go in the next batch.
+    QList< int > dirtyProperties = d->dirtyProperties;
+    d->dirtyProperties.clear();
+    if (dirtyProperties.isEmpty()) {
+        return;
+    }
+
+    QVariantMap changed;
+    for (int index : dirtyProperties) {
+        QMetaProperty property = d->target->metaObject()->property(index);
+        QVariant value = property.read(d->target);
+        changed.insert(QLatin1String(property.name()), value);
+        d->notify(index, property, value);
+    }
+
+    // The whole batch goes on the bus in a single PropertiesChanged.
+    d->broadcast(changed);
+}
+
+}
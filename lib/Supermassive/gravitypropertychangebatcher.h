@@ -0,0 +1,47 @@
+#ifndef GRAVITY_PROPERTYCHANGEBATCHER_H
+#define GRAVITY_PROPERTYCHANGEBATCHER_H
+
+#include <QtCore/QObject>
+
+#include <GravitySupermassive/Global>
+
+namespace Gravity {
+
+/**
+ * @brief Coalesces property change notifications of a D-Bus object
+ *
+ * Instead of emitting NOTIFY signals directly, objects mark their properties as dirty through the batcher.
+ * Dirty properties are collected and notified once, with their current value, when the batcher flushes
+ * on the next event loop iteration. Each flush emits the NOTIFY signals of the dirty properties for in-process
+ * users, and a single DBusObject propertiesChanged carrying all of them for the bus: the SDK's own relay of
+ * each NOTIFY signal to the bus is held back meanwhile. This way a burst of changes (such as the ones happening
+ * during an orbit switch) results in one notification on the bus.
+ *
+ * Properties which are latency sensitive can be marked as immediate, in which case they are notified
+ * straight away together with whatever was pending.
+ */
+class HEMERA_GRAVITY_EXPORT PropertyChangeBatcher : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(PropertyChangeBatcher)
+
+public:
+    explicit PropertyChangeBatcher(QObject *target);
+    virtual ~PropertyChangeBatcher();
+
+    void setImmediate(const char *property, bool immediate = true);
+    bool isImmediate(const char *property) const;
+
+    void markDirty(const char *property);
+
+public Q_SLOTS:
+    void flush();
+
+private:
+    class Private;
+    Private * const d;
+};
+
+}
+
+#endif // GRAVITY_PROPERTYCHANGEBATCHER_H
@@ -1,58 +1,47 @@
-#include "gravityremovablestoragemanager.h"
-
+#include "gravityremovablestoragemanager_p.h"
+
+#include "gravityblockprobe_p.h"
+#include "gravitycredentialsresolver.h"
+#include "gravitycopyengine_p.h"
+#include "gravitydevicemonitor_p.h"
+#include "gravitylatencyhistogram_p.h"
+#include "gravitymountbackend_p.h"
 #include "gravityoperations.h"
 
-#include <HemeraCore/CommonOperations>
 #include <HemeraCore/Literals>
 #include <HemeraCore/RemovableStorage>
 
 #include <QtConcurrent/QtConcurrentRun>
 #include <QtCore/QDebug>
 #include <QtCore/QFutureWatcher>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFileInfo>
 #include <QtCore/QJsonObject>
-#include <QtCore/QSocketNotifier>
-#include <QtCore/QProcess>
+#include <QtCore/QMultiHash>
+#include <QtCore/QSet>
+#include <QtCore/QSettings>
+#include <QtCore/QSharedPointer>
 #include <QtCore/QTemporaryDir>
+#include <QtCore/QThreadPool>
+#include <QtCore/QTimer>
 
 #include <QtDBus/QDBusConnection>
 
-#include <libudev.h>
+#include <gravityconfig.h>
 
 #include <errno.h>
+#include <pwd.h>
 #include <unistd.h>
 
-#include <iostream>
-#include <sstream>
+#include <sys/mount.h>
 
 #include "removablestoragemanageradaptor.h"
+#include "gravityremovablestoragemanageradaptor.h"
 
 
 namespace Gravity
 {
 
-class MountOperation : public Hemera::StringOperation
-{
-    Q_OBJECT
-    Q_DISABLE_COPY(MountOperation)
-
-public:
-    explicit MountOperation(const QString &device, int options, RemovableStorageManager *parent)
-        : StringOperation(parent), m_manager(parent), m_device(device), m_options(options) {}
-    virtual ~MountOperation() {}
-
-public Q_SLOTS:
-    virtual void startImpl() override final;
-
-    inline virtual QString result() const override final { return m_path; }
-
-private:
-    RemovableStorageManager *m_manager;
-    QString m_device;
-    int m_options;
-
-    QString m_path;
-};
-
 void MountOperation::startImpl()
 {
     connect(m_manager, &RemovableStorageManager::mountFinished, this, [this] (const QString &device) {
@@ -70,27 +59,6 @@ void MountOperation::startImpl()
     m_path = m_manager->Mount(m_device, m_options);
 }
 
-
-class UnmountOperation : public Hemera::Operation
-{
-    Q_OBJECT
-    Q_DISABLE_COPY(UnmountOperation)
-
-public:
-    explicit UnmountOperation(const QString &device, RemovableStorageManager *parent)
-        : Operation(parent), m_manager(parent), m_device(device) {}
-    virtual ~UnmountOperation() {}
-
-public Q_SLOTS:
-    virtual void startImpl() override final;
-
-private:
-    RemovableStorageManager *m_manager;
-    QString m_device;
-
-    QString m_path;
-};
-
 void UnmountOperation::startImpl()
 {
     connect(m_manager, &RemovableStorageManager::unmountFinished, this, [this] (const QString &device) {
@@ -111,55 +79,236 @@ void UnmountOperation::startImpl()
 class RemovableStorageManager::Private
 {
 public:
-    Private(RemovableStorageManager *parent) : q(parent), udev(nullptr), mon(nullptr) {}
+    Private(RemovableStorageManager *parent, DeviceMonitor *monitor) : q(parent), monitor(monitor), generation(0), oldestTrackedGeneration(0)
+                                            , nextCopyJobId(1), copyPool(nullptr), copyProgressTimer(nullptr)
+                                            , releasesInFlight(0), maxParallelReleases(2)
+                                            , udevWakeups(0), udevEvents(0), udevLargestBurst(0), copiedBytes(0), copyingTime(0)
+                                            , forceUnmountDeadline(5000), unmountRetryInterval(500) {}
 
     RemovableStorageManager *q;
 
-    struct udev *udev;
-    struct udev_monitor *mon;
+    DeviceMonitor *monitor;
 
     QHash< QString, QJsonObject > devices;
     QHash< QString, QString > mountedDevices;
     QHash< QString, QTemporaryDir* > mountPoints;
 
     QDBusServiceWatcher *watcher;
-
-    void onDeviceAdded(struct udev_device *device);
-    void onDeviceRemoved(struct udev_device *device);
-    void removeDeviceFromStorage(const QString &deviceId, const QString &dbusService);
+    CredentialsResolver *credentials;
+
+    // Versioned device table: every change bumps the generation. Removed devices are remembered for a while,
+    // so that clients can catch up with a delta.
+    quint64 generation;
+    quint64 oldestTrackedGeneration;
+    QHash< QString, quint64 > deviceGenerations;
+    QHash< QString, quint64 > removedDeviceGenerations;
+    QByteArray snapshot;
+
+    // An unmount in progress. Callers asking for the same device while it runs wait on the same one.
+    struct PendingUnmount {
+        PendingUnmount() : firstAttempt(0), finished(false), forcing(false) {}
+
+        QString deviceId;
+        QString mountPoint;
+        QList< QDBusMessage > messages;
+        QElapsedTimer elapsed;
+        qint64 firstAttempt;
+        bool finished;
+        bool forcing;
+    };
+
+    // Bulk copies between removable devices and local storage
+    struct CopyJob {
+        QSharedPointer< CopyEngine::Job > job;
+        QString deviceId;
+        QString service;
+        QElapsedTimer elapsed;
+    };
+
+    QHash< quint64, CopyJob > copyJobs;
+    quint64 nextCopyJobId;
+    QStringList copyAllowedPaths;
+    QThreadPool *copyPool;
+    QTimer *copyProgressTimer;
+
+    quint64 startCopy(const QString &deviceId, const QString &source, const QString &destination, const QString &service, uid_t uid,
+                      QString *errorName, QString *errorMessage);
+    void cancelCopyJobs(const QString &deviceId, const QString &service = QString());
+    static bool lookupUser(uid_t uid, gid_t *gid, QString *home);
+    void emitCopyProgress();
+
+    // Overrides to the built in mount profiles, by filesystem
+    QHash< QString, MountBackend::Profile > mountProfiles;
+
+    int forceUnmountDeadline;
+    int unmountRetryInterval;
+
+    QHash< QString, QSharedPointer< PendingUnmount > > pendingUnmounts;
+
+    void finishUnmount(const QString &deviceId, const QList< QDBusMessage > &messages, const MountBackend::Result &result,
+                       const QString &kind, qint64 msecs);
+    void completeUnmount(const QSharedPointer< PendingUnmount > &pending, const MountBackend::Result &result, const QString &kind);
+
+    // Runtime figures, so that media and kernels can be compared on the field
+    QHash< QString, LatencyHistogram > latencies;
+    QHash< QString, quint64 > failures;
+    quint64 udevWakeups;
+    quint64 udevEvents;
+    int udevLargestBurst;
+    quint64 copiedBytes;
+    qint64 copyingTime;
+    void retryUnmount(const QSharedPointer< PendingUnmount > &pending);
+    void forceUnmount(const QSharedPointer< PendingUnmount > &pending);
+
+    void markDeviceChanged(const QString &deviceId);
+    QByteArray devicesSnapshot();
+    QByteArray devicesSince(quint64 sinceGeneration);
+
+    // Probing results, keyed by device number and disk sequence number: a new medium in the same slot
+    // gets a new sequence number.
+    typedef QPair< quint64, quint64 > ProbeKey;
+    QHash< ProbeKey, BlockProbe::Info > probeCache;
+    // Which medium each device holds, and which media are being probed right now
+    QHash< QString, ProbeKey > deviceProbeKeys;
+    QSet< ProbeKey > probesInFlight;
+
+    static ProbeKey probeKey(const DeviceMonitor::Device &device);
+    static void setDeviceInfo(QJsonObject *deviceData, const BlockProbe::Info &info);
+    bool deviceInfo(const DeviceMonitor::Device &device, BlockProbe::Info *info);
+    void probeDevice(const QString &deviceId, const DeviceMonitor::Device &device);
+
+    void onDeviceAdded(const DeviceMonitor::Device &device);
+    void onDeviceRemoved(const DeviceMonitor::Device &device);
+    void removeDeviceFromStorage(const QString &deviceId);
+
+    // service -> devices it mounted. A service is watched as long as it owns at least one mount.
+    QMultiHash< QString, QString > serviceDevices;
+    // Devices of dead services waiting to be unmounted, and how many are being unmounted right now
+    QStringList pendingReleases;
+    QSet< QString > releasingDevices;
+    int releasesInFlight;
+    int maxParallelReleases;
+
+    void trackMount(const QString &deviceId, const QString &service);
+    void untrackMount(const QString &deviceId);
+    void releaseDevices(const QStringList &deviceIds);
+    void processReleases();
+    void processUdevEvents();
     QJsonDocument devicesToJson();
 };
 
-void RemovableStorageManager::Private::onDeviceAdded(struct udev_device* device)
+RemovableStorageManager::Private::ProbeKey RemovableStorageManager::Private::probeKey(const DeviceMonitor::Device &device)
 {
-    QJsonObject deviceData;
-    QString devName = QLatin1String(udev_device_get_property_value(device, "DEVNAME"));
-    Hemera::RemovableStorage::Device::Type type = qstrcmp(udev_device_get_property_value(device, "ID_BUS"), "usb") == 0 ?
-                                    Hemera::RemovableStorage::Device::Type::USB :
-                                    Hemera::RemovableStorage::Device::Type::SDCard;
+    return ProbeKey(device.number, device.diskSequence);
+}
+
+void RemovableStorageManager::Private::setDeviceInfo(QJsonObject *deviceData, const BlockProbe::Info &info)
+{
+    deviceData->insert(QStringLiteral("filesystem"), info.filesystem);
+    deviceData->insert(QStringLiteral("label"), info.label);
+    deviceData->insert(QStringLiteral("uuid"), info.uuid);
+    deviceData->insert(QStringLiteral("size"), info.size);
+}
+
+bool RemovableStorageManager::Private::deviceInfo(const DeviceMonitor::Device &device, BlockProbe::Info *info)
+{
+    *info = device.info;
+    if (info->valid) {
+        return true;
+    }
+
+    QHash< ProbeKey, BlockProbe::Info >::const_iterator cached = probeCache.constFind(probeKey(device));
+    if (cached != probeCache.constEnd()) {
+        *info = cached.value();
+        return true;
+    }
+
+    return false;
+}
+
+void RemovableStorageManager::Private::probeDevice(const QString &deviceId, const DeviceMonitor::Device &device)
+{
+    ProbeKey key = probeKey(device);
+    if (probesInFlight.contains(key)) {
+        return;
+    }
+    probesInFlight.insert(key);
+
+    // Probing reads from the device, which might be slow to wake up: never do it on the main thread.
+    QByteArray deviceNode = device.node;
+    QFutureWatcher< BlockProbe::Info > *probeWatcher = new QFutureWatcher< BlockProbe::Info >(q);
+    QObject::connect(probeWatcher, &QFutureWatcher< BlockProbe::Info >::finished, q, [this, probeWatcher, deviceId, key] {
+        BlockProbe::Info info = probeWatcher->result();
+        probeWatcher->deleteLater();
+        probesInFlight.remove(key);
+
+        if (!info.valid) {
+            qDebug() << "Could not probe" << deviceId;
+            return;
+        }
+        probeCache.insert(key, info);
+
+        // The medium might have gone, or have been replaced, in the meanwhile
+        if (!devices.contains(deviceId) || deviceProbeKeys.value(deviceId) != key) {
+            return;
+        }
+
+        QJsonObject deviceData = devices.value(deviceId);
+        setDeviceInfo(&deviceData, info);
+        devices.insert(deviceId, deviceData);
+        markDeviceChanged(deviceId);
+
+        Q_EMIT q->DeviceAdded(QJsonDocument(deviceData).toJson(QJsonDocument::Compact));
+        Q_EMIT q->DevicesChanged(devicesSnapshot());
+    });
+
+    probeWatcher->setFuture(QtConcurrent::run([deviceNode] () -> BlockProbe::Info {
+        return BlockProbe::probe(deviceNode);
+    }));
+}
 
-    const char* sizeInSectors = udev_device_get_property_value(device, "ID_PART_ENTRY_SIZE");
-    std::stringstream strValue;
-    strValue << sizeInSectors;
+void RemovableStorageManager::Private::onDeviceAdded(const DeviceMonitor::Device &device)
+{
+    if (!device.removable) {
+        return;
+    }
 
-    qint64 intValue;
-    strValue >> intValue;
+    QJsonObject deviceData;
+    QString devName = device.name;
+    BlockProbe::Info info;
+    bool known = deviceInfo(device, &info);
+    deviceProbeKeys.insert(devName, probeKey(device));
 
     deviceData.insert(QStringLiteral("path"), devName);
     deviceData.insert(QStringLiteral("mounted"), false);
-    deviceData.insert(QStringLiteral("filesystem"), QLatin1String(udev_device_get_property_value(device, "ID_FS_TYPE")));
-    deviceData.insert(QStringLiteral("type"), static_cast<int>(type));
-    deviceData.insert(QStringLiteral("size"), intValue*512);
+    deviceData.insert(QStringLiteral("type"), static_cast<int>(device.type));
+    setDeviceInfo(&deviceData, info);
+
+    // A change event might hit a device we have mounted already
+    if (mountPoints.contains(devName)) {
+        deviceData.insert(QStringLiteral("mounted"), true);
+        deviceData.insert(QStringLiteral("mountPoint"), mountPoints.value(devName)->path());
+    }
 
     devices.insert(devName, deviceData);
+    markDeviceChanged(devName);
 
-    Q_EMIT q->DevicesChanged(devicesToJson().toJson(QJsonDocument::Compact));
     Q_EMIT q->DeviceAdded(QJsonDocument(deviceData).toJson(QJsonDocument::Compact));
+
+    if (!known) {
+        // Advertised right away anyway: filesystem, label and uuid follow as soon as we know them.
+        probeDevice(devName, device);
+    }
 }
 
-void RemovableStorageManager::Private::onDeviceRemoved(struct udev_device* device)
+void RemovableStorageManager::Private::onDeviceRemoved(const DeviceMonitor::Device &device)
 {
-    QString devName = QLatin1String(udev_device_get_property_value(device, "DEVNAME"));
+    QString devName = device.name;
+    deviceProbeKeys.remove(devName);
+    if (!devices.contains(devName)) {
+        // Not something we were tracking
+        return;
+    }
 
     if (mountedDevices.contains(devName)) {
         // We need to unmount it
@@ -168,42 +317,346 @@ void RemovableStorageManager::Private::onDeviceRemoved(struct udev_device* devic
             if (op->isError()) {
                 qWarning() << "Error unmounting removed device" << devName << ":" << op->errorMessage();
                 // Unmount failed, so we have to manually clean up
-                QString service = mountedDevices.take(devName);
-                if (!service.isEmpty()) {
-                    watcher->removeWatchedService(service);
-                }
+                untrackMount(devName);
                 delete mountPoints.take(devName);
             }
 
             // Otherwise, removeDeviceFromStorage has already cleaned up for us
             devices.remove(devName);
+            markDeviceChanged(devName);
 
-            Q_EMIT q->DevicesChanged(devicesToJson().toJson(QJsonDocument::Compact));
+            Q_EMIT q->DevicesChanged(devicesSnapshot());
             Q_EMIT q->DeviceRemoved(devName);
        });
 
     } else {
-        // Not mounted, we just erase it
+        // Not mounted, we just erase it. The caller takes care of DevicesChanged.
         devices.remove(devName);
+        markDeviceChanged(devName);
 
-        Q_EMIT q->DevicesChanged(devicesToJson().toJson(QJsonDocument::Compact));
         Q_EMIT q->DeviceRemoved(devName);
     }
 }
 
-void RemovableStorageManager::Private::removeDeviceFromStorage(const QString &deviceId, const QString &dbusService)
+void RemovableStorageManager::Private::processUdevEvents()
 {
-    delete mountPoints.take(deviceId);
-    mountedDevices.remove(deviceId);
-    if (!dbusService.isEmpty()) {
-        watcher->removeWatchedService(dbusService);
+    // Drain everything which is queued: a hub or a multi partition stick produces a burst of events,
+    // which we want to advertise as a single change.
+    QElapsedTimer burstTimer;
+    burstTimer.start();
+
+    int processed = 0;
+    for (const DeviceMonitor::Device &device : monitor->takeEvents()) {
+        if (device.action == "add" || device.action == "change") {
+            onDeviceAdded(device);
+            ++processed;
+        } else if (device.action == "remove") {
+            probeCache.remove(probeKey(device));
+            onDeviceRemoved(device);
+            ++processed;
+        }
     }
 
+    if (processed > 0) {
+        Q_EMIT q->DevicesChanged(devicesSnapshot());
+    }
+
+    ++udevWakeups;
+    udevEvents += processed;
+    udevLargestBurst = qMax(udevLargestBurst, processed);
+    latencies[QStringLiteral("udevBurst")].record(burstTimer.elapsed());
+}
+
+void RemovableStorageManager::Private::removeDeviceFromStorage(const QString &deviceId)
+{
+    cancelCopyJobs(deviceId);
+    delete mountPoints.take(deviceId);
+    untrackMount(deviceId);
+
     // Update device status
     QJsonObject deviceData = devices.value(deviceId);
     deviceData.insert(QStringLiteral("mounted"), false);
     deviceData.remove(QStringLiteral("mountPoint"));
     devices.insert(deviceId, deviceData);
+    markDeviceChanged(deviceId);
+}
+
+void RemovableStorageManager::Private::trackMount(const QString &deviceId, const QString &service)
+{
+    mountedDevices.insert(deviceId, service);
+    if (service.isEmpty()) {
+        return;
+    }
+
+    if (!serviceDevices.contains(service)) {
+        watcher->addWatchedService(service);
+    }
+    serviceDevices.insert(service, deviceId);
+}
+
+void RemovableStorageManager::Private::untrackMount(const QString &deviceId)
+{
+    QString service = mountedDevices.take(deviceId);
+    if (service.isEmpty()) {
+        return;
+    }
+
+    serviceDevices.remove(service, deviceId);
+    if (!serviceDevices.contains(service)) {
+        watcher->removeWatchedService(service);
+    }
+}
+
+void RemovableStorageManager::Private::releaseDevices(const QStringList &deviceIds)
+{
+    for (const QString &deviceId : deviceIds) {
+        if (!releasingDevices.contains(deviceId)) {
+            releasingDevices.insert(deviceId);
+            pendingReleases.append(deviceId);
+        }
+    }
+
+    processReleases();
+}
+
+void RemovableStorageManager::Private::processReleases()
+{
+    // Unmounting is I/O bound: a handful at a time keeps the others from starving.
+    while (!pendingReleases.isEmpty() && releasesInFlight < maxParallelReleases) {
+        QString deviceId = pendingReleases.takeFirst();
+        ++releasesInFlight;
+
+        Hemera::Operation *op = new UnmountOperation(deviceId, q);
+        QObject::connect(op, &Hemera::Operation::finished, q, [this, op, deviceId] {
+            if (op->isError()) {
+                qWarning() << "Could not release" << deviceId << ":" << op->errorMessage();
+            }
+
+            --releasesInFlight;
+            releasingDevices.remove(deviceId);
+            processReleases();
+        });
+    }
+}
+
+void RemovableStorageManager::Private::markDeviceChanged(const QString &deviceId)
+{
+    ++generation;
+    snapshot.clear();
+
+    QByteArray deviceData;
+    if (devices.contains(deviceId)) {
+        deviceGenerations.insert(deviceId, generation);
+        removedDeviceGenerations.remove(deviceId);
+        deviceData = QJsonDocument(devices.value(deviceId)).toJson(QJsonDocument::Compact);
+    } else {
+        deviceGenerations.remove(deviceId);
+        removedDeviceGenerations.insert(deviceId, generation);
+
+        // Do not remember removals forever: older clients will just get a full resync.
+        if (removedDeviceGenerations.size() > 64) {
+            QHash< QString, quint64 >::iterator oldest = removedDeviceGenerations.begin();
+            for (QHash< QString, quint64 >::iterator i = removedDeviceGenerations.begin(); i != removedDeviceGenerations.end(); ++i) {
+                if (i.value() < oldest.value()) {
+                    oldest = i;
+                }
+            }
+            oldestTrackedGeneration = oldest.value();
+            removedDeviceGenerations.erase(oldest);
+        }
+    }
+
+    Q_EMIT q->DeviceChanged(generation, deviceId, deviceData);
+}
+
+QByteArray RemovableStorageManager::Private::devicesSnapshot()
+{
+    if (snapshot.isEmpty()) {
+        snapshot = devicesToJson().toJson(QJsonDocument::Compact);
+    }
+
+    return snapshot;
+}
+
+QByteArray RemovableStorageManager::Private::devicesSince(quint64 sinceGeneration)
+{
+    QJsonObject result;
+    result.insert(QStringLiteral("generation"), static_cast<double>(generation));
+
+    if (sinceGeneration < oldestTrackedGeneration || sinceGeneration > generation) {
+        // We can't tell what happened in between
+        result.insert(QStringLiteral("full"), true);
+        result.insert(QStringLiteral("devices"), devicesToJson().array());
+        return QJsonDocument(result).toJson(QJsonDocument::Compact);
+    }
+
+    QJsonArray changed;
+    for (QHash< QString, quint64 >::const_iterator i = deviceGenerations.constBegin(); i != deviceGenerations.constEnd(); ++i) {
+        if (i.value() > sinceGeneration) {
+            changed.append(devices.value(i.key()));
+        }
+    }
+    QJsonArray removed;
+    for (QHash< QString, quint64 >::const_iterator i = removedDeviceGenerations.constBegin(); i != removedDeviceGenerations.constEnd(); ++i) {
+        if (i.value() > sinceGeneration) {
+            removed.append(i.key());
+        }
+    }
+
+    result.insert(QStringLiteral("full"), false);
+    result.insert(QStringLiteral("devices"), changed);
+    result.insert(QStringLiteral("removed"), removed);
+    return QJsonDocument(result).toJson(QJsonDocument::Compact);
+}
+
+void RemovableStorageManager::Private::finishUnmount(const QString &deviceId, const QList< QDBusMessage > &messages,
+                                                     const MountBackend::Result &result, const QString &kind, qint64 msecs)
+{
+    if (result.isError()) {
+        ++failures[kind];
+        qWarning() << "Umount of" << deviceId << "failed! Giving up." << result.errorMessage;
+        for (const QDBusMessage &message : messages) {
+            QDBusConnection::systemBus().send(message.createErrorReply(result.errorName, result.errorMessage));
+        }
+
+        Q_EMIT q->errorOccurred(deviceId, result.errorName, result.errorMessage);
+        return;
+    }
+
+    // Umount successful! Let's register the change.
+    latencies[kind].record(msecs);
+    removeDeviceFromStorage(deviceId);
+    Q_EMIT q->unmountFinished(deviceId);
+    Q_EMIT q->DevicesChanged(devicesSnapshot());
+    Q_EMIT q->DeviceUnmounted(QJsonDocument(devices.value(deviceId)).toJson(QJsonDocument::Compact));
+
+    for (const QDBusMessage &message : messages) {
+        QDBusConnection::systemBus().send(message.createReply());
+    }
+}
+
+void RemovableStorageManager::Private::completeUnmount(const QSharedPointer< PendingUnmount > &pending, const MountBackend::Result &result,
+                                                       const QString &kind)
+{
+    pending->finished = true;
+    if (pendingUnmounts.value(pending->deviceId) == pending) {
+        pendingUnmounts.remove(pending->deviceId);
+    }
+
+    finishUnmount(pending->deviceId, pending->messages, result, kind, pending->firstAttempt + pending->elapsed.elapsed());
+}
+
+void RemovableStorageManager::Private::retryUnmount(const QSharedPointer< PendingUnmount > &pending)
+{
+    if (pending->finished || pending->forcing) {
+        return;
+    }
+
+    QFutureWatcher< MountBackend::Result > *retryWatcher = new QFutureWatcher< MountBackend::Result >(q);
+    QObject::connect(retryWatcher, &QFutureWatcher< MountBackend::Result >::finished, q, [this, retryWatcher, pending] {
+        MountBackend::Result result = retryWatcher->result();
+        retryWatcher->deleteLater();
+
+        if (pending->finished) {
+            return;
+        }
+
+        // A retry which made it while the device is being detached still counts: the detach will find nothing to do.
+        if (!result.isError()) {
+            completeUnmount(pending, result, QStringLiteral("retriedUnmount"));
+            return;
+        }
+
+        if (pending->forcing) {
+            // The deadline has already taken over
+            return;
+        }
+
+        if (pending->elapsed.elapsed() >= forceUnmountDeadline) {
+            forceUnmount(pending);
+            return;
+        }
+
+        Q_EMIT q->UnmountProgress(pending->deviceId, QStringLiteral("waiting"), pending->elapsed.elapsed());
+        QTimer::singleShot(unmountRetryInterval, q, [this, pending] { retryUnmount(pending); });
+    });
+
+    QString mountPoint = pending->mountPoint;
+    retryWatcher->setFuture(QtConcurrent::run([mountPoint] () -> MountBackend::Result {
+        return MountBackend::unmount(mountPoint);
+    }));
+}
+
+void RemovableStorageManager::Private::forceUnmount(const QSharedPointer< PendingUnmount > &pending)
+{
+    if (pending->finished || pending->forcing) {
+        return;
+    }
+
+    qWarning() << "Device" << pending->deviceId << "did not unmount within" << forceUnmountDeadline << "ms, detaching it.";
+    pending->forcing = true;
+    Q_EMIT q->UnmountProgress(pending->deviceId, QStringLiteral("forcing"), pending->elapsed.elapsed());
+
+    QFutureWatcher< MountBackend::Result > *forceUmountWatcher = new QFutureWatcher< MountBackend::Result >(q);
+    QObject::connect(forceUmountWatcher, &QFutureWatcher< MountBackend::Result >::finished, q, [this, forceUmountWatcher, pending] {
+        MountBackend::Result result = forceUmountWatcher->result();
+        forceUmountWatcher->deleteLater();
+
+        if (pending->finished) {
+            // A late retry got there first
+            return;
+        }
+
+        // EINVAL means the mount point is gone already, most likely thanks to a retry still on its way back: that's what we wanted.
+        if (result.error == EINVAL) {
+            result = MountBackend::Result();
+        }
+
+        completeUnmount(pending, result, QStringLiteral("forcedUnmount"));
+    });
+
+    QString mountPoint = pending->mountPoint;
+    forceUmountWatcher->setFuture(QtConcurrent::run([mountPoint] () -> MountBackend::Result {
+        return MountBackend::unmount(mountPoint, MNT_FORCE | MNT_DETACH);
+    }));
+}
+
+bool RemovableStorageManager::Private::lookupUser(uid_t uid, gid_t *gid, QString *home)
+{
+    struct passwd pwd;
+    struct passwd *result = Q_NULLPTR;
+    QByteArray buffer(1024, 0);
+
+    int ret;
+    while ((ret = ::getpwuid_r(uid, &pwd, buffer.data(), buffer.size(), &result)) == ERANGE) {
+        buffer.resize(buffer.size() * 2);
+    }
+    if (ret != 0 || !result) {
+        return false;
+    }
+
+    *gid = pwd.pw_gid;
+    *home = QFile::decodeName(pwd.pw_dir);
+    return true;
+}
+
+void RemovableStorageManager::Private::cancelCopyJobs(const QString &deviceId, const QString &service)
+{
+    for (QHash< quint64, CopyJob >::const_iterator i = copyJobs.constBegin(); i != copyJobs.constEnd(); ++i) {
+        if ((!deviceId.isEmpty() && i.value().deviceId == deviceId) || (!service.isEmpty() && i.value().service == service)) {
+            i.value().job->cancelled.store(1);
+        }
+    }
+}
+
+void RemovableStorageManager::Private::emitCopyProgress()
+{
+    for (QHash< quint64, CopyJob >::const_iterator i = copyJobs.constBegin(); i != copyJobs.constEnd(); ++i) {
+        qint64 bytesCopied = i.value().job->bytesCopied.load();
+        qint64 elapsed = qMax(i.value().elapsed.elapsed(), static_cast< qint64 >(1));
+        Q_EMIT q->CopyProgress(i.key(), bytesCopied, i.value().job->totalBytes.load(),
+                               i.value().job->filesCopied.load(), i.value().job->totalFiles.load(), bytesCopied * 1000 / elapsed);
+    }
 }
 
 QJsonDocument RemovableStorageManager::Private::devicesToJson()
@@ -218,34 +671,36 @@ QJsonDocument RemovableStorageManager::Private::devicesToJson()
 
 static RemovableStorageManager *s_instance = nullptr;
 
-RemovableStorageManager::RemovableStorageManager(QObject* parent)
+RemovableStorageManager::RemovableStorageManager(DeviceMonitor *monitor, QObject* parent)
     : AsyncInitDBusObject(parent)
-    , d(new Private(this))
+    , d(new Private(this, monitor))
 {
     if (s_instance) {
         Q_ASSERT("Trying to create an additional instance! Only one RemovableStorageManager per process can exist.");
     }
 
+    monitor->setParent(this);
     s_instance = this;
 }
 
 RemovableStorageManager::~RemovableStorageManager()
 {
-    if (d->udev) {
-        udev_unref(d->udev);
-    }
+    delete d;
+}
 
-    if (d->mon) {
-        udev_monitor_unref(d->mon);
+RemovableStorageManager *RemovableStorageManager::instance()
+{
+    if (!s_instance) {
+        new RemovableStorageManager(new UdevDeviceMonitor, nullptr);
     }
 
-    delete d;
+    return s_instance;
 }
 
-RemovableStorageManager *RemovableStorageManager::instance()
+RemovableStorageManager *RemovableStorageManager::instance(DeviceMonitor *monitor)
 {
     if (!s_instance) {
-        new RemovableStorageManager(nullptr);
+        new RemovableStorageManager(monitor, nullptr);
     }
 
     return s_instance;
@@ -253,107 +708,65 @@ RemovableStorageManager *RemovableStorageManager::instance()
 
 void RemovableStorageManager::initImpl()
 {
-    struct udev_enumerate *enumerate;
-    struct udev_list_entry *devices, *dev_list_entry;
-    struct udev_device *dev;
-
-    int fd;
+    QSettings settings(QStringLiteral("%1/removablestorage.conf").arg(QLatin1String(StaticConfig::configGravityPath())), QSettings::NativeFormat);
+    settings.beginGroup(QStringLiteral("Unmount")); {
+        d->forceUnmountDeadline = settings.value(QStringLiteral("ForceDeadline"), 5000).toInt();
+        d->unmountRetryInterval = settings.value(QStringLiteral("RetryInterval"), 500).toInt();
+        d->maxParallelReleases = qMax(1, settings.value(QStringLiteral("MaxParallelReleases"), 2).toInt());
+    } settings.endGroup();
+    // [MountProfiles/vfat] NoAtime=true Options=utf8,shortname=mixed
+    settings.beginGroup(QStringLiteral("MountProfiles")); {
+        for (const QString &filesystem : settings.childGroups()) {
+            MountBackend::Profile profile = MountBackend::defaultProfile(filesystem);
+            settings.beginGroup(filesystem);
+            profile.noAtime = settings.value(QStringLiteral("NoAtime"), profile.noAtime).toBool();
+            if (settings.contains(QStringLiteral("Options"))) {
+                profile.data.clear();
+                for (const QString &option : settings.value(QStringLiteral("Options")).toStringList()) {
+                    profile.data.append(option.trimmed().toLatin1());
+                }
+            }
+            settings.endGroup();
 
-    /* Create the udev object */
-    d->udev = udev_new();
-    if (!d->udev) {
-        qWarning() << "Can't create udev manager, this is really weird.";
-        setInitError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()), QStringLiteral("Could not create udev manager"));
+            d->mountProfiles.insert(filesystem, profile);
+        }
+    } settings.endGroup();
+
+    int maxCopyJobs;
+    settings.beginGroup(QStringLiteral("Copy")); {
+        // When empty, every caller is confined to its own home.
+        d->copyAllowedPaths = settings.value(QStringLiteral("AllowedPaths")).toStringList();
+        maxCopyJobs = settings.value(QStringLiteral("MaxConcurrentJobs"), 2).toInt();
+    } settings.endGroup();
+
+    // Copies are long lived: give them their own threads, so mounts and unmounts never queue behind them.
+    d->copyPool = new QThreadPool(this);
+    d->copyPool->setMaxThreadCount(maxCopyJobs);
+    d->copyProgressTimer = new QTimer(this);
+    d->copyProgressTimer->setInterval(500);
+    connect(d->copyProgressTimer, &QTimer::timeout, this, [this] { d->emitCopyProgress(); });
+
+    QList< DeviceMonitor::Device > presentDevices;
+    QString errorMessage;
+    if (!d->monitor->start(&presentDevices, &errorMessage)) {
+        setInitError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()), errorMessage);
         return;
     }
 
-    /* This section sets up a monitor which will report events when
-       devices attached to the system change.  Events include "add",
-       "remove", "change", "online", and "offline".
-    */
-
-    /* Set up a monitor to monitor block devices */
-    d->mon = udev_monitor_new_from_netlink(d->udev, "udev");
-
-    if (!d->mon) {
-        qWarning() << "Could not create netlink udev monitor!";
-        setInitError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()), QStringLiteral("Could not create netlink udev monitor"));
-        return;
+    // onDeviceAdded takes care of discarding anything which is not removable
+    for (const DeviceMonitor::Device &device : presentDevices) {
+        d->onDeviceAdded(device);
     }
 
-    /* Filtering for added devices without additional checks is perfectly fine. If a block partition
-     * gets added at runtime it is obviously removable storage, unless something really creepy is
-     * happening.
-     */
-    udev_monitor_filter_add_match_subsystem_devtype(d->mon, "block", "partition");
-    udev_monitor_enable_receiving(d->mon);
-    /* Get the file descriptor (fd) for the monitor. This fd will get passed to select() */
-    fd = udev_monitor_get_fd(d->mon);
-
-
-    /* Create a list of the devices in the 'block' subsystem. */
-    enumerate = udev_enumerate_new(d->udev);
-    udev_enumerate_add_match_subsystem(enumerate, "block");
-    udev_enumerate_add_match_property(enumerate, "ID_FS_USAGE", "filesystem");
-    udev_enumerate_scan_devices(enumerate);
-    devices = udev_enumerate_get_list_entry(enumerate);
-    /* For each item enumerated, print out its information.
-       udev_list_entry_foreach is a macro which expands to
-       a loop. The loop will be executed for each member in
-       devices, setting dev_list_entry to a list entry
-       which contains the device's path in /sys. */
-    udev_list_entry_foreach (dev_list_entry, devices) {
-        const char *path;
-
-        /* Get the filename of the /sys entry for the device
-           and create a udev_device object (dev) representing it */
-        path = udev_list_entry_get_name(dev_list_entry);
-        dev = udev_device_new_from_syspath(d->udev, path);
-
-        // TODO: Maybe we should also support SD here? We need a more reliable filter.
-        if (qstrcmp(udev_device_get_property_value(dev, "ID_BUS"), "usb") == 0) {
-            qWarning() << "Enumerating!" << path;
-
-            d->onDeviceAdded(dev);
-        }
-
-        udev_device_unref(dev);
-    }
-    /* Free the enumerator object */
-    udev_enumerate_unref(enumerate);
-
-    /* Begin polling for udev events. Events occur when devices
-       attached to the system are added, removed, or change state.
-       udev_monitor_receive_device() will return a device
-       object representing the device which changed and what type of
-       change occured.
-
-       The monitor was set up earler in this file, and monitoring is
-       already underway.
-    */
-
-    QSocketNotifier *udevMonitor = new QSocketNotifier(fd, QSocketNotifier::Read, this);
-    connect(udevMonitor, &QSocketNotifier::activated, this, [this] {
-        qWarning() << "UDEV Monitor activated!!";
-        /* Make the call to receive the device. QSocketNotifier ensures that this will not block. */
-        struct udev_device *dev;
-        dev = udev_monitor_receive_device(d->mon);
-        if (dev) {
-            qWarning() << "Got device!!";
-            const char* szAction = udev_device_get_action(dev);
-            if (qstrcmp(szAction, "add") == 0) {
-                d->onDeviceAdded(dev);
-            } else {
-                d->onDeviceRemoved(dev);
-            }
-            udev_device_unref(dev);
-        } else {
-            qWarning() << "No Device from receive_device(). An error occured.";
-        }
+    connect(d->monitor, &DeviceMonitor::eventsPending, this, [this] {
+        d->processUdevEvents();
     });
 
     QDBusConnection::systemBus().registerObject(Hemera::Literals::literal(Hemera::Literals::DBus::removableStorageManagerPath()), this);
     new RemovableStorageManagerAdaptor(this);
+    new GravityRemovableStorageManagerAdaptor(this);
+
+    d->credentials = new CredentialsResolver(QDBusConnection::systemBus(), this);
 
     // Add our QDBusServiceWatcher to monitor applications dying without releasing mount lock
     d->watcher = new QDBusServiceWatcher(this);
@@ -361,15 +774,17 @@ void RemovableStorageManager::initImpl()
     d->watcher->setConnection(QDBusConnection::systemBus());
 
     connect(d->watcher, &QDBusServiceWatcher::serviceUnregistered, this, [this] (const QString &service) {
-        for (QHash< QString, QString >::const_iterator i = d->mountedDevices.constBegin(); i != d->mountedDevices.constEnd(); ++i) {
-            if (i.value() == service) {
-                qDebug() << "Service" << service << "died without unmounting. Forcing unmount.";
-                Unmount(i.key());
-                break;
-            }
+        d->cancelCopyJobs(QString(), service);
+
+        // The watch goes away by itself, once the last of its devices has been unmounted.
+        QStringList deviceIds = d->serviceDevices.values(service);
+        if (deviceIds.isEmpty()) {
+            d->watcher->removeWatchedService(service);
+            return;
         }
 
-        d->watcher->removeWatchedService(service);
+        qDebug() << "Service" << service << "died without unmounting" << deviceIds << ". Forcing unmount.";
+        d->releaseDevices(deviceIds);
     });
 
 
@@ -378,20 +793,27 @@ void RemovableStorageManager::initImpl()
 
 QByteArray RemovableStorageManager::ListDevices()
 {
-    return d->devicesToJson().toJson(QJsonDocument::Compact);
+    return d->devicesSnapshot();
+}
+
+QByteArray RemovableStorageManager::ListDevices(qulonglong sinceGeneration)
+{
+    return d->devicesSince(sinceGeneration);
+}
+
+qulonglong RemovableStorageManager::generation() const
+{
+    return d->generation;
 }
 
 QString RemovableStorageManager::Mount(const QString &deviceId, int options)
 {
     QDBusMessage dbusMessage;
-    uid_t ownerUid = 0; // root
 
     if (!calledFromDBus()) {
         qDebug() << "Mount called straight from Gravity!";
     } else {
         dbusMessage = message();
-        ownerUid = QDBusConnection::systemBus().interface()->serviceUid(message().service());
-        qDebug() << "Will mount for uid" << ownerUid;
         setDelayedReply(true);
     }
 
@@ -417,90 +839,103 @@ QString RemovableStorageManager::Mount(const QString &deviceId, int options)
         return QString();
     }
 
-    QTemporaryDir *mountPoint = new QTemporaryDir(QStringLiteral("%1%2hemera_removable_storage-XXXXXX").arg(QDir::tempPath(), QDir::separator()));
+    QString filesystem = d->devices.value(deviceId).value(QStringLiteral("filesystem")).toString();
+    if (filesystem.isEmpty()) {
+        qWarning() << deviceId << "has no recognizable filesystem!";
+        if (dbusMessage.type() != QDBusMessage::InvalidMessage) {
+            QDBusConnection::systemBus().send(dbusMessage.createErrorReply(Hemera::RemovableStorage::Errors::unsupportedFilesystem(),
+                                                                           QStringLiteral("Unsupported filesystem")));
+        }
+        Q_EMIT errorOccurred(deviceId, Hemera::RemovableStorage::Errors::unsupportedFilesystem(), QStringLiteral("Unsupported filesystem"));
+        return QString();
+    }
 
-    QProcess *mountProcess = new QProcess(this);
-    mountProcess->setProgram(QStringLiteral("mount"));
+    QTemporaryDir *mountPoint = new QTemporaryDir(QStringLiteral("%1%2hemera_removable_storage-XXXXXX").arg(QDir::tempPath(), QDir::separator()));
 
-    QString mountOptions = QStringLiteral("uid=%1").arg(ownerUid);
     Hemera::RemovableStorage::MountOptions requestedMountOptions = static_cast<Hemera::RemovableStorage::MountOptions>(options);
-    if (requestedMountOptions & Hemera::RemovableStorage::ReadOnly) {
-        mountOptions.append(QStringLiteral(",ro"));
-    }
-    mountProcess->setArguments(QStringList{ QStringLiteral("-o"), mountOptions, deviceId, mountPoint->path() });
-    Hemera::ProcessOperation *op = new Hemera::ProcessOperation(mountProcess, this);
-
-    connect(op, &Hemera::Operation::finished, this, [this, dbusMessage, ownerUid, mountPoint, deviceId, mountProcess, requestedMountOptions] {
-        if (mountProcess->exitStatus() == QProcess::CrashExit) {
-            qWarning() << "Mount crashed!";
-            if (dbusMessage.type() != QDBusMessage::InvalidMessage) {
-                QDBusConnection::systemBus().send(dbusMessage.createErrorReply(QLatin1String(Hemera::Literals::Errors::unhandledRequest()),
-                                                                               QStringLiteral("Process crashed")));
+    QString mountPointPath = mountPoint->path();
+
+    auto startMount = [this, dbusMessage, mountPoint, mountPointPath, deviceId, filesystem, requestedMountOptions] (uid_t ownerUid) {
+        MountBackend::Options mountOptions = MountBackend::removableOptions(d->mountProfiles.value(filesystem, MountBackend::defaultProfile(filesystem)),
+                                                                            ownerUid, requestedMountOptions & Hemera::RemovableStorage::ReadOnly);
+
+        // mount(2) can take its time on slow media: keep it away from the event loop.
+        QElapsedTimer mountTimer;
+        mountTimer.start();
+
+        QFutureWatcher< MountBackend::Result > *mountWatcher = new QFutureWatcher< MountBackend::Result >(this);
+        connect(mountWatcher, &QFutureWatcher< MountBackend::Result >::finished, this,
+                [this, dbusMessage, mountPoint, deviceId, mountWatcher, requestedMountOptions, mountTimer] {
+            MountBackend::Result result = mountWatcher->result();
+            mountWatcher->deleteLater();
+
+            if (result.isError()) {
+                ++d->failures[QStringLiteral("mount")];
+                qWarning() << "Mount failed!" << result.errorName << result.errorMessage;
+                if (dbusMessage.type() != QDBusMessage::InvalidMessage) {
+                    QDBusConnection::systemBus().send(dbusMessage.createErrorReply(result.errorName, result.errorMessage));
+                }
+                Q_EMIT errorOccurred(deviceId, result.errorName, result.errorMessage);
+                delete mountPoint;
+                return;
             }
-            Q_EMIT errorOccurred(deviceId, QLatin1String(Hemera::Literals::Errors::unhandledRequest()), QStringLiteral("Process crashed"));
-            delete mountPoint;
-            mountProcess->deleteLater();
-            return;
-        }
-
-        if (mountProcess->exitCode() != 0) {
-            qWarning() << "Mount failed!";
-            QString mountOutput = QLatin1String(mountProcess->readAll());
-            qWarning() << mountOutput;
 
-            if (dbusMessage.type() != QDBusMessage::InvalidMessage) {
-                if (mountOutput.contains(QStringLiteral("fs type"))) {
-                    QDBusConnection::systemBus().send(dbusMessage.createErrorReply(Hemera::RemovableStorage::Errors::unsupportedFilesystem(),
-                                                                                   QStringLiteral("Unsupported filesystem")));
-                } else {
-                    QDBusConnection::systemBus().send(dbusMessage.createErrorReply(QLatin1String(Hemera::Literals::Errors::failedRequest()),
-                                                                                   QStringLiteral("Process exited with %1").arg(mountProcess->exitCode())));
+            // Mount successful! Let's register the change.
+            d->latencies[QStringLiteral("mount")].record(mountTimer.elapsed());
+            d->mountPoints.insert(deviceId, mountPoint);
+            d->trackMount(deviceId, dbusMessage.service());
+
+            // Update device status
+            QJsonObject deviceData = d->devices.value(deviceId);
+            deviceData.insert(QStringLiteral("mounted"), true);
+            deviceData.insert(QStringLiteral("mountPoint"), mountPoint->path());
+            d->devices.insert(deviceId, deviceData);
+            d->markDeviceChanged(deviceId);
+
+            if (!(requestedMountOptions & Hemera::RemovableStorage::ReadOnly) && access(mountPoint->path().toLatin1().constData(), R_OK | W_OK) < 0) {
+                if (dbusMessage.type() != QDBusMessage::InvalidMessage) {
+                    QDBusConnection::systemBus().send(dbusMessage.createErrorReply(Hemera::RemovableStorage::Errors::notWriteable(),
+                                                                                   QStringLiteral("Could not mount filesystem for writing.")));
                 }
+                Q_EMIT errorOccurred(deviceId, Hemera::RemovableStorage::Errors::notWriteable(), QStringLiteral("Could not mount filesystem for writing."));
+                // Unmount
+                Unmount(deviceId);
+                return;
             }
-            if (mountOutput.contains(QStringLiteral("fs type"))) {
-                Q_EMIT errorOccurred(deviceId, Hemera::RemovableStorage::Errors::unsupportedFilesystem(), QStringLiteral("Unsupported filesystem"));
-            } else {
-                Q_EMIT errorOccurred(deviceId, QLatin1String(Hemera::Literals::Errors::failedRequest()),
-                                     QStringLiteral("Process exited with %1").arg(mountProcess->exitCode()));
-            }
-            delete mountPoint;
-            mountProcess->deleteLater();
-            return;
-        }
 
-        // Mount successful! Let's register the change.
-        d->mountedDevices.insert(deviceId, dbusMessage.service());
-        d->mountPoints.insert(deviceId, mountPoint);
-        if (!dbusMessage.service().isEmpty()) {
-            d->watcher->addWatchedService(dbusMessage.service());
-        }
+            Q_EMIT mountFinished(deviceId);
+            Q_EMIT DevicesChanged(d->devicesSnapshot());
+            Q_EMIT DeviceMounted(QJsonDocument(d->devices.value(deviceId)).toJson(QJsonDocument::Compact));
 
-        // Update device status
-        QJsonObject deviceData = d->devices.value(deviceId);
-        deviceData.insert(QStringLiteral("mounted"), true);
-        deviceData.insert(QStringLiteral("mountPoint"), mountPoint->path());
-        d->devices.insert(deviceId, deviceData);
-
-        if (!(requestedMountOptions & Hemera::RemovableStorage::ReadOnly) && access(mountPoint->path().toLatin1().constData(), R_OK | W_OK) < 0) {
             if (dbusMessage.type() != QDBusMessage::InvalidMessage) {
-                QDBusConnection::systemBus().send(dbusMessage.createErrorReply(Hemera::RemovableStorage::Errors::notWriteable(),
-                                                                               QStringLiteral("Could not mount filesystem for writing.")));
+                QDBusConnection::systemBus().send(dbusMessage.createReply(QVariantList{ mountPoint->path() }));
             }
-            Q_EMIT errorOccurred(deviceId, Hemera::RemovableStorage::Errors::notWriteable(), QStringLiteral("Could not mount filesystem for writing."));
-            // Unmount
-            Unmount(deviceId);
-        }
+        });
 
-        Q_EMIT mountFinished(deviceId);
-        Q_EMIT DevicesChanged(d->devicesToJson().toJson(QJsonDocument::Compact));
-        Q_EMIT DeviceMounted(QJsonDocument(d->devices.value(deviceId)).toJson(QJsonDocument::Compact));
+        mountWatcher->setFuture(QtConcurrent::run([deviceId, mountPointPath, filesystem, mountOptions] () -> MountBackend::Result {
+            return MountBackend::mount(deviceId, mountPointPath, filesystem, mountOptions);
+        }));
+    };
 
-        if (dbusMessage.type() != QDBusMessage::InvalidMessage) {
-            QDBusConnection::systemBus().send(dbusMessage.createReply(QVariantList{ mountPoint->path() }));
-        }
+    if (dbusMessage.type() == QDBusMessage::InvalidMessage) {
+        // root
+        startMount(0);
+    } else {
+        // Ask the bus who is calling, without blocking on it.
+        CredentialsOperation *credentialsOperation = d->credentials->resolve(dbusMessage.service());
+        connect(credentialsOperation, &Hemera::Operation::finished, this, [this, credentialsOperation, dbusMessage, deviceId, mountPoint, startMount] {
+            if (credentialsOperation->isError()) {
+                qWarning() << "Could not resolve the credentials of" << dbusMessage.service() << credentialsOperation->errorMessage();
+                QDBusConnection::systemBus().send(dbusMessage.createErrorReply(credentialsOperation->errorName(), credentialsOperation->errorMessage()));
+                Q_EMIT errorOccurred(deviceId, credentialsOperation->errorName(), credentialsOperation->errorMessage());
+                delete mountPoint;
+                return;
+            }
 
-        mountProcess->deleteLater();
-    });
+            qDebug() << "Will mount for uid" << credentialsOperation->uid();
+            startMount(credentialsOperation->uid());
+        });
+    }
 
     return mountPoint->path();
 }
@@ -549,88 +984,285 @@ void RemovableStorageManager::Unmount(const QString &deviceId)
         return;
     }
 
-    // Ok, let's unmount.
-    QProcess *unmountProcess = new QProcess(this);
-    unmountProcess->setProgram(QStringLiteral("umount"));
-    unmountProcess->setArguments(QStringList{ deviceId });
-    Hemera::ProcessOperation *op = new Hemera::ProcessOperation(unmountProcess, this);
+    // Is somebody else already getting rid of it? Then just wait for the same outcome.
+    QSharedPointer< Private::PendingUnmount > pending = d->pendingUnmounts.value(deviceId);
+    if (!pending.isNull()) {
+        if (dbusMessage.type() != QDBusMessage::InvalidMessage) {
+            pending->messages.append(dbusMessage);
+        }
+        return;
+    }
+
+    // Ok, let's unmount. Copies in flight would keep the filesystem busy.
+    d->cancelCopyJobs(deviceId);
+    QString mountPointPath = d->mountPoints.value(deviceId)->path();
 
-    connect(op, &Hemera::Operation::finished, this, [this, dbusMessage, deviceId, unmountProcess] {
-        if (unmountProcess->exitStatus() == QProcess::CrashExit) {
-            unmountProcess->deleteLater();
-            qWarning() << "Umount crashed!";
-            if (dbusMessage.type() != QDBusMessage::InvalidMessage) {
-                QDBusConnection::systemBus().send(dbusMessage.createErrorReply(QLatin1String(Hemera::Literals::Errors::unhandledRequest()),
-                                                                               QStringLiteral("Process crashed")));
-            }
-            Q_EMIT errorOccurred(deviceId, QLatin1String(Hemera::Literals::Errors::unhandledRequest()), QStringLiteral("Process crashed"));
+    pending = QSharedPointer< Private::PendingUnmount >(new Private::PendingUnmount);
+    pending->deviceId = deviceId;
+    pending->mountPoint = mountPointPath;
+    if (dbusMessage.type() != QDBusMessage::InvalidMessage) {
+        pending->messages.append(dbusMessage);
+    }
+    pending->elapsed.start();
+    d->pendingUnmounts.insert(deviceId, pending);
+
+    QFutureWatcher< MountBackend::Result > *unmountWatcher = new QFutureWatcher< MountBackend::Result >(this);
+    connect(unmountWatcher, &QFutureWatcher< MountBackend::Result >::finished, this,
+            [this, deviceId, unmountWatcher, mountPointPath, pending] {
+        MountBackend::Result result = unmountWatcher->result();
+        unmountWatcher->deleteLater();
+
+        if (!result.isError()) {
+            d->completeUnmount(pending, result, QStringLiteral("unmount"));
             return;
         }
 
-        if (unmountProcess->exitCode() != 0) {
-            qWarning() << "Umount failed! Trying a force umount";
-            qWarning() << unmountProcess->readAll();
-
-            // Don't block gravity on sync()!
-            QFutureWatcher< int > *forceUmountWatcher = new QFutureWatcher< int >(this);
-            connect(forceUmountWatcher, &QFutureWatcher< int >::finished, this, [this, deviceId, forceUmountWatcher, dbusMessage] {
-                if (forceUmountWatcher->result() != 0) {
-                    qWarning() << "Force umount failed! Giving up.";
-                    if (dbusMessage.type() != QDBusMessage::InvalidMessage) {
-                        QDBusConnection::systemBus().send(dbusMessage.createErrorReply(QLatin1String(Hemera::Literals::Errors::failedRequest()),
-                                                                                       QStringLiteral("Process exited with %1").arg(forceUmountWatcher->result())));
-                    }
-
-                    Q_EMIT errorOccurred(deviceId, QLatin1String(Hemera::Literals::Errors::failedRequest()),
-                                         QStringLiteral("Process exited with %1").arg(forceUmountWatcher->result()));
-                } else {
-                    qDebug() << "Force umount was successful!";
-                    // Umount successful! Let's register the change.
-                    d->removeDeviceFromStorage(deviceId, dbusMessage.service());
-                    Q_EMIT unmountFinished(deviceId);
-                    Q_EMIT DevicesChanged(d->devicesToJson().toJson(QJsonDocument::Compact));
-                    Q_EMIT DeviceUnmounted(QJsonDocument(d->devices.value(deviceId)).toJson(QJsonDocument::Compact));
-
-                    if (dbusMessage.type() != QDBusMessage::InvalidMessage) {
-                        QDBusConnection::systemBus().send(dbusMessage.createReply());
-                    }
-                }
+        qWarning() << "Umount failed!" << result.errorMessage << "Flushing the device and retrying";
 
-                forceUmountWatcher->deleteLater();
-            });
-
-            QFuture< int > forceUmountFuture = QtConcurrent::run([this, deviceId] () -> int {
-                ::sync();
-                QProcess forceUmountProcess;
-                forceUmountProcess.setProgram(QStringLiteral("umount"));
-                forceUmountProcess.setArguments(QStringList{ QStringLiteral("-l"), QStringLiteral("-f"), deviceId });
-                forceUmountProcess.start();
-                if (!forceUmountProcess.waitForFinished()) {
-                    return -1;
-                }
-                if (forceUmountProcess.exitCode() != 0) {
-                    qDebug() << "umount failed!" << forceUmountProcess.readAll();
-                }
+        // From now on, the deadline counts
+        pending->firstAttempt = pending->elapsed.restart();
 
-                return forceUmountProcess.exitCode();
-            });
-            forceUmountWatcher->setFuture(forceUmountFuture);
-            unmountProcess->deleteLater();
-            return;
+        // Whatever happens, don't keep the device around past the deadline: a slow flush included.
+        QTimer::singleShot(d->forceUnmountDeadline, this, [this, pending] { d->forceUnmount(pending); });
+
+        // Flush only the filesystem we are getting rid of, not the whole system. Don't block gravity on it!
+        Q_EMIT UnmountProgress(deviceId, QStringLiteral("syncing"), 0);
+        QFutureWatcher< MountBackend::Result > *syncWatcher = new QFutureWatcher< MountBackend::Result >(this);
+        connect(syncWatcher, &QFutureWatcher< MountBackend::Result >::finished, this, [this, syncWatcher, pending] {
+            MountBackend::Result syncResult = syncWatcher->result();
+            syncWatcher->deleteLater();
+
+            if (syncResult.isError()) {
+                qWarning() << "Could not flush" << pending->deviceId << syncResult.errorMessage;
+            } else if (!pending->finished && !pending->forcing) {
+                Q_EMIT UnmountProgress(pending->deviceId, QStringLiteral("synced"), pending->elapsed.elapsed());
+            }
+
+            d->retryUnmount(pending);
+        });
+
+        syncWatcher->setFuture(QtConcurrent::run([mountPointPath] () -> MountBackend::Result {
+            return MountBackend::syncFilesystem(mountPointPath);
+        }));
+    });
+
+    unmountWatcher->setFuture(QtConcurrent::run([mountPointPath] () -> MountBackend::Result {
+        return MountBackend::unmount(mountPointPath);
+    }));
+}
+
+quint64 RemovableStorageManager::Private::startCopy(const QString &deviceId, const QString &source, const QString &destination,
+                                                    const QString &service, uid_t uid, QString *errorName, QString *errorMessage)
+{
+    auto fail = [deviceId, errorName, errorMessage] (const QString &name, const QString &message) -> quint64 {
+        qWarning() << "Refusing copy on" << deviceId << ":" << message;
+        *errorName = name;
+        *errorMessage = message;
+        return 0;
+    };
+
+    if (!mountPoints.contains(deviceId)) {
+        return fail(Hemera::RemovableStorage::Errors::notMounted(), QStringLiteral("Device %1 is not mounted!").arg(deviceId));
+    }
+    if (!service.isEmpty() && service != mountedDevices.value(deviceId)) {
+        return fail(Hemera::RemovableStorage::Errors::notOwnedByApplication(),
+                    QStringLiteral("Device %1 was not mounted by this service!").arg(deviceId));
+    }
+
+    gid_t gid;
+    QString home;
+    if (!lookupUser(uid, &gid, &home)) {
+        return fail(QLatin1String(Hemera::Literals::Errors::notAllowed()), QStringLiteral("uid %1 does not exist").arg(uid));
+    }
+
+    // Unless configured otherwise, users can only copy to and from their own home.
+    QStringList allowedPaths = copyAllowedPaths.isEmpty() ? QStringList() << home : copyAllowedPaths;
+
+    auto isWithin = [] (const QString &path, const QString &root) -> bool {
+        return !path.isEmpty() && !root.isEmpty() && (path == root || path.startsWith(root + QLatin1Char('/')));
+    };
+    // The allowed path containing path, if any
+    auto allowedRoot = [&allowedPaths, isWithin] (const QString &path) -> QString {
+        for (const QString &allowedPath : allowedPaths) {
+            QString root = QFileInfo(allowedPath).canonicalFilePath();
+            if (isWithin(path, root)) {
+                return root;
+            }
         }
+        return QString();
+    };
+
+    // Resolve everything: a symlink must not take us anywhere we didn't agree upon.
+    QString mountPointPath = QFileInfo(mountPoints.value(deviceId)->path()).canonicalFilePath();
+    QString canonicalSource = QFileInfo(source).canonicalFilePath();
+    QFileInfo destinationInfo(destination);
+    QString destinationParent = destinationInfo.absoluteDir().canonicalPath();
+    QString canonicalDestination = destinationParent.isEmpty() ? QString() :
+                                   QStringLiteral("%1/%2").arg(destinationParent, destinationInfo.fileName());
+
+    if (canonicalSource.isEmpty()) {
+        return fail(QLatin1String(Hemera::Literals::Errors::notFound()), QStringLiteral("%1 does not exist").arg(source));
+    }
+    if (canonicalDestination.isEmpty() || destinationInfo.fileName().isEmpty()) {
+        return fail(QLatin1String(Hemera::Literals::Errors::badRequest()), QStringLiteral("%1 is not a valid destination").arg(destination));
+    }
 
-        // Umount successful! Let's register the change.
-        d->removeDeviceFromStorage(deviceId, dbusMessage.service());
-        Q_EMIT unmountFinished(deviceId);
-        Q_EMIT DevicesChanged(d->devicesToJson().toJson(QJsonDocument::Compact));
-        Q_EMIT DeviceUnmounted(QJsonDocument(d->devices.value(deviceId)).toJson(QJsonDocument::Compact));
+    QString sourceRoot;
+    QString destinationRoot;
+    if (isWithin(canonicalSource, mountPointPath) && !allowedRoot(canonicalDestination).isEmpty()) {
+        sourceRoot = mountPointPath;
+        destinationRoot = allowedRoot(canonicalDestination);
+    } else if (!allowedRoot(canonicalSource).isEmpty() && isWithin(canonicalDestination, mountPointPath)) {
+        sourceRoot = allowedRoot(canonicalSource);
+        destinationRoot = mountPointPath;
+    } else {
+        return fail(QLatin1String(Hemera::Literals::Errors::notAllowed()),
+                    QStringLiteral("Copies are allowed only between %1 and an allowed local path").arg(deviceId));
+    }
+    if (canonicalDestination == destinationRoot) {
+        return fail(QLatin1String(Hemera::Literals::Errors::badRequest()), QStringLiteral("%1 is not a valid destination").arg(destination));
+    }
+    if (isWithin(canonicalDestination, canonicalSource)) {
+        return fail(QLatin1String(Hemera::Literals::Errors::badRequest()), QStringLiteral("Cannot copy %1 into itself").arg(source));
+    }
 
-        if (dbusMessage.type() != QDBusMessage::InvalidMessage) {
-            QDBusConnection::systemBus().send(dbusMessage.createReply());
+    quint64 jobId = nextCopyJobId++;
+    CopyJob copyJob;
+    copyJob.job = QSharedPointer< CopyEngine::Job >(new CopyEngine::Job);
+    copyJob.job->sourceRoot = sourceRoot;
+    copyJob.job->source = canonicalSource.mid(sourceRoot.size() + 1);
+    copyJob.job->destinationRoot = destinationRoot;
+    copyJob.job->destination = canonicalDestination.mid(destinationRoot.size() + 1);
+    copyJob.job->uid = uid;
+    copyJob.job->gid = gid;
+    copyJob.deviceId = deviceId;
+    copyJob.service = service;
+    copyJob.elapsed.start();
+    copyJobs.insert(jobId, copyJob);
+
+    QSharedPointer< CopyEngine::Job > job = copyJob.job;
+    QFutureWatcher< CopyEngine::Result > *copyWatcher = new QFutureWatcher< CopyEngine::Result >(q);
+    QObject::connect(copyWatcher, &QFutureWatcher< CopyEngine::Result >::finished, q, [this, copyWatcher, jobId] {
+        CopyEngine::Result result = copyWatcher->result();
+        copyWatcher->deleteLater();
+
+        CopyJob copyJob = copyJobs.take(jobId);
+        if (copyJobs.isEmpty()) {
+            copyProgressTimer->stop();
+        }
+
+        qint64 elapsed = copyJob.elapsed.elapsed();
+        qint64 bytesCopied = copyJob.job->bytesCopied.load();
+        qDebug() << "Copy job" << jobId << "finished:" << bytesCopied << "bytes in" << elapsed << "ms" << result.errorMessage;
+        if (result.isError()) {
+            ++failures[QStringLiteral("copy")];
+        }
+        latencies[QStringLiteral("copy")].record(elapsed);
+        copiedBytes += bytesCopied;
+        copyingTime += elapsed;
+
+        Q_EMIT q->CopyFinished(jobId, result.errorName, result.errorMessage, bytesCopied, elapsed);
+    });
+
+    copyWatcher->setFuture(QtConcurrent::run(copyPool, [job] () -> CopyEngine::Result {
+        return CopyEngine::copy(job.data());
+    }));
+
+    if (!copyProgressTimer->isActive()) {
+        copyProgressTimer->start();
+    }
+
+    return jobId;
+}
+
+qulonglong RemovableStorageManager::Copy(const QString &deviceId, const QString &source, const QString &destination)
+{
+    QString errorName;
+    QString errorMessage;
+
+    if (!calledFromDBus()) {
+        // Gravity itself
+        quint64 jobId = d->startCopy(deviceId, source, destination, QString(), ::geteuid(), &errorName, &errorMessage);
+        if (!jobId) {
+            Q_EMIT errorOccurred(deviceId, errorName, errorMessage);
+        }
+        return jobId;
+    }
+
+    QDBusMessage dbusMessage = message();
+    setDelayedReply(true);
+
+    // Copies run with the credentials of the caller: find out who it is, without blocking on it.
+    CredentialsOperation *credentialsOperation = d->credentials->resolve(dbusMessage.service());
+    connect(credentialsOperation, &Hemera::Operation::finished, this,
+            [this, credentialsOperation, dbusMessage, deviceId, source, destination] {
+        QString errorName = credentialsOperation->errorName();
+        QString errorMessage = credentialsOperation->errorMessage();
+        quint64 jobId = 0;
+
+        if (!credentialsOperation->isError()) {
+            jobId = d->startCopy(deviceId, source, destination, dbusMessage.service(), credentialsOperation->uid(),
+                                 &errorName, &errorMessage);
+        }
+
+        if (!jobId) {
+            QDBusConnection::systemBus().send(dbusMessage.createErrorReply(errorName, errorMessage));
+            Q_EMIT errorOccurred(deviceId, errorName, errorMessage);
+            return;
         }
 
-        unmountProcess->deleteLater();
+        QDBusConnection::systemBus().send(dbusMessage.createReply(QVariant::fromValue(static_cast< qulonglong >(jobId))));
     });
+
+    return 0;
+}
+
+void RemovableStorageManager::CancelCopy(qulonglong jobId)
+{
+    if (!d->copyJobs.contains(jobId)) {
+        if (calledFromDBus()) {
+            sendErrorReply(QLatin1String(Hemera::Literals::Errors::notFound()), QStringLiteral("No such copy job"));
+        }
+        return;
+    }
+
+    if (calledFromDBus() && message().service() != d->copyJobs.value(jobId).service) {
+        sendErrorReply(QLatin1String(Hemera::Literals::Errors::notAllowed()), QStringLiteral("The copy job belongs to another service"));
+        return;
+    }
+
+    d->copyJobs.value(jobId).job->cancelled.store(1);
+}
+
+QVariantMap RemovableStorageManager::Metrics() const
+{
+    QVariantMap latencies;
+    for (QHash< QString, LatencyHistogram >::const_iterator i = d->latencies.constBegin(); i != d->latencies.constEnd(); ++i) {
+        latencies.insert(i.key(), i.value().toVariantMap());
+    }
+
+    QVariantMap failures;
+    for (QHash< QString, quint64 >::const_iterator i = d->failures.constBegin(); i != d->failures.constEnd(); ++i) {
+        failures.insert(i.key(), i.value());
+    }
+
+    QVariantMap udev;
+    udev.insert(QStringLiteral("wakeups"), d->udevWakeups);
+    udev.insert(QStringLiteral("events"), d->udevEvents);
+    udev.insert(QStringLiteral("largestBurst"), d->udevLargestBurst);
+
+    QVariantMap copies;
+    copies.insert(QStringLiteral("bytes"), d->copiedBytes);
+    copies.insert(QStringLiteral("time"), d->copyingTime);
+    copies.insert(QStringLiteral("bytesPerSecond"), d->copyingTime > 0 ? d->copiedBytes * 1000 / d->copyingTime : 0);
+
+    QVariantMap result;
+    result.insert(QStringLiteral("histogramBounds"), LatencyHistogram::bounds());
+    result.insert(QStringLiteral("latencies"), latencies);
+    result.insert(QStringLiteral("failures"), failures);
+    result.insert(QStringLiteral("udev"), udev);
+    result.insert(QStringLiteral("copies"), copies);
+    return result;
 }
 
 QList< QString > RemovableStorageManager::devices() const
@@ -654,5 +1286,3 @@ Hemera::Operation *RemovableStorageManager::unmount(const QString &deviceId)
 }
 
 }
-
-#include "gravityremovablestoragemanager.moc"
@@ -3,6 +3,7 @@
 
 #include <HemeraCore/AsyncInitDBusObject>
 
+#include <QtCore/QVariantMap>
 #include <QtDBus/QDBusContext>
 
 #include <GravitySupermassive/Global>
@@ -15,6 +16,8 @@ class StringOperation;
 
 namespace Gravity {
 
+class DeviceMonitor;
+
 class HEMERA_GRAVITY_EXPORT RemovableStorageManager : public Hemera::AsyncInitDBusObject
 {
     Q_OBJECT
@@ -25,24 +28,35 @@ public:
     virtual ~RemovableStorageManager();
 
     static RemovableStorageManager *instance();
+    /// As instance(), but devices come from monitor instead of udev. Meant for tests and benchmarks.
+    static RemovableStorageManager *instance(DeviceMonitor *monitor);
 
     // DBus methods
     QByteArray ListDevices();
+    QByteArray ListDevices(qulonglong sinceGeneration);
     QString Mount(const QString &deviceId, int options);
     void Unmount(const QString &deviceId);
+    qulonglong Copy(const QString &deviceId, const QString &source, const QString &destination);
+    void CancelCopy(qulonglong jobId);
+    QVariantMap Metrics() const;
 
     // Internal Gravity methods
     Hemera::StringOperation *mount(const QString &deviceId, int options);
     Hemera::Operation *unmount(const QString &deviceId);
     QList< QString > devices() const;
     QHash< QString, QString > mountedDevices() const;
+    qulonglong generation() const;
 
 Q_SIGNALS:
     void DevicesChanged(const QByteArray &devices);
+    void DeviceChanged(qulonglong generation, const QString &deviceName, const QByteArray &device);
     void DeviceAdded(const QByteArray &device);
     void DeviceRemoved(const QString &deviceName);
     void DeviceMounted(const QByteArray &device);
     void DeviceUnmounted(const QByteArray &device);
+    void UnmountProgress(const QString &deviceName, const QString &stage, qulonglong elapsed);
+    void CopyProgress(qulonglong jobId, qlonglong bytesCopied, qlonglong totalBytes, int filesCopied, int totalFiles, qlonglong bytesPerSecond);
+    void CopyFinished(qulonglong jobId, const QString &errorName, const QString &errorMessage, qlonglong bytesCopied, qlonglong elapsed);
     void mountFinished(const QString &device);
     void unmountFinished(const QString &device);
     void errorOccurred(const QString &device, const QString &errorName, const QString &errorMessage);
@@ -51,7 +65,7 @@ protected:
     virtual void initImpl() override final;
 
 private:
-    explicit RemovableStorageManager(QObject* parent);
+    explicit RemovableStorageManager(DeviceMonitor *monitor, QObject* parent);
 
     class Private;
     Private * const d;
@@ -0,0 +1,54 @@
+#ifndef GRAVITY_REMOVABLESTORAGEMANAGER_P_H
+#define GRAVITY_REMOVABLESTORAGEMANAGER_P_H
+
+#include "gravityremovablestoragemanager.h"
+
+#include <HemeraCore/CommonOperations>
+
+namespace Gravity
+{
+
+class MountOperation : public Hemera::StringOperation
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(MountOperation)
+
+public:
+    explicit MountOperation(const QString &device, int options, RemovableStorageManager *parent)
+        : StringOperation(parent), m_manager(parent), m_device(device), m_options(options) {}
+    virtual ~MountOperation() {}
+
+public Q_SLOTS:
+    virtual void startImpl() override final;
+
+    inline virtual QString result() const override final { return m_path; }
+
+private:
+    RemovableStorageManager *m_manager;
+    QString m_device;
+    int m_options;
+
+    QString m_path;
+};
+
+class UnmountOperation : public Hemera::Operation
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(UnmountOperation)
+
+public:
+    explicit UnmountOperation(const QString &device, RemovableStorageManager *parent)
+        : Operation(parent), m_manager(parent), m_device(device) {}
+    virtual ~UnmountOperation() {}
+
+public Q_SLOTS:
+    virtual void startImpl() override final;
+
+private:
+    RemovableStorageManager *m_manager;
+    QString m_device;
+};
+
+}
+
+#endif // GRAVITY_REMOVABLESTORAGEMANAGER_P_H
@@ -4,6 +4,7 @@
 #include "gravitysandbox.h"
 #include "gravitysandboxmanager.h"
 #include "gravitygalaxymanager.h"
+#include "gravitypropertychangebatcher.h"
 
 #include <HemeraCore/CommonOperations>
 #include <HemeraCore/Literals>
@@ -26,12 +27,15 @@ public:
 
     QStringList launchedSatellites;
     QStringList activeSatellites;
+
+    PropertyChangeBatcher *propertyBatcher;
 };
 
 SatelliteManager::SatelliteManager(const QString &star, QObject* parent)
     : AsyncInitDBusObject(parent)
     , d(new Private)
 {
+    d->propertyBatcher = new PropertyChangeBatcher(this);
     d->star = star;
 }
 
@@ -97,7 +101,7 @@ void SatelliteManager::LaunchOrbitAsSatellite(const QString& satellite)
 
         // Add it to our control list.
         d->launchedSatellites.append(satellite);
-        Q_EMIT launchedSatellitesChanged();
+        d->propertyBatcher->markDirty("LaunchedSatellites");
 
         callerConnection.send(callerMessage.createReply());
     });
@@ -126,9 +130,9 @@ void SatelliteManager::ShutdownSatellite(const QString& satellite)
             return;
         }
 
-        // Add it to our control list.
-        d->launchedSatellites.append(satellite);
-        Q_EMIT launchedSatellitesChanged();
+        // Remove it from our control list.
+        d->launchedSatellites.removeOne(satellite);
+        d->propertyBatcher->markDirty("LaunchedSatellites");
 
         callerConnection.send(callerMessage.createReply());
     });
@@ -155,7 +159,7 @@ void SatelliteManager::ShutdownAllSatellites()
         connect(op, &Hemera::Operation::finished, [this, op, satellite] {
             if (!op->isError()) {
                 d->launchedSatellites.removeOne(satellite);
-                Q_EMIT launchedSatellitesChanged();
+                d->propertyBatcher->markDirty("LaunchedSatellites");
             }
         });
     }
@@ -1,10 +1,14 @@
 #include "gravitystarsequence_p.h"
 
 #include <QtCore/QDebug>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
 #include <QtCore/QTimer>
 
 #include <QtDBus/QDBusConnection>
 #include <QtDBus/QDBusMessage>
+#include <QtDBus/QDBusServer>
 #include <QtDBus/QDBusServiceWatcher>
 
 #include <QtQml/QQmlComponent>
@@ -24,6 +28,8 @@
 
 #include <sys/types.h>
 #include <pwd.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <systemd/sd-daemon.h>
 
 namespace Gravity
@@ -216,7 +222,7 @@ void StarSequence::Private::setPhase(Phase p)
 {
     if (p != phase) {
         phase = p;
-        Q_EMIT q->phaseChanged();
+        propertyBatcher->markDirty("phase");
     }
 }
 
@@ -270,9 +276,76 @@ Hemera::Operation *StarSequence::deinjectOrbit()
     return op;
 }
 
-void StarSequence::Private::sendBackReply(const QDBusMessage &reply)
+void StarSequence::Private::sendBackReply(const QDBusConnection &connection, const QDBusMessage &reply)
 {
-    QDBusConnection::systemBus().send(reply);
+    connection.send(reply);
+}
+
+void StarSequence::Private::setupPrivateBus()
+{
+    QString socketPath = q->privateBusAddress(star).mid(qstrlen("unix:path="));
+
+    QDir().mkpath(QFileInfo(socketPath).absolutePath());
+    // Clean up leftovers from a previous run
+    QFile::remove(socketPath);
+
+    privateBusServer = new QDBusServer(q->privateBusAddress(star), q);
+    if (!privateBusServer->isConnected()) {
+        qWarning() << "Could not create the private bus for star" << star << privateBusServer->lastError().message()
+                   << "- Parsec will go through the system bus.";
+        privateBusServer->deleteLater();
+        privateBusServer = Q_NULLPTR;
+        return;
+    }
+
+    // libdbus only accepts peers with our own uid by default: access control is delegated to the socket's permissions.
+    privateBusServer->setAnonymousAuthenticationAllowed(true);
+
+    struct passwd *pw = getpwnam(star.toLatin1().constData());
+    if (!pw || ::chown(socketPath.toLatin1().constData(), pw->pw_uid, pw->pw_gid) < 0 ||
+        ::chmod(socketPath.toLatin1().constData(), S_IRUSR | S_IWUSR) < 0) {
+        qWarning() << "Could not hand the private bus over to star" << star << "- Parsec will go through the system bus.";
+        privateBusServer->deleteLater();
+        privateBusServer = Q_NULLPTR;
+        QFile::remove(socketPath);
+        return;
+    }
+
+    QObject::connect(privateBusServer, &QDBusServer::newConnection, q, [this] (const QDBusConnection &connection) {
+        // A new Parsec means the previous one is gone: forget its connections before their names can be reused.
+        pruneDeadPeers();
+
+        QDBusConnection peer(connection);
+        peerConnections.insert(peer.name());
+
+        peer.registerObject(busPath, q);
+        if (satelliteManager) {
+            peer.registerObject(QString::fromLatin1(Hemera::Literals::DBus::satelliteManagerPath()).arg(star), satelliteManager);
+        }
+
+        qDebug() << "Parsec connected through the private bus for star" << star;
+    });
+}
+
+void StarSequence::Private::pruneDeadPeers()
+{
+    for (QSet< QString >::iterator i = peerConnections.begin(); i != peerConnections.end();) {
+        if (QDBusConnection(*i).isConnected()) {
+            ++i;
+            continue;
+        }
+
+        qDebug() << "Parsec disconnected from the private bus for star" << star;
+        QDBusConnection::disconnectFromPeer(*i);
+        i = peerConnections.erase(i);
+    }
+}
+
+bool StarSequence::Private::isTrustedPeer(const QDBusConnection &connection)
+{
+    // Only the star's Parsec can reach the private bus. Names of connections which went away mean nothing.
+    pruneDeadPeers();
+    return peerConnections.contains(connection.name());
 }
 
 bool StarSequence::Private::canSwitchOrbit()
@@ -285,7 +358,7 @@ void StarSequence::Private::setOrbit(const QString& newType)
     activeOrbit = newType;
 
     updateSystemdStatus();
-    Q_EMIT q->activeOrbitChanged(activeOrbit);
+    propertyBatcher->markDirty("activeOrbit");
 }
 
 Hemera::Operation *StarSequence::Private::controlOrbitService(const Sandbox &sandbox, ControlUnitOperation::Mode operationMode)
@@ -298,6 +371,9 @@ StarSequence::StarSequence(const QString &star, const QString &activeOrbit, cons
     : Hemera::AsyncInitDBusObject(parent)
     , d(new Private(this))
 {
+    d->propertyBatcher = new PropertyChangeBatcher(this);
+    // Whoever is about to switch orbit has to know right away it can't
+    d->propertyBatcher->setImmediate("isOrbitSwitchInhibited");
     d->initialActiveOrbit = activeOrbit;
     d->residentOrbit = residentOrbit;
     d->busPath = QString::fromLatin1(Hemera::Literals::DBus::starSequencePath()).arg(star);
@@ -314,6 +390,11 @@ QDBusObjectPath StarSequence::busPath() const
     return QDBusObjectPath(d->busPath);
 }
 
+QString StarSequence::privateBusAddress(const QString &star)
+{
+    return QStringLiteral("unix:path=%1/%2/dbus/gravity_center_socket").arg(QLatin1String(StaticConfig::hemeraStarsRuntimeDir()), star);
+}
+
 void StarSequence::setShouldUpdateSystemd(bool update)
 {
     d->shouldUpdateSystemd = update;
@@ -381,7 +462,10 @@ void StarSequence::initImpl()
     new StarSequenceAdaptor(this);
 
     // Bring up satellite manager
-    (new SatelliteManager(d->star, this))->init();
+    d->satelliteManager = new SatelliteManager(d->star, this);
+    d->satelliteManager->init();
+
+    d->setupPrivateBus();
 
     setOnePartIsReady();
 }
@@ -462,7 +546,7 @@ quint16 StarSequence::inhibitOrbitSwitch(const QString& requesterName, const QSt
         return 0;
     }
 
-    if (message().service().isEmpty()) {
+    if (message().service().isEmpty() && !d->isTrustedPeer(connection())) {
         qWarning() << "The service name of the context is empty. Something terrible is going on. Rejecting.";
         // Send a reply
         sendErrorReply(QDBusError::InternalError, QStringLiteral("The caller is apparently not advertising any service name."));
@@ -479,7 +563,7 @@ void StarSequence::releaseOrbitSwitchInhibition(quint16 cookie)
         return;
     }
 
-    if (message().service().isEmpty()) {
+    if (message().service().isEmpty() && !d->isTrustedPeer(connection())) {
         qWarning() << "The service name of the context is empty. Something terrible is going on. Rejecting.";
         // Send a reply
         sendErrorReply(QDBusError::InternalError, QStringLiteral("The caller is apparently not advertising any service name."));
@@ -498,12 +582,13 @@ quint16 StarSequence::Private::inhibitOrbitSwitch(const QString& dbusService, co
     qDebug() << "Added inhibition from an explicit DBus service, " << dbusService << ", with cookie " <<
             lastCookie << " with " << reason;
 
+    // Reasons first: they go along when isOrbitSwitchInhibited flushes right away
+    propertyBatcher->markDirty("inhibitionReasons");
+
     if (cookieToInhibition.size() == 1) {
-        Q_EMIT q->isOrbitSwitchInhibitedChanged(q->isOrbitSwitchInhibited());
+        propertyBatcher->markDirty("isOrbitSwitchInhibited");
     }
 
-    Q_EMIT q->inhibitionReasonsChanged(q->inhibitionReasons());
-
     return lastCookie;
 }
 
@@ -516,11 +601,11 @@ void StarSequence::Private::releaseOrbitSwitchInhibition(const QString &dbusServ
     qDebug() << "Released inhibition with cookie " << cookie;
     cookieToInhibition.remove(cookie);
 
+    propertyBatcher->markDirty("inhibitionReasons");
+
     if (!q->isOrbitSwitchInhibited()) {
-        Q_EMIT q->isOrbitSwitchInhibitedChanged(q->isOrbitSwitchInhibited());
+        propertyBatcher->markDirty("isOrbitSwitchInhibited");
     }
-
-    Q_EMIT q->inhibitionReasonsChanged(q->inhibitionReasons());
 }
 
 void StarSequence::reloadCurrentOrbit()
@@ -538,11 +623,12 @@ void StarSequence::reloadCurrentOrbit()
 
     setDelayedReply(true);
     QDBusMessage m = message();
-    connect(reloadCurrentOrbit(&nullReloadHook, nullptr), &Hemera::Operation::finished, [this, m] (Hemera::Operation *op) {
+    QDBusConnection c = connection();
+    connect(reloadCurrentOrbit(&nullReloadHook, nullptr), &Hemera::Operation::finished, [this, m, c] (Hemera::Operation *op) {
         if (!op || op->isError()) {
-            StarSequence::Private::sendBackReply(m.createErrorReply(op->errorName(), op->errorMessage()));
+            StarSequence::Private::sendBackReply(c, m.createErrorReply(op->errorName(), op->errorMessage()));
         } else {
-            StarSequence::Private::sendBackReply(m.createReply());
+            StarSequence::Private::sendBackReply(c, m.createReply());
         }
     });
 }
@@ -582,11 +668,12 @@ void StarSequence::requestOrbitSwitch(const QString &orbit)
     // Now the reply has to be delayed
     setDelayedReply(true);
     QDBusMessage m = message();
-    connect(d->requestOrbitSwitch(GalaxyManager::availableSandboxes().value(orbit)), &Hemera::Operation::finished, [this, m] (Hemera::Operation *op) {
+    QDBusConnection c = connection();
+    connect(d->requestOrbitSwitch(GalaxyManager::availableSandboxes().value(orbit)), &Hemera::Operation::finished, [this, m, c] (Hemera::Operation *op) {
         if (!op || op->isError()) {
-            StarSequence::Private::sendBackReply(m.createErrorReply(op->errorName(), op->errorMessage()));
+            StarSequence::Private::sendBackReply(c, m.createErrorReply(op->errorName(), op->errorMessage()));
         } else {
-            StarSequence::Private::sendBackReply(m.createReply());
+            StarSequence::Private::sendBackReply(c, m.createReply());
         }
     });
 }
@@ -39,6 +39,9 @@ public:
 
     QDBusObjectPath busPath() const;
 
+    /// Address of the private, peer to peer link Gravity Center offers to the star's Parsec.
+    static QString privateBusAddress(const QString &star);
+
     QString activeOrbit() const;
     QString residentOrbit() const;
     bool isOrbitSwitchInhibited() const;
@@ -4,8 +4,10 @@
 #include "gravitystarsequence.h"
 
 #include "gravityoperations.h"
+#include "gravitypropertychangebatcher.h"
 
 #include <QtCore/QPointer>
+#include <QtCore/QSet>
 #include <QtCore/QStringList>
 
 #include <QtDBus/QDBusMessage>
@@ -14,10 +16,13 @@
 #include <QtQml/QQmlComponent>
 
 class OrgFreedesktopSystemd1ManagerInterface;
+class QDBusServer;
 
 namespace Gravity
 {
 
+class SatelliteManager;
+
 struct Orbit
 {
     QString name;
@@ -63,7 +68,8 @@ class StarSequence::Private
 {
 public:
     Private(StarSequence *q) : q(q), phase(Phase::Unknown), lastCookie(0),
-                               isShuttingDown(false), shouldUpdateSystemd(true) {}
+                               isShuttingDown(false), shouldUpdateSystemd(true),
+                               satelliteManager(Q_NULLPTR), privateBusServer(Q_NULLPTR) {}
 
     StarSequence *q;
 
@@ -88,8 +94,21 @@ public:
 
     QString busPath;
 
+    SatelliteManager *satelliteManager;
+
+    // Private link to Parsec. Names of the peer connections established on it.
+    QDBusServer *privateBusServer;
+    QSet< QString > peerConnections;
+
+    void setupPrivateBus();
+    void pruneDeadPeers();
+    bool isTrustedPeer(const QDBusConnection &connection);
+
     OrgFreedesktopSystemd1ManagerInterface *systemdManager;
 
+    // Orbit switches touch several properties in a row: notify them all at once.
+    PropertyChangeBatcher *propertyBatcher;
+
     bool isShuttingDown;
     bool shouldUpdateSystemd;
 
@@ -105,7 +124,7 @@ public:
     quint16 inhibitOrbitSwitch(const QString &dbusService, const QString &reason);
     void releaseOrbitSwitchInhibition(const QString &dbusService, quint16 cookie);
 
-    static void sendBackReply(const QDBusMessage &reply);
+    static void sendBackReply(const QDBusConnection &connection, const QDBusMessage &reply);
 
     void updateSystemdStatus();
 
@@ -0,0 +1,659 @@
+/*
+ * Drives RemovableStorageManager through full media lifecycles on loop devices.
+ *
+ * Usage: gravity-removablestorage-bench [--profiles] [cycles] [megabytes]
+ *
+ * A vfat, an ext4 and an exfat image are attached to loop devices, and the manager is fed add and remove
+ * events through a mock device monitor instead of udev. For each medium, every cycle probes, mounts,
+ * writes megabytes, unmounts and removes it through the manager's own operations. Latency percentiles
+ * for each step, write throughput and event throughput are reported, followed by the manager's Metrics().
+ *
+ * With --profiles, each medium is mounted instead with its built in mount profile and a few alternatives
+ * (atime, no flush, discard, longer journal commits), cycles times each. The median throughput for a large
+ * file and for many small files, and the median unmount time, are reported for every profile.
+ *
+ * It needs root and loop device support, nothing else: no physical media, no udev, no system bus.
+ * Without them the run is skipped, with exit code 77. Filesystems without a mkfs tool, or the kernel
+ * support to mount them, are skipped as well.
+ */
+
+#include "gravitydevicemonitor_p.h"
+#include "gravitymountbackend_p.h"
+#include "gravityremovablestoragemanager.h"
+
+#include <HemeraCore/CommonOperations>
+#include <HemeraCore/Operation>
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QEventLoop>
+#include <QtCore/QFile>
+#include <QtCore/QHash>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QProcess>
+#include <QtCore/QTemporaryDir>
+#include <QtCore/QTimer>
+#include <QtCore/QVector>
+
+#include <algorithm>
+#include <iostream>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <linux/loop.h>
+
+using namespace Gravity;
+
+namespace {
+
+const int s_skipped = 77;
+const qint64 s_imageSize = 64 * 1024 * 1024;
+const int s_timeout = 30000;
+const int s_burstSize = 32;
+const int s_smallFileCount = 256;
+const int s_smallFileSize = 16 * 1024;
+
+class MockDeviceMonitor : public DeviceMonitor
+{
+public:
+    virtual bool start(QList< Device > *, QString *) override final { return true; }
+
+    virtual QList< Device > takeEvents() override final {
+        QList< Device > events;
+        events.swap(m_events);
+        return events;
+    }
+
+    void inject(const Device &device) {
+        // Like the netlink socket: a single wakeup for whatever queues up in the meanwhile
+        if (m_events.isEmpty()) {
+            QTimer::singleShot(0, this, [this] { Q_EMIT eventsPending(); });
+        }
+        m_events.append(device);
+    }
+
+private:
+    QList< Device > m_events;
+};
+
+struct Medium {
+    Medium() : number(0), loopFd(-1), usable(true) {}
+
+    QString filesystem;
+    QString image;
+    QString device;
+    quint64 number;
+    int loopFd;
+    bool usable;
+};
+
+// Nanoseconds, reported in milliseconds
+class Samples
+{
+public:
+    void record(qint64 nsecs) { m_samples.append(nsecs); }
+
+    void report(const QString &name) {
+        if (m_samples.isEmpty()) {
+            return;
+        }
+
+        std::sort(m_samples.begin(), m_samples.end());
+        std::cout << name.toLocal8Bit().constData() << ": " << m_samples.count() << " samples, p50 " << msecs(percentile(50))
+                  << " ms, p90 " << msecs(percentile(90)) << " ms, p99 " << msecs(percentile(99))
+                  << " ms, max " << msecs(m_samples.last()) << " ms" << std::endl;
+    }
+
+private:
+    // Nearest rank
+    qint64 percentile(int percent) const {
+        int rank = (percent * m_samples.count() + 99) / 100;
+        return m_samples.at(qBound(0, rank - 1, m_samples.count() - 1));
+    }
+
+    static QByteArray msecs(qint64 nsecs) { return QByteArray::number(nsecs / 1000000.0, 'f', 2); }
+
+    QVector< qint64 > m_samples;
+};
+
+// Spins the event loop until done() holds. Timings are taken by the signal handlers, not here.
+template< typename Predicate >
+bool waitUntil(Predicate done)
+{
+    QElapsedTimer timeout;
+    timeout.start();
+
+    QEventLoop loop;
+    QTimer poll;
+    poll.setInterval(5);
+    QObject::connect(&poll, &QTimer::timeout, &loop, [&] {
+        if (done() || timeout.elapsed() > s_timeout) {
+            loop.quit();
+        }
+    });
+    poll.start();
+    if (!done()) {
+        loop.exec();
+    }
+
+    return done();
+}
+
+// Runs operation to completion. Returns false and fills errorMessage if it fails or times out.
+bool waitForOperation(Hemera::Operation *operation, QString *errorMessage, QString *result = nullptr)
+{
+    // Don't leave anything pointing to this stack frame behind, should the operation time out
+    QObject context;
+    bool finished = false;
+    QObject::connect(operation, &Hemera::Operation::finished, &context, [operation, &finished, errorMessage, result] {
+        finished = true;
+        if (operation->isError()) {
+            *errorMessage = operation->errorName() + QStringLiteral(": ") + operation->errorMessage();
+        } else if (result) {
+            *result = qobject_cast< Hemera::StringOperation* >(operation)->result();
+        }
+    });
+
+    if (!waitUntil([&finished] { return finished; })) {
+        *errorMessage = QStringLiteral("Timed out");
+        return false;
+    }
+
+    return errorMessage->isEmpty();
+}
+
+bool makeFilesystem(const QString &filesystem, const QString &image)
+{
+    QFile file(image);
+    if (!file.open(QIODevice::WriteOnly) || !file.resize(s_imageSize)) {
+        return false;
+    }
+    file.close();
+
+    QStringList arguments;
+    if (filesystem == QStringLiteral("ext4")) {
+        arguments << QStringLiteral("-q") << QStringLiteral("-F");
+    }
+    arguments << image;
+
+    QProcess mkfs;
+    mkfs.setProcessChannelMode(QProcess::MergedChannels);
+    mkfs.start(QStringLiteral("mkfs.") + filesystem, arguments);
+
+    return mkfs.waitForFinished() && mkfs.exitStatus() == QProcess::NormalExit && mkfs.exitCode() == 0;
+}
+
+// Read write, unlike MountBackend::attachLoopDevice. The device goes away as soon as loopFd is closed and it is unmounted.
+bool attachLoopDevice(Medium *medium)
+{
+    for (int attempt = 0; attempt < 10; ++attempt) {
+        int control = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+        int index = control < 0 ? -1 : ioctl(control, LOOP_CTL_GET_FREE);
+        if (control >= 0) {
+            close(control);
+        }
+        if (index < 0) {
+            return false;
+        }
+
+        // Containers usually come with /dev/loop-control only
+        QByteArray node = QByteArrayLiteral("/dev/loop") + QByteArray::number(index);
+        struct stat nodeStat;
+        if (stat(node.constData(), &nodeStat) < 0) {
+            if (mknod(node.constData(), S_IFBLK | 0660, makedev(7, index)) < 0 || stat(node.constData(), &nodeStat) < 0) {
+                return false;
+            }
+        }
+
+        int loopFd = open(node.constData(), O_RDWR | O_CLOEXEC);
+        int backingFd = open(QFile::encodeName(medium->image).constData(), O_RDWR | O_CLOEXEC);
+        int error = (loopFd < 0 || backingFd < 0 || ioctl(loopFd, LOOP_SET_FD, backingFd) < 0) ? errno : 0;
+        if (backingFd >= 0) {
+            close(backingFd);
+        }
+
+        if (error == 0) {
+            struct loop_info64 info;
+            memset(&info, 0, sizeof(info));
+            info.lo_flags = LO_FLAGS_AUTOCLEAR;
+            ioctl(loopFd, LOOP_SET_STATUS64, &info);
+
+            medium->device = QString::fromLatin1(node);
+            medium->number = nodeStat.st_rdev;
+            medium->loopFd = loopFd;
+            return true;
+        }
+
+        if (loopFd >= 0) {
+            close(loopFd);
+        }
+        // Somebody else got the same device in the meanwhile
+        if (error != EBUSY) {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+// Write throughput through the mount point, flushed to the device
+bool writeFile(const QString &mountPoint, int megabytes, qint64 *nsecs)
+{
+    QFile file(mountPoint + QStringLiteral("/gravity-bench.bin"));
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    QByteArray chunk(1024 * 1024, 'g');
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < megabytes; ++i) {
+        if (file.write(chunk) != chunk.size()) {
+            return false;
+        }
+    }
+    if (!file.flush() || fdatasync(file.handle()) < 0) {
+        return false;
+    }
+    *nsecs = timer.nsecsElapsed();
+
+    return true;
+}
+
+// Lots of small files, each one closed right away: where flush, atime and journal commits show up
+bool writeSmallFiles(const QString &mountPoint, int count, qint64 *nsecs)
+{
+    QByteArray content(s_smallFileSize, 'g');
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < count; ++i) {
+        QFile file(mountPoint + QStringLiteral("/gravity-bench-%1.bin").arg(i));
+        if (!file.open(QIODevice::WriteOnly) || file.write(content) != content.size()) {
+            return false;
+        }
+    }
+    // Read them back too: without noatime every read is a write
+    for (int i = 0; i < count; ++i) {
+        QFile file(mountPoint + QStringLiteral("/gravity-bench-%1.bin").arg(i));
+        if (!file.open(QIODevice::ReadOnly) || file.readAll().size() != content.size()) {
+            return false;
+        }
+    }
+
+    int fd = open(QFile::encodeName(mountPoint).constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || syncfs(fd) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    close(fd);
+    *nsecs = timer.nsecsElapsed();
+
+    return true;
+}
+
+bool isMounted(const QString &mountPoint)
+{
+    QByteArray entry = QFile::encodeName(mountPoint);
+    entry.prepend(' ').append(' ');
+
+    QFile mounts(QStringLiteral("/proc/self/mounts"));
+    return mounts.open(QIODevice::ReadOnly) && mounts.readAll().contains(entry);
+}
+
+// Returns s_skipped when there's nothing to run on
+int prepareMedia(const QTemporaryDir &workDir, QList< Medium > *media)
+{
+    if (geteuid() != 0 || access("/dev/loop-control", R_OK | W_OK) < 0) {
+        std::cout << "Root and loop device support are needed, skipping." << std::endl;
+        return s_skipped;
+    }
+
+    for (const QString &filesystem : { QStringLiteral("vfat"), QStringLiteral("ext4"), QStringLiteral("exfat") }) {
+        Medium medium;
+        medium.filesystem = filesystem;
+        medium.image = workDir.path() + QStringLiteral("/") + filesystem + QStringLiteral(".img");
+        if (!makeFilesystem(filesystem, medium.image)) {
+            std::cout << filesystem.toLatin1().constData() << ": could not create the filesystem, skipping." << std::endl;
+            continue;
+        }
+        if (!attachLoopDevice(&medium)) {
+            std::cerr << "Could not attach " << medium.image.toLocal8Bit().constData() << " to a loop device: " << strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        }
+        media->append(medium);
+    }
+    if (media->isEmpty()) {
+        std::cout << "No filesystem could be created, skipping." << std::endl;
+        return s_skipped;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int run(int cycles, int megabytes)
+{
+    QTemporaryDir workDir;
+    QList< Medium > media;
+    int prepared = prepareMedia(workDir, &media);
+    if (prepared != EXIT_SUCCESS) {
+        return prepared;
+    }
+
+    MockDeviceMonitor *monitor = new MockDeviceMonitor;
+    RemovableStorageManager *manager = RemovableStorageManager::instance(monitor);
+    QString errorMessage;
+    if (!waitForOperation(manager->init(), &errorMessage)) {
+        std::cerr << "Could not initialize the manager: " << errorMessage.toLocal8Bit().constData() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // When each device has been fully probed, and has gone
+    QElapsedTimer clock;
+    clock.start();
+    QHash< QString, qint64 > probedAt;
+    QHash< QString, qint64 > removedAt;
+    int devicesChanged = 0;
+    QObject::connect(manager, &RemovableStorageManager::DeviceAdded, [&clock, &probedAt] (const QByteArray &device) {
+        QJsonObject deviceData = QJsonDocument::fromJson(device).object();
+        if (!deviceData.value(QStringLiteral("filesystem")).toString().isEmpty()) {
+            probedAt.insert(deviceData.value(QStringLiteral("path")).toString(), clock.nsecsElapsed());
+        }
+    });
+    QObject::connect(manager, &RemovableStorageManager::DeviceRemoved, [&clock, &removedAt] (const QString &device) {
+        removedAt.insert(device, clock.nsecsElapsed());
+    });
+    QObject::connect(manager, &RemovableStorageManager::DevicesChanged, [&devicesChanged] { ++devicesChanged; });
+
+    quint64 diskSequence = 0;
+    auto event = [&diskSequence] (const Medium &medium, const char *action, bool probed) {
+        DeviceMonitor::Device device;
+        device.action = action;
+        device.name = medium.device;
+        device.node = QFile::encodeName(medium.device);
+        device.number = medium.number;
+        // A new medium every time: nothing comes from the probe cache
+        device.diskSequence = qstrcmp(action, "remove") == 0 ? diskSequence : ++diskSequence;
+        device.removable = true;
+        device.info.size = s_imageSize;
+        if (probed) {
+            device.info.valid = true;
+            device.info.filesystem = medium.filesystem;
+            device.info.usage = QStringLiteral("filesystem");
+        }
+        return device;
+    };
+
+    bool failed = false;
+    for (Medium &medium : media) {
+        Samples probe, mount, unmount, remove;
+        qint64 writtenBytes = 0;
+        qint64 writingTime = 0;
+
+        for (int cycle = 0; cycle < cycles && medium.usable; ++cycle) {
+            // Added without filesystem information, as it happens when udev's blkid builtin lags behind
+            probedAt.remove(medium.device);
+            removedAt.remove(medium.device);
+            qint64 start = clock.nsecsElapsed();
+            monitor->inject(event(medium, "add", false));
+            if (!waitUntil([&] { return probedAt.contains(medium.device); })) {
+                std::cerr << medium.device.toLatin1().constData() << " was never probed" << std::endl;
+                failed = true;
+                break;
+            }
+            probe.record(probedAt.value(medium.device) - start);
+
+            QString mountPoint;
+            errorMessage.clear();
+            start = clock.nsecsElapsed();
+            if (!waitForOperation(manager->mount(medium.device, 0), &errorMessage, &mountPoint)) {
+                std::cout << medium.filesystem.toLatin1().constData() << ": mount failed, " << errorMessage.toLocal8Bit().constData() << std::endl;
+                // The kernel might just not support it: only a failure after a good mount counts.
+                medium.usable = false;
+                failed = failed || cycle > 0;
+                monitor->inject(event(medium, "remove", false));
+                waitUntil([&] { return removedAt.contains(medium.device); });
+                break;
+            }
+            mount.record(clock.nsecsElapsed() - start);
+
+            qint64 nsecs;
+            if (!writeFile(mountPoint, megabytes, &nsecs)) {
+                std::cerr << "Could not write to " << mountPoint.toLocal8Bit().constData() << std::endl;
+                failed = true;
+            } else {
+                writtenBytes += megabytes * Q_INT64_C(1024) * 1024;
+                writingTime += nsecs;
+            }
+
+            errorMessage.clear();
+            start = clock.nsecsElapsed();
+            if (!waitForOperation(manager->unmount(medium.device), &errorMessage) || isMounted(mountPoint)) {
+                std::cerr << "Could not unmount " << medium.device.toLatin1().constData() << ": " << errorMessage.toLocal8Bit().constData() << std::endl;
+                failed = true;
+                break;
+            }
+            unmount.record(clock.nsecsElapsed() - start);
+
+            start = clock.nsecsElapsed();
+            monitor->inject(event(medium, "remove", false));
+            if (!waitUntil([&] { return removedAt.contains(medium.device); })) {
+                std::cerr << medium.device.toLatin1().constData() << " was never removed" << std::endl;
+                failed = true;
+                break;
+            }
+            remove.record(removedAt.value(medium.device) - start);
+        }
+
+        if (!medium.usable || failed) {
+            continue;
+        }
+
+        // Pulled out while mounted: the manager has to unmount it by itself
+        removedAt.remove(medium.device);
+        monitor->inject(event(medium, "add", true));
+        QString mountPoint;
+        errorMessage.clear();
+        if (!waitForOperation(manager->mount(medium.device, 0), &errorMessage, &mountPoint)) {
+            std::cerr << "Could not mount " << medium.device.toLatin1().constData() << ": " << errorMessage.toLocal8Bit().constData() << std::endl;
+            failed = true;
+            continue;
+        }
+        qint64 start = clock.nsecsElapsed();
+        monitor->inject(event(medium, "remove", false));
+        if (!waitUntil([&] { return removedAt.contains(medium.device); }) || manager->mountedDevices().contains(medium.device) ||
+            isMounted(mountPoint)) {
+            std::cerr << medium.device.toLatin1().constData() << " is still mounted after being pulled out" << std::endl;
+            failed = true;
+            continue;
+        }
+        qint64 pulled = removedAt.value(medium.device) - start;
+
+        QString name = medium.filesystem + QLatin1Char(' ');
+        probe.report(name + QStringLiteral("probe"));
+        mount.report(name + QStringLiteral("mount"));
+        unmount.report(name + QStringLiteral("unmount"));
+        remove.report(name + QStringLiteral("remove"));
+        std::cout << name.toLatin1().constData() << "pulled while mounted: " << pulled / 1000000.0 << " ms" << std::endl;
+        if (writingTime > 0) {
+            std::cout << name.toLatin1().constData() << "write: " << writtenBytes * 1000000000 / writingTime << " bytes/s" << std::endl;
+        }
+    }
+
+    // Hubs and multi partition sticks come in bursts: the whole burst has to be advertised with one change
+    const Medium &medium = media.first();
+    int bursts = qMax(1, cycles);
+    int changesBefore = devicesChanged;
+    qint64 start = clock.nsecsElapsed();
+    for (int burst = 0; burst < bursts && !failed; ++burst) {
+        for (int i = 0; i < s_burstSize; ++i) {
+            monitor->inject(event(medium, i % 2 == 0 ? "add" : "remove", true));
+        }
+        int expected = changesBefore + burst + 1;
+        if (!waitUntil([&] { return devicesChanged >= expected; })) {
+            std::cerr << "A burst of events was never processed" << std::endl;
+            failed = true;
+        }
+    }
+    qint64 burstTime = qMax(Q_INT64_C(1), clock.nsecsElapsed() - start);
+    if (!failed) {
+        std::cout << "events: " << bursts * s_burstSize << " in " << bursts << " bursts, "
+                  << bursts * s_burstSize * Q_INT64_C(1000000000) / burstTime << " events/s" << std::endl;
+        if (devicesChanged - changesBefore != bursts) {
+            std::cerr << "Expected " << bursts << " DevicesChanged, got " << devicesChanged - changesBefore << std::endl;
+            failed = true;
+        }
+    }
+
+    std::cout << "Metrics(): " << QJsonDocument::fromVariant(manager->Metrics()).toJson(QJsonDocument::Compact).constData() << std::endl;
+
+    for (const Medium &medium : media) {
+        close(medium.loopFd);
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// The built in profile of filesystem, and the alternatives worth comparing it against
+QList< QPair< QString, MountBackend::Profile > > profiles(const QString &filesystem)
+{
+    QList< QPair< QString, MountBackend::Profile > > result;
+    MountBackend::Profile builtIn = MountBackend::defaultProfile(filesystem);
+    result << qMakePair(QStringLiteral("built in"), builtIn);
+
+    MountBackend::Profile atime = builtIn;
+    atime.noAtime = false;
+    result << qMakePair(QStringLiteral("atime"), atime);
+
+    if (builtIn.data.contains("flush")) {
+        MountBackend::Profile noFlush = builtIn;
+        noFlush.data.removeAll("flush");
+        result << qMakePair(QStringLiteral("no flush"), noFlush);
+    }
+    if (builtIn.data.contains("nodiscard")) {
+        MountBackend::Profile discard = builtIn;
+        discard.data.replace(discard.data.indexOf("nodiscard"), "discard");
+        result << qMakePair(QStringLiteral("discard"), discard);
+
+        MountBackend::Profile commit = builtIn;
+        commit.data << "commit=60";
+        result << qMakePair(QStringLiteral("commit=60"), commit);
+    }
+
+    return result;
+}
+
+template< typename T >
+T median(QVector< T > values)
+{
+    std::sort(values.begin(), values.end());
+    return values.isEmpty() ? T() : values.at(values.count() / 2);
+}
+
+// Write throughput of every mount profile, straight through MountBackend
+int compareProfiles(int runs, int megabytes)
+{
+    QTemporaryDir workDir;
+    QList< Medium > media;
+    int prepared = prepareMedia(workDir, &media);
+    if (prepared != EXIT_SUCCESS) {
+        return prepared;
+    }
+
+    QTemporaryDir mountPoint;
+    bool failed = false;
+    for (const Medium &medium : media) {
+        for (const QPair< QString, MountBackend::Profile > &profile : profiles(medium.filesystem)) {
+            MountBackend::Options options = MountBackend::removableOptions(profile.second, 0, false);
+            QVector< qint64 > bytesPerSecond;
+            QVector< qint64 > filesPerSecond;
+            QVector< qint64 > unmountTimes;
+
+            for (int i = 0; i < runs; ++i) {
+                MountBackend::Result result = MountBackend::mount(medium.device, mountPoint.path(), medium.filesystem, options);
+                if (result.isError()) {
+                    // The kernel might just not support it
+                    std::cout << medium.filesystem.toLatin1().constData() << " (" << profile.first.toLatin1().constData() << "): mount failed, "
+                              << result.errorMessage.toLocal8Bit().constData() << std::endl;
+                    failed = failed || bytesPerSecond.count() > 0;
+                    break;
+                }
+
+                qint64 bigFile = 0;
+                qint64 smallFiles = 0;
+                if (!writeFile(mountPoint.path(), megabytes, &bigFile) || !writeSmallFiles(mountPoint.path(), s_smallFileCount, &smallFiles)) {
+                    std::cerr << "Could not write to " << medium.device.toLatin1().constData() << std::endl;
+                    failed = true;
+                }
+
+                QElapsedTimer unmountTimer;
+                unmountTimer.start();
+                result = MountBackend::unmount(mountPoint.path());
+                if (result.isError()) {
+                    std::cerr << "Could not unmount " << medium.device.toLatin1().constData() << ": "
+                              << result.errorMessage.toLocal8Bit().constData() << std::endl;
+                    return EXIT_FAILURE;
+                }
+                unmountTimes.append(unmountTimer.nsecsElapsed());
+
+                if (bigFile > 0 && smallFiles > 0) {
+                    bytesPerSecond.append(megabytes * Q_INT64_C(1024) * 1024 * 1000000000 / bigFile);
+                    filesPerSecond.append(s_smallFileCount * Q_INT64_C(1000000000) / smallFiles);
+                }
+            }
+
+            if (bytesPerSecond.isEmpty()) {
+                continue;
+            }
+            std::cout << medium.filesystem.toLatin1().constData() << " (" << profile.first.toLatin1().constData() << ", "
+                      << options.data.constData() << "): " << median(bytesPerSecond) << " bytes/s, "
+                      << median(filesPerSecond) << " small files/s, unmount " << median(unmountTimes) / 1000000.0 << " ms" << std::endl;
+        }
+    }
+
+    for (const Medium &medium : media) {
+        close(medium.loopFd);
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void quietMessages(QtMsgType type, const QMessageLogContext &, const QString &message)
+{
+    // The manager is chatty on purpose: keep the report readable.
+    if (type != QtDebugMsg) {
+        std::cerr << message.toLocal8Bit().constData() << std::endl;
+    }
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QStringList arguments = app.arguments().mid(1);
+    bool profilesOnly = arguments.removeAll(QStringLiteral("--profiles")) > 0;
+    int cycles = arguments.count() > 0 ? arguments.at(0).toInt() : (profilesOnly ? 5 : 20);
+    int megabytes = arguments.count() > 1 ? arguments.at(1).toInt() : 8;
+    if (cycles <= 0 || megabytes <= 0 || megabytes * Q_INT64_C(2) * 1024 * 1024 > s_imageSize) {
+        std::cerr << "Usage: " << argv[0] << " [--profiles] [cycles] [megabytes, up to " << s_imageSize / 2 / 1024 / 1024 << "]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    qInstallMessageHandler(quietMessages);
+
+    QTimer::singleShot(0, &app, [&app, profilesOnly, cycles, megabytes] {
+        app.exit(profilesOnly ? compareProfiles(cycles, megabytes) : run(cycles, megabytes));
+    });
+    return app.exec();
+}
@@ -0,0 +1,80 @@
+#include "adaptiveidletimer.h"
+
+#include <QtCore/QDateTime>
+#include <QtCore/QSettings>
+#include <QtCore/QTimer>
+
+#include <gravityconfig.h>
+
+// Lives on a tmpfs: it survives across activations, not across boots.
+#define ACTIVITY_STATE_PATH "/run/hemera/fingerprints-activity"
+
+/* How many mean intervals we wait for the next request before giving up */
+constexpr int idleHeadroom() { return 4; }
+
+AdaptiveIdleTimer::AdaptiveIdleTimer(QObject *parent)
+    : QObject(parent)
+    , m_timer(new QTimer(this))
+    , m_meanInterval(0)
+    , m_lastActivity(0)
+{
+    QSettings settings(QStringLiteral("%1/fingerprints.conf").arg(QLatin1String(Gravity::StaticConfig::configGravityPath())), QSettings::NativeFormat);
+    settings.beginGroup(QStringLiteral("IdleShutdown")); {
+        m_minimumTimeout = settings.value(QStringLiteral("MinimumTimeout"), 60 * 1000).toInt();
+        m_maximumTimeout = qMax(m_minimumTimeout, settings.value(QStringLiteral("MaximumTimeout"), 10 * 60 * 1000).toInt());
+    } settings.endGroup();
+
+    QSettings state(QStringLiteral(ACTIVITY_STATE_PATH), QSettings::IniFormat);
+    m_meanInterval = state.value(QStringLiteral("MeanInterval"), 0).toLongLong();
+    m_lastActivity = state.value(QStringLiteral("LastActivity"), 0).toLongLong();
+
+    m_timer->setSingleShot(true);
+    connect(m_timer, &QTimer::timeout, this, [this] {
+        saveState();
+        Q_EMIT idle();
+    });
+}
+
+AdaptiveIdleTimer::~AdaptiveIdleTimer()
+{
+}
+
+int AdaptiveIdleTimer::timeout() const
+{
+    // If the next request isn't expected before the longest we'd wait anyway, staying up is just a waste.
+    if (m_meanInterval <= 0 || m_meanInterval > m_maximumTimeout) {
+        return m_minimumTimeout;
+    }
+
+    return static_cast< int >(qBound< qint64 >(m_minimumTimeout, m_meanInterval * idleHeadroom(), m_maximumTimeout));
+}
+
+qint64 AdaptiveIdleTimer::meanInterval() const
+{
+    return m_meanInterval;
+}
+
+void AdaptiveIdleTimer::start()
+{
+    m_timer->start(timeout());
+}
+
+void AdaptiveIdleTimer::activity()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (m_lastActivity > 0 && now > m_lastActivity) {
+        // Exponentially weighted, so that the timeout follows changes in the usage pattern.
+        qint64 interval = now - m_lastActivity;
+        m_meanInterval = m_meanInterval > 0 ? (m_meanInterval * 7 + interval * 3) / 10 : interval;
+    }
+    m_lastActivity = now;
+
+    start();
+}
+
+void AdaptiveIdleTimer::saveState()
+{
+    QSettings state(QStringLiteral(ACTIVITY_STATE_PATH), QSettings::IniFormat);
+    state.setValue(QStringLiteral("MeanInterval"), m_meanInterval);
+    state.setValue(QStringLiteral("LastActivity"), m_lastActivity);
+}
@@ -0,0 +1,44 @@
+#ifndef ADAPTIVEIDLETIMER_H
+#define ADAPTIVEIDLETIMER_H
+
+#include <QtCore/QObject>
+
+class QTimer;
+
+/**
+ * Signals when the service has been idle for long enough to be shut down.
+ *
+ * The timeout follows the observed time between requests, across activations as well: services
+ * which are called often stay around, rarely used ones go away quickly. The timeout is bounded
+ * by MinimumTimeout and MaximumTimeout in the [IdleShutdown] group of fingerprints.conf.
+ */
+class AdaptiveIdleTimer : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(AdaptiveIdleTimer)
+
+public:
+    explicit AdaptiveIdleTimer(QObject *parent = Q_NULLPTR);
+    virtual ~AdaptiveIdleTimer();
+
+    int timeout() const;
+    qint64 meanInterval() const;
+
+public Q_SLOTS:
+    void start();
+    void activity();
+
+Q_SIGNALS:
+    void idle();
+
+private:
+    void saveState();
+
+    QTimer *m_timer;
+    int m_minimumTimeout;
+    int m_maximumTimeout;
+    qint64 m_meanInterval;
+    qint64 m_lastActivity;
+};
+
+#endif // ADAPTIVEIDLETIMER_H
@@ -1,16 +1,23 @@
 #include "appliancecryptoservice.h"
 
 #include "filesystemcertificatestoreprovider.h"
+#include "localcertificateauthority.h"
 
 #include <QtCore/QCryptographicHash>
 #include <QtCore/QDebug>
 #include <QtCore/QDir>
 #include <QtCore/QFile>
+#include <QtCore/QFutureWatcher>
+#include <QtCore/QSettings>
 #include <QtCore/QString>
 #include <QtCore/QStringList>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
 #include <QtCore/QTimer>
 #include <QtCore/QPluginLoader>
 
+#include <QtConcurrent/QtConcurrentRun>
+
 #include <QtDBus/QDBusConnection>
 
 #include <HemeraCore/Literals>
@@ -19,13 +26,21 @@
 
 #include "appliancecryptoadaptor.h"
 
+#define LOCALCA_PATH "/var/lib/hemera/appliance-crypto/localca.crt"
+
 ApplianceCryptoService::ApplianceCryptoService()
     : Hemera::AsyncInitObject(Q_NULLPTR)
+    , m_fallbackProvider(Q_NULLPTR)
+    , m_storeLoaded(false)
+    , m_storeGeneration(0)
+    , m_signingPool(Q_NULLPTR)
+    , m_certificateValidity(0)
 {
 }
 
 ApplianceCryptoService::~ApplianceCryptoService()
 {
+    wipeStore();
 }
 
 void ApplianceCryptoService::initImpl()
@@ -38,6 +53,15 @@ void ApplianceCryptoService::initImpl()
     new ApplianceCryptoAdaptor(this);
 
     m_fallbackProvider = new FilesystemCertificateStoreProvider(this);
+    connect(m_fallbackProvider, &Gravity::CertificateStoreProviderPlugin::changed, this, &ApplianceCryptoService::wipeStore);
+
+    QSettings settings(QStringLiteral("%1/appliancecrypto.conf").arg(QLatin1String(Gravity::StaticConfig::configGravityPath())), QSettings::NativeFormat);
+    settings.beginGroup(QStringLiteral("LocalCA")); {
+        // Issued certificates are short lived: one day, by default.
+        m_certificateValidity = settings.value(QStringLiteral("CertificateValidity"), 24 * 60 * 60).toLongLong();
+        m_signingPool = new QThreadPool(this);
+        m_signingPool->setMaxThreadCount(qMax(1, settings.value(QStringLiteral("MaxSigningThreads"), QThread::idealThreadCount()).toInt()));
+    } settings.endGroup();
 
     setReady();
 }
@@ -91,16 +115,112 @@ void ApplianceCryptoService::loadProviderPlugin()
     }
 }
 
-QByteArray ApplianceCryptoService::DeviceKey()
+void ApplianceCryptoService::loadStore()
 {
-    Q_EMIT activity();
+    if (m_storeLoaded) {
+        return;
+    }
+
+    // Drop whatever is left from a provider we could not cache
+    wipeStore();
+
+    if (m_provider.isNull()) {
+        loadProviderPlugin();
+    }
+
+    QByteArray deviceKey;
+    QByteArray privateKey;
     if (m_provider) {
-        if (!m_provider->deviceKey().isEmpty()) {
-            return m_provider->deviceKey();
+        connect(m_provider.data(), &Gravity::CertificateStoreProviderPlugin::changed, this, &ApplianceCryptoService::wipeStore,
+                Qt::UniqueConnection);
+
+        deviceKey = m_provider->deviceKey();
+        if (!m_provider->clientCredentials(&privateKey, &m_certificate)) {
+            privateKey.clear();
+            m_certificate.clear();
         }
     }
 
-    return m_fallbackProvider->deviceKey();
+    if (deviceKey.isEmpty()) {
+        deviceKey = m_fallbackProvider->deviceKey();
+    }
+    if (m_certificate.isEmpty()) {
+        m_fallbackProvider->clientCredentials(&privateKey, &m_certificate);
+    }
+
+    m_deviceKey.take(deviceKey);
+    m_privateKey.take(privateKey);
+
+    // Providers which don't tell us about changes are queried again on the next request.
+    m_storeLoaded = m_provider.isNull() || m_provider->notifiesChanges();
+}
+
+void ApplianceCryptoService::withLocalAuthority(const AuthorityCallback &callback)
+{
+    loadStore();
+    if (!m_authority.isNull() || m_privateKey.isEmpty()) {
+        callback(m_authority);
+        return;
+    }
+
+    m_authorityWaiters.append(callback);
+    if (m_authorityWaiters.size() > 1) {
+        // Already on its way
+        return;
+    }
+
+    // Parsing the key, and creating and caching the CA certificate the first time, is slow: do it on the pool.
+    // The job gets its own locked copy of the key, as the store might be wiped meanwhile.
+    QSharedPointer< SecureBuffer > privateKey(new SecureBuffer);
+    QByteArray privateKeyData = m_privateKey.data();
+    privateKey->take(privateKeyData);
+    QByteArray certificate = m_certificate;
+    quint64 generation = m_storeGeneration;
+
+    QFutureWatcher< AuthorityResult > *watcher = new QFutureWatcher< AuthorityResult >(this);
+    connect(watcher, &QFutureWatcher< AuthorityResult >::finished, this, [this, watcher, generation] {
+        AuthorityResult result = watcher->result();
+        watcher->deleteLater();
+
+        if (result.authority.isNull()) {
+            qWarning() << "Could not load the local certificate authority:" << result.errorMessage;
+        } else if (generation == m_storeGeneration) {
+            // The authority is kept ready for signing until the store changes.
+            m_authority = result.authority;
+        }
+
+        QList< AuthorityCallback > waiters = m_authorityWaiters;
+        m_authorityWaiters.clear();
+        for (const AuthorityCallback &waiter : waiters) {
+            waiter(result.authority);
+        }
+    });
+    watcher->setFuture(QtConcurrent::run(m_signingPool, [privateKey, certificate] () -> AuthorityResult {
+        AuthorityResult result;
+        QSharedPointer< LocalCertificateAuthority > authority(new LocalCertificateAuthority);
+        if (authority->load(privateKey->data(), certificate, QStringLiteral(LOCALCA_PATH), &result.errorMessage)) {
+            result.authority = authority;
+        }
+        return result;
+    }));
+}
+
+void ApplianceCryptoService::wipeStore()
+{
+    m_deviceKey.wipe();
+    m_privateKey.wipe();
+    m_certificate.clear();
+    m_authority.clear();
+    m_storeLoaded = false;
+    ++m_storeGeneration;
+}
+
+QByteArray ApplianceCryptoService::DeviceKey()
+{
+    Q_EMIT activity();
+    loadStore();
+
+    return m_deviceKey.data();
 }
 
 QByteArray ApplianceCryptoService::ClientSSLCertificate(const QByteArray &/*ohQDBusSeriously?*/)
@@ -111,23 +231,10 @@ QByteArray ApplianceCryptoService::ClientSSLCertificate(const QByteArray &/*ohQD
     QDBusMessage request = message();
     QDBusConnection requestConnection = connection();
 
-    QByteArray privateKey;
-    QByteArray certificate;
-
     Q_EMIT activity();
-    if (m_provider) {
-        if (!m_provider->privateKey().isEmpty() && !m_provider->certificate().isEmpty()) {
-            certificate = m_provider->certificate();
-            privateKey = m_provider->privateKey();
-        }
-    }
-
-    if (certificate.isEmpty()) {
-        certificate = m_fallbackProvider->certificate();
-        privateKey = m_fallbackProvider->privateKey();
-    }
+    loadStore();
 
-    requestConnection.send(request.createReply(QList<QVariant>() << privateKey << certificate));
+    requestConnection.send(request.createReply(QList<QVariant>() << m_privateKey.data() << m_certificate));
 
     // Blah.
     return QByteArray();
@@ -135,12 +242,72 @@ QByteArray ApplianceCryptoService::ClientSSLCertificate(const QByteArray &/*ohQD
 
 QByteArray ApplianceCryptoService::LocalCA()
 {
-    // TODO: Implement me! :(
+    if (!calledFromDBus()) {
+        return QByteArray();
+    }
+
+    Q_EMIT activity();
+
+    setDelayedReply(true);
+    QDBusMessage request = message();
+    QDBusConnection requestConnection = connection();
+
+    withLocalAuthority([request, requestConnection] (const QSharedPointer< LocalCertificateAuthority > &authority) {
+        if (authority.isNull()) {
+            requestConnection.send(request.createErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::notFound()),
+                                                            QStringLiteral("The local certificate authority is not available on this appliance.")));
+        } else {
+            requestConnection.send(request.createReply(QVariant(authority->certificate())));
+        }
+    });
+
     return QByteArray();
 }
 
 QByteArray ApplianceCryptoService::SignSSLCertificate(const QByteArray &certificateSigningRequest)
 {
-    // TODO: Implement me! :(
+    if (!calledFromDBus()) {
+        return QByteArray();
+    }
+
+    Q_EMIT activity();
+
+    // Signing is CPU bound: do it on the pool, and let the main thread serve further requests meanwhile.
+    setDelayedReply(true);
+    QDBusMessage request = message();
+    QDBusConnection requestConnection = connection();
+    long validity = m_certificateValidity;
+
+    withLocalAuthority([this, request, requestConnection, certificateSigningRequest, validity]
+                       (const QSharedPointer< LocalCertificateAuthority > &authority) {
+        if (authority.isNull()) {
+            requestConnection.send(request.createErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::notFound()),
+                                                            QStringLiteral("The local certificate authority is not available on this appliance.")));
+            return;
+        }
+
+        struct Result {
+            QByteArray certificate;
+            QString errorMessage;
+        };
+
+        QFutureWatcher< Result > *watcher = new QFutureWatcher< Result >(this);
+        connect(watcher, &QFutureWatcher< Result >::finished, this, [watcher, request, requestConnection] {
+            Result result = watcher->result();
+            if (result.certificate.isEmpty()) {
+                requestConnection.send(request.createErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::badRequest()),
+                                                                result.errorMessage));
+            } else {
+                requestConnection.send(request.createReply(QVariant(result.certificate)));
+            }
+            watcher->deleteLater();
+        });
+        watcher->setFuture(QtConcurrent::run(m_signingPool, [authority, certificateSigningRequest, validity] () -> Result {
+            Result result;
+            result.certificate = authority->sign(certificateSigningRequest, validity, &result.errorMessage);
+            return result;
+        }));
+    });
+
     return QByteArray();
 }
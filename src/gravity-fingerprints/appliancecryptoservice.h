@@ -5,13 +5,21 @@
 #include <QtCore/QStringList>
 #include <QtCore/QByteArray>
 #include <QtCore/QPointer>
+#include <QtCore/QSharedPointer>
 
 #include <QtDBus/QDBusContext>
 
+#include <functional>
+
+#include "securememory.h"
+
 namespace Gravity {
 class CertificateStoreProviderPlugin;
 }
 
+class LocalCertificateAuthority;
+class QThreadPool;
+
 class ApplianceCryptoService : public Hemera::AsyncInitObject, protected QDBusContext
 {
     Q_OBJECT
@@ -27,6 +35,9 @@ public:
     QByteArray LocalCA();
     QByteArray SignSSLCertificate(const QByteArray &certificateSigningRequest);
 
+    /// Wipes the key material from memory. It will be loaded again from the provider when needed.
+    void wipeStore();
+
 private Q_SLOTS:
     void initImpl() override final;
 
@@ -35,9 +46,34 @@ Q_SIGNALS:
 
 private:
     void loadProviderPlugin();
+    void loadStore();
+
+    // Calls back with the local authority, or with a null one if it is not available. The authority is loaded on the signing pool.
+    typedef std::function< void (const QSharedPointer< LocalCertificateAuthority > &) > AuthorityCallback;
+    void withLocalAuthority(const AuthorityCallback &callback);
+
+    struct AuthorityResult {
+        QSharedPointer< LocalCertificateAuthority > authority;
+        QString errorMessage;
+    };
 
     QPointer< Gravity::CertificateStoreProviderPlugin > m_provider;
     Gravity::CertificateStoreProviderPlugin *m_fallbackProvider;
+
+    // Key material is read once, and kept in locked memory until the provider reports a change or we go idle.
+    // Providers which don't declare NotifiesChanges are never cached.
+    bool m_storeLoaded;
+    // Bumped whenever the store is wiped, so that an authority loaded from stale keys is not kept
+    quint64 m_storeGeneration;
+    SecureBuffer m_deviceKey;
+    SecureBuffer m_privateKey;
+    QByteArray m_certificate;
+
+    // Signing jobs hold a reference to the authority, so it can be dropped while they are running.
+    QSharedPointer< LocalCertificateAuthority > m_authority;
+    QList< AuthorityCallback > m_authorityWaiters;
+    QThreadPool *m_signingPool;
+    long m_certificateValidity;
 };
 
 #endif // APPLIANCECRYPTOSERVICE_H
@@ -1,20 +1,45 @@
 #include "filesystemcertificatestoreprovider.h"
 
 #include <QtCore/QFile>
+#include <QtCore/QFileSystemWatcher>
+#include <QtCore/QStringList>
 
+#define CERTIFICATESTORE_PATH QStringLiteral("/etc/hemera/appliance-crypto")
 #define CERTIFICATE_PATH QStringLiteral("/etc/hemera/appliance-crypto/certificate")
 #define DEVICEKEY_PATH QStringLiteral("/etc/hemera/appliance-crypto/devicekey")
 #define PRIVATEKEY_PATH QStringLiteral("/etc/hemera/appliance-crypto/privatekey")
 
 FilesystemCertificateStoreProvider::FilesystemCertificateStoreProvider(QObject* parent)
     : CertificateStoreProviderPlugin(parent)
+    , m_watcher(new QFileSystemWatcher(this))
 {
+    // Files are usually replaced rather than rewritten: watch the directory too, and pick up new files as they appear.
+    connect(m_watcher, &QFileSystemWatcher::directoryChanged, this, [this] {
+        watchFiles();
+        Q_EMIT changed();
+    });
+    connect(m_watcher, &QFileSystemWatcher::fileChanged, this, [this] {
+        watchFiles();
+        Q_EMIT changed();
+    });
+
+    watchFiles();
 }
 
 FilesystemCertificateStoreProvider::~FilesystemCertificateStoreProvider()
 {
 }
 
+void FilesystemCertificateStoreProvider::watchFiles()
+{
+    QStringList paths = QStringList() << CERTIFICATESTORE_PATH << CERTIFICATE_PATH << DEVICEKEY_PATH << PRIVATEKEY_PATH;
+    for (const QString &path : paths) {
+        if (!m_watcher->files().contains(path) && !m_watcher->directories().contains(path) && QFile::exists(path)) {
+            m_watcher->addPath(path);
+        }
+    }
+}
+
 QByteArray FilesystemCertificateStoreProvider::loadFromFile(const QString &file) const
 {
     QFile f(file);
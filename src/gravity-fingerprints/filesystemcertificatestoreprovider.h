@@ -3,10 +3,13 @@
 
 #include <GravityFingerprints/CertificateStoreProviderPlugin>
 
+class QFileSystemWatcher;
+
 class FilesystemCertificateStoreProvider : public Gravity::CertificateStoreProviderPlugin
 {
     Q_OBJECT
     Q_INTERFACES(Gravity::CertificateStoreProviderPlugin)
+    Q_CLASSINFO("NotifiesChanges", "true")
     Q_DISABLE_COPY(FilesystemCertificateStoreProvider)
 
 public:
@@ -19,6 +22,9 @@ public:
 
 private:
     QByteArray loadFromFile(const QString &file) const;
+    void watchFiles();
+
+    QFileSystemWatcher *m_watcher;
 };
 
 #endif // FILESYSTEMCERTIFICATESTOREPROVIDER_H
@@ -0,0 +1,189 @@
+/*
+ * Compares the generic fingerprint provider against the udev based implementation it replaced.
+ *
+ * Usage: gravity-fingerprint-provider-bench [iterations] [--drop-caches]
+ *
+ * The first call of each implementation is the cold one: with --drop-caches, and when running as root,
+ * the kernel page, dentry and inode caches are dropped before it. The following calls are the warm ones.
+ * Both implementations must come up with the same fingerprint, unless the unit has no network hardware.
+ */
+
+#include "genericfingerprintprovider.h"
+
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QStringList>
+#include <QtCore/QTextStream>
+
+#include <libudev.h>
+
+#include <iostream>
+
+#include <unistd.h>
+
+namespace {
+
+// The generic provider, as it was when it went through udev. It leaked the whole udev context, here it is freed.
+QStringList udevCpuValues()
+{
+    QStringList list;
+
+    QFile cpuinfoFile(QStringLiteral("/proc/cpuinfo"));
+    if (!cpuinfoFile.open(QIODevice::ReadOnly)) {
+        return QStringList();
+    }
+
+    QTextStream cpuinfo(&cpuinfoFile);
+
+    QStringList interstingKeys = { QStringLiteral("serial"), QStringLiteral("CPU implementer"), QStringLiteral("CPU architecture"),
+                                   QStringLiteral("CPU variant"), QStringLiteral("CPU part"), QStringLiteral("CPU revision"), QStringLiteral("cpu family"),
+                                   QStringLiteral("model") };
+
+    QString line;
+    do {
+        line = cpuinfo.readLine();
+
+        for (const QString &checkKey : interstingKeys) {
+            if (line.startsWith(checkKey)) {
+                QStringList sl = line.split(QLatin1Char(':'));
+                if (sl.count() != 2) {
+                    continue;
+                }
+                list.append(sl.at(1).simplified());
+            }
+        }
+    } while (!line.isNull());
+
+    list.sort();
+    list.removeDuplicates();
+
+    return list;
+}
+
+QByteArray udevHardwareSerialNumber()
+{
+    QStringList uidsList;
+    QStringList removableUidsList;
+
+    udev *ud = udev_new();
+    udev_enumerate *uenum = udev_enumerate_new(ud);
+    udev_enumerate_add_match_subsystem(uenum, "net");
+    udev_enumerate_add_match_subsystem(uenum, "bluetooth");
+    udev_enumerate_scan_devices(uenum);
+    udev_list_entry *dev_list_entry;
+    udev_list_entry *devices = udev_enumerate_get_list_entry(uenum);
+
+    udev_list_entry_foreach(dev_list_entry, devices) {
+        udev_device *dev = udev_device_new_from_syspath(ud, udev_list_entry_get_name(dev_list_entry));
+        udev_device *parentDev = udev_device_get_parent(dev);
+        if (!parentDev) {
+            udev_device_unref(dev);
+            continue;
+        }
+
+        const char *parentSubsystems = udev_device_get_subsystem(parentDev);
+        const char *addrSysAttr = udev_device_get_sysattr_value(dev, "address");
+        if (addrSysAttr) {
+            QString hwAddr = QString::fromLatin1(addrSysAttr);
+            if (parentSubsystems && QString::fromLatin1(parentSubsystems).contains(QStringLiteral("usb"))) {
+                removableUidsList.append(hwAddr);
+            } else {
+                uidsList.append(hwAddr);
+            }
+        }
+        udev_device_unref(dev);
+    }
+
+    udev_enumerate_unref(uenum);
+    udev_unref(ud);
+
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    uidsList.sort();
+    removableUidsList.sort();
+    for (const QString &uid : uidsList.isEmpty() ? removableUidsList : uidsList) {
+        hash.addData(uid.toLatin1());
+    }
+
+    hash.addData(udevCpuValues().join(QStringLiteral(" ")).toLatin1());
+
+    return hash.result();
+}
+
+void dropCaches()
+{
+    sync();
+
+    QFile dropCaches(QStringLiteral("/proc/sys/vm/drop_caches"));
+    if (!dropCaches.open(QIODevice::WriteOnly) || dropCaches.write("3\n") < 0) {
+        std::cerr << "Could not drop the kernel caches, cold figures are not really cold." << std::endl;
+    }
+}
+
+// Cold and mean warm time of @p function, in microseconds
+template< typename Function >
+QByteArray measure(const char *name, int iterations, bool coldCaches, Function function)
+{
+    if (coldCaches) {
+        dropCaches();
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    QByteArray result = function();
+    qint64 cold = timer.nsecsElapsed() / 1000;
+
+    timer.restart();
+    for (int i = 0; i < iterations; ++i) {
+        function();
+    }
+    qint64 warm = timer.nsecsElapsed() / 1000 / iterations;
+
+    std::cout << name << ": cold " << cold << " us, warm " << warm << " us" << std::endl;
+    return result;
+}
+
+void quietMessages(QtMsgType type, const QMessageLogContext &, const QString &message)
+{
+    // The provider is chatty on purpose: keep the report readable.
+    if (type != QtDebugMsg) {
+        std::cerr << message.toLocal8Bit().constData() << std::endl;
+    }
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = 100;
+    bool coldCaches = false;
+    for (int i = 1; i < argc; ++i) {
+        if (qstrcmp(argv[i], "--drop-caches") == 0) {
+            coldCaches = true;
+        } else {
+            iterations = QByteArray(argv[i]).toInt();
+        }
+    }
+    if (iterations <= 0) {
+        std::cerr << "Usage: " << argv[0] << " [iterations] [--drop-caches]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (coldCaches && geteuid() != 0) {
+        std::cerr << "Only root can drop the kernel caches." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    qInstallMessageHandler(quietMessages);
+
+    GenericFingerprintProvider provider;
+    QByteArray udevResult = measure("udev", iterations, coldCaches, udevHardwareSerialNumber);
+    QByteArray sysfsResult = measure("sysfs", iterations, coldCaches, [&provider] { return provider.initHardwareSerialNumber(); });
+
+    if (udevResult != sysfsResult) {
+        std::cout << "Fingerprints differ: expected only on units without any network or bluetooth address." << std::endl;
+    } else {
+        std::cout << "Fingerprints match." << std::endl;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -1,5 +1,6 @@
 #include "fingerprintsservice.h"
 
+#include "adaptiveidletimer.h"
 #include "genericfingerprintprovider.h"
 
 #include <stdio.h>
@@ -8,15 +9,22 @@
 #include <QtCore/QDebug>
 #include <QtCore/QDir>
 #include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QSaveFile>
+#include <QtCore/QSettings>
+#include <QtCore/QFileSystemWatcher>
 #include <QtCore/QString>
 #include <QtCore/QStringList>
 #include <QtCore/QTimer>
 #include <QtCore/QPluginLoader>
 
 #include <QtDBus/QDBusConnection>
+#include <QtDBus/QDBusMetaType>
 
 #include <HemeraCore/Literals>
 
+#include <GravitySupermassive/CredentialsResolver>
+
 #include <systemd/sd-daemon.h>
 #include <systemd/sd-journal.h>
 
@@ -26,19 +34,38 @@
 #include <pwd.h>
 
 #include "fingerprintsadaptor.h"
+#include "gravityfingerprintsadaptor.h"
 
 #define FINGERPRINTS_PATH "/var/lib/hemera/fingerprints/"
 #define STOREDFINGERPRINT_PATH "/var/lib/hemera/fingerprints/stored_fingerprint"
 #define HARDWAREFINGERPRINT_PATH "/var/lib/hemera/fingerprints/hardware_fingerprint"
+#define GLOBALHARDWAREID_PATH "/var/lib/hemera/fingerprints/global_hardware_id"
+#define GLOBALSYSTEMID_PATH "/var/lib/hemera/fingerprints/global_system_id"
+
+#define GLOBALHARDWAREID_SEED "ThisHardwareIdWillBePublicAndEveryoneWillSeeIt!"
+#define GLOBALHARDWAREID_SEED2 "HEMERA1_HWID1"
+#define GLOBALSYSTEMID_SEED "ThisSoftwareIdWillBePublicAndEveryoneWillSeeIt!!!"
+#define GLOBALSYSTEMID_SEED2 "HEMERA1_SYSID1"
 
 
+static QByteArray fingerprintCacheKey(const QByteArray &seed, const QByteArray &seed2)
+{
+    // Seeds are arbitrary data: prefix the length, so that no two pairs can collide.
+    return QByteArray::number(seed.size()) + ':' + seed + seed2;
+}
+
 FingerprintsService::FingerprintsService()
     : Hemera::AsyncInitObject(Q_NULLPTR)
+    , m_credentialsResolver(Q_NULLPTR)
+    , m_secretsWatcher(Q_NULLPTR)
+    , m_activationLatency(-1)
+    , m_requests(0)
 {
 }
 
 FingerprintsService::~FingerprintsService()
 {
+    wipeSecrets();
 }
 
 void FingerprintsService::initImpl()
@@ -53,13 +80,119 @@ void FingerprintsService::initImpl()
                      QStringLiteral("Could not register the object on DBus. This means either a wrong installation or a corrupted instance."));
         return;
     }
+    qDBusRegisterMetaType< QList< QByteArray > >();
     new FingerprintsAdaptor(this);
+    new GravityFingerprintsAdaptor(this);
+
+    QSettings settings(QStringLiteral("%1/fingerprints.conf").arg(QLatin1String(Gravity::StaticConfig::configGravityPath())), QSettings::NativeFormat);
+    settings.beginGroup(QStringLiteral("Cache")); {
+        // Fingerprints, per kind. The global IDs are kept aside, whatever the size.
+        int cacheSize = qMax(0, settings.value(QStringLiteral("MaxFingerprints"), 64).toInt());
+        m_storedFingerprints.setMaxCost(cacheSize);
+        m_hardwareFingerprints.setMaxCost(cacheSize);
+    } settings.endGroup();
 
     m_fallbackProvider = new GenericFingerprintProvider(this);
+    m_credentialsResolver = new Gravity::CredentialsResolver(QDBusConnection::systemBus(), this);
+
+    connect(this, &FingerprintsService::activity, this, [this] { ++m_requests; });
+
+    m_secretsWatcher = new QFileSystemWatcher(this);
+    connect(m_secretsWatcher, &QFileSystemWatcher::directoryChanged, this, [this] {
+        // A secret might have been removed. Replaced secrets are caught by the file watch, and
+        // the directory also changes when we persist global IDs, which must not flush anything.
+        if (!m_storedSecret.isEmpty() && !QFile::exists(QStringLiteral(STOREDFINGERPRINT_PATH))) {
+            m_storedSecret.wipe();
+            m_storedFingerprints.clear();
+            m_globalSystemId.clear();
+        }
+        if (!m_hardwareSecret.isEmpty() && !QFile::exists(QStringLiteral(HARDWAREFINGERPRINT_PATH))) {
+            m_hardwareSecret.wipe();
+            m_hardwareFingerprints.clear();
+            m_globalHardwareId.clear();
+        }
+        watchSecrets();
+    });
+    connect(m_secretsWatcher, &QFileSystemWatcher::fileChanged, this, [this] (const QString &path) {
+        if (path == QStringLiteral(STOREDFINGERPRINT_PATH)) {
+            m_storedSecret.wipe();
+            m_storedFingerprints.clear();
+            m_globalSystemId.clear();
+        } else {
+            m_hardwareSecret.wipe();
+            m_hardwareFingerprints.clear();
+            m_globalHardwareId.clear();
+        }
+    });
 
     setReady();
 }
 
+void FingerprintsService::wipeSecrets()
+{
+    m_storedSecret.wipe();
+    m_hardwareSecret.wipe();
+    m_storedFingerprints.clear();
+    m_hardwareFingerprints.clear();
+    m_globalHardwareId.clear();
+    m_globalSystemId.clear();
+}
+
+void FingerprintsService::watchSecrets()
+{
+    if (!m_secretsWatcher) {
+        return;
+    }
+
+    QStringList paths = QStringList() << QStringLiteral(FINGERPRINTS_PATH) << QStringLiteral(STOREDFINGERPRINT_PATH)
+                                      << QStringLiteral(HARDWAREFINGERPRINT_PATH);
+    for (const QString &path : paths) {
+        if (!m_secretsWatcher->files().contains(path) && !m_secretsWatcher->directories().contains(path) && QFile::exists(path)) {
+            m_secretsWatcher->addPath(path);
+        }
+    }
+}
+
+QByteArray FingerprintsService::storedSecret()
+{
+    if (m_storedSecret.isEmpty()) {
+        QByteArray secret;
+        QFile stored(QStringLiteral(STOREDFINGERPRINT_PATH));
+        if (!stored.open(QIODevice::ReadOnly)/* || stored.size() != 256*/) {
+            qDebug() << "We need to create a new stored number";
+            secret = initStoredSerialNumber();
+        } else {
+            secret = stored.read(256);
+            stored.close();
+        }
+
+        m_storedSecret.take(secret);
+        watchSecrets();
+    }
+
+    return m_storedSecret.data();
+}
+
+QByteArray FingerprintsService::hardwareSecret()
+{
+    if (m_hardwareSecret.isEmpty()) {
+        QByteArray secret;
+        QFile hardware(QStringLiteral(HARDWAREFINGERPRINT_PATH));
+        if (!hardware.open(QIODevice::ReadOnly) /*|| hardware.size() != 256*/){
+            qDebug() << "We need to create a new hardware number";
+            secret = initHardwareSerialNumber();
+        } else {
+            secret = hardware.readAll();
+            hardware.close();
+        }
+
+        m_hardwareSecret.take(secret);
+        watchSecrets();
+    }
+
+    return m_hardwareSecret.data();
+}
+
 void FingerprintsService::loadProviderPlugin()
 {
     // Init provider
@@ -150,28 +283,54 @@ QByteArray FingerprintsService::calculateStoredFingerprint(const QByteArray &see
         return QByteArray();
     }
 
+    QByteArray key = fingerprintCacheKey(seed, seed2);
+    if (QByteArray *cached = m_storedFingerprints.object(key)) {
+        return *cached;
+    }
+
     QCryptographicHash hash(QCryptographicHash::Sha256);
     hash.addData("STORED SERIAL NUMBER");
     hash.addData(seed);
     hash.addData(seed2);
+    hash.addData(storedSecret());
+
+    QByteArray result = hash.result().toBase64(QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals);
+    m_storedFingerprints.insert(key, new QByteArray(result));
+
+    return result;
+}
+
+QByteArray FingerprintsService::initHardwareSerialNumber()
+{
+    QByteArray hardwareData;
+    if (m_provider.isNull()) {
+        // Try loading the plugin
+        loadProviderPlugin();
+    }
 
-    QByteArray storedData;
-    QFile stored(QStringLiteral(STOREDFINGERPRINT_PATH));
-    if (!stored.open(QIODevice::ReadOnly)/* || stored.size() != 256*/) {
-        qDebug() << "We need to create a new stored number";
-        storedData = initStoredSerialNumber();
+    if (m_provider.isNull()) {
+        qDebug() << "No provider plugin available. Falling back to generic.";
+        // We should not fail. Instead, let's just use the fallback.
+        hardwareData = m_fallbackProvider->initHardwareSerialNumber();
     } else {
-        storedData = stored.read(256);
-        stored.close();
+        hardwareData = m_provider->initHardwareSerialNumber();
     }
-    hash.addData(storedData);
 
-    QByteArray result = hash.result();
+    if (hardwareData.isEmpty()) {
+        qWarning() << "Provider failed in creating a hardware fingerprint! Falling back to generic.";
+        // We should not fail. Instead, let's just use the fallback.
+        hardwareData = m_fallbackProvider->initHardwareSerialNumber();
+    }
 
-    //wipe software key from memory
-    storedData.fill(0, storedData.count());
+    // Cache it.
+    createMissingPath();
+    QFile hardwareFile(QStringLiteral(HARDWAREFINGERPRINT_PATH ));
+    hardwareFile.setPermissions(QFileDevice::WriteUser | QFileDevice::ReadUser);
+    hardwareFile.open(QIODevice::WriteOnly);
+    hardwareFile.write(hardwareData);
+    hardwareFile.close();
 
-    return result.toBase64(QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals);
+    return hardwareData;
 }
 
 QByteArray FingerprintsService::calculateHardwareFingerprint(const QByteArray &seed, const QByteArray &seed2)
@@ -180,91 +339,67 @@ QByteArray FingerprintsService::calculateHardwareFingerprint(const QByteArray &s
         return QByteArray();
     }
 
+    QByteArray key = fingerprintCacheKey(seed, seed2);
+    if (QByteArray *cached = m_hardwareFingerprints.object(key)) {
+        return *cached;
+    }
+
     QCryptographicHash hash(QCryptographicHash::Sha256);
     hash.addData("HARDWARE SERIAL NUMBER");
     hash.addData(seed);
     hash.addData(seed2);
-
-    QByteArray hardwareData;
-    QFile hardware(QStringLiteral(HARDWAREFINGERPRINT_PATH));
-    if (!hardware.open(QIODevice::ReadOnly) /*|| hardware.size() != 256*/){
-        qDebug() << "We need to create a new hardware number";
-        if (m_provider.isNull()) {
-            // Try loading the plugin
-            loadProviderPlugin();
-        }
-
-        if (m_provider.isNull()) {
-            qDebug() << "No provider plugin available. Falling back to generic.";
-            // We should not fail. Instead, let's just use the fallback.
-            hardwareData = m_fallbackProvider->initHardwareSerialNumber();
-        } else {
-            hardwareData = m_provider->initHardwareSerialNumber();
-        }
-
-        if (hardwareData.isEmpty()) {
-            qWarning() << "Provider failed in creating a hardware fingerprint! Falling back to generic.";
-            // We should not fail. Instead, let's just use the fallback.
-            hardwareData = m_fallbackProvider->initHardwareSerialNumber();
-        }
-
-        // Cache it.
-        createMissingPath();
-        QFile hardwareFile(QStringLiteral(HARDWAREFINGERPRINT_PATH ));
-        hardwareFile.setPermissions(QFileDevice::WriteUser | QFileDevice::ReadUser);
-        hardwareFile.open(QIODevice::WriteOnly);
-        hardwareFile.write(hardwareData);
-        hardwareFile.close();
-    } else {
-        hardwareData = hardware.readAll();
-        hardware.close();
-    }
-
-    hash.addData(hardwareData);
-    QByteArray result = hash.result();
-
-    //wipe hardware key from memory
-    hardwareData.fill(0, hardwareData.count());
+    hash.addData(hardwareSecret());
 
     // Encode to base64 (URL Friendly) to save bytes and make it readable.
-    return result.toBase64(QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals);
+    QByteArray result = hash.result().toBase64(QByteArray::Base64UrlEncoding | QByteArray::OmitTrailingEquals);
+    m_hardwareFingerprints.insert(key, new QByteArray(result));
+
+    return result;
 }
 
-QString FingerprintsService::usernameFromUid(uid_t uid)
+void FingerprintsService::sendFingerprints(FingerprintType type, const QList< QByteArray > &seeds, bool batched)
 {
-    struct passwd pwd;
-    struct passwd *result;
-    char *buf;
-    size_t bufsize;
-    int s;
-
-    bufsize = sysconf(_SC_GETPW_R_SIZE_MAX);
-    if (bufsize <= 0) {        /* Value was indeterminate */
-        bufsize = 16384;        /* Should be more than enough */
-    }
+    setDelayedReply(true);
+
+    QDBusMessage request = message();
+    Gravity::CredentialsOperation *op = m_credentialsResolver->resolve(request.service());
+    connect(op, &Hemera::Operation::finished, this, [this, op, request, type, seeds, batched] {
+        if (op->isError() || op->userName().isEmpty()) {
+            QDBusConnection::systemBus().send(request.createErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
+                                                                       QStringLiteral("Could not retrieve username!")));
+            return;
+        }
 
-    buf = static_cast<char*>(malloc(bufsize));
-    if (buf == NULL) {
-        qWarning() << "Could not allocate memory!";
-        return QString();
-    }
+        // The secret is loaded once for the whole batch
+        QByteArray username = op->userName().toLatin1();
+        QList< QByteArray > fingerprints;
+        for (const QByteArray &seed : seeds) {
+            fingerprints.append(type == FingerprintType::Stored ? calculateStoredFingerprint(seed, username)
+                                                                : calculateHardwareFingerprint(seed, username));
+        }
 
-    s = getpwuid_r(uid, &pwd, buf, bufsize, &result);
-    if (result == NULL) {
-        if (s == 0) {
-            qWarning() << "Caller user not found! Refusing to create a fingerprint.";
+        if (type == FingerprintType::Stored) {
+            sd_journal_send("MESSAGE=A stored serial number has been generated",
+                            "MESSAGE_ID=a663a41892a34842a09fb81dbd99e594",
+                            "PRIORITY=5",
+                            "REQUEST_SERVICE=%s", request.service().toLatin1().constData(),
+                            "REQUEST_SEEDS=%d", seeds.size(),
+                            NULL);
         } else {
-            qWarning() << "getpwuid_r failed," << s;
+            sd_journal_send("MESSAGE=A hardware serial number has been generated",
+                            "MESSAGE_ID=58e62cc7dc29494386f767521eb4b82b",
+                            "PRIORITY=5",
+                            "REQUEST_SERVICE=%s", request.service().toLatin1().constData(),
+                            "REQUEST_SEEDS=%d", seeds.size(),
+                            NULL);
         }
-        free(buf);
-        return QString();
-    }
-
-    QString ret = QString::fromLatin1(pwd.pw_name);
 
-    free(buf);
-
-    return ret;
+        if (batched) {
+            QDBusConnection::systemBus().send(request.createReply(QVariant::fromValue(fingerprints)));
+        } else {
+            QDBusConnection::systemBus().send(request.createReply(QVariant(fingerprints.value(0))));
+        }
+    });
 }
 
 QByteArray FingerprintsService::StoredSerialNumber(const QByteArray &seed)
@@ -274,62 +409,123 @@ QByteArray FingerprintsService::StoredSerialNumber(const QByteArray &seed)
     }
 
     Q_EMIT activity();
-    QString username = usernameFromUid(QDBusConnection::systemBus().interface()->serviceUid(message().service()));
-    if (username.isEmpty()) {
-        setDelayedReply(true);
-        QDBusConnection::systemBus().send(message().createErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
-                                                                     QStringLiteral("Could not retrieve username!")));
+    sendFingerprints(FingerprintType::Stored, QList< QByteArray >() << seed, false);
+    return QByteArray();
+}
+
+QByteArray FingerprintsService::HardwareSerialNumber(const QByteArray &seed)
+{
+    if (!calledFromDBus()) {
         return QByteArray();
     }
 
-    QByteArray f = calculateStoredFingerprint(seed, username.toLatin1());
+    Q_EMIT activity();
+    sendFingerprints(FingerprintType::Hardware, QList< QByteArray >() << seed, false);
+    return QByteArray();
+}
 
-    sd_journal_send("MESSAGE=A stored serial number has been generated",
-                    "MESSAGE_ID=a663a41892a34842a09fb81dbd99e594",
-                    "PRIORITY=5",
-                    "REQUEST_SERVICE=%s", message().service().toLatin1().constData(),
-                    NULL);
+QList< QByteArray > FingerprintsService::StoredSerialNumbers(const QList< QByteArray > &seeds)
+{
+    if (!calledFromDBus()) {
+        return QList< QByteArray >();
+    }
 
-    return f;
+    Q_EMIT activity();
+    sendFingerprints(FingerprintType::Stored, seeds, true);
+    return QList< QByteArray >();
 }
 
-QByteArray FingerprintsService::HardwareSerialNumber(const QByteArray &seed)
+QList< QByteArray > FingerprintsService::HardwareSerialNumbers(const QList< QByteArray > &seeds)
 {
     if (!calledFromDBus()) {
-        return QByteArray();
+        return QList< QByteArray >();
     }
 
-    QString username = usernameFromUid(QDBusConnection::systemBus().interface()->serviceUid(message().service()));
-    if (username.isEmpty()) {
-        setDelayedReply(true);
-        QDBusConnection::systemBus().send(message().createErrorReply(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()),
-                                                                     QStringLiteral("Could not retrieve username!")));
-        return QByteArray();
+    Q_EMIT activity();
+    sendFingerprints(FingerprintType::Hardware, seeds, true);
+    return QList< QByteArray >();
+}
+
+QByteArray FingerprintsService::persistedGlobalId(FingerprintType type, const QString &idPath, const QString &secretPath)
+{
+    // A persisted ID is only good if it was written after the secret it derives from.
+    QFileInfo idInfo(idPath);
+    QFileInfo secretInfo(secretPath);
+    if (idInfo.exists() && secretInfo.exists() && idInfo.lastModified() >= secretInfo.lastModified()) {
+        QFile idFile(idPath);
+        if (idFile.open(QIODevice::ReadOnly)) {
+            QByteArray id = idFile.readAll();
+            if (!id.isEmpty()) {
+                return id;
+            }
+        }
     }
 
-    QByteArray f = calculateHardwareFingerprint(seed, username.toLatin1());
+    QByteArray id = type == FingerprintType::Hardware ?
+                    calculateHardwareFingerprint(QByteArray(GLOBALHARDWAREID_SEED), QByteArray(GLOBALHARDWAREID_SEED2)) :
+                    calculateStoredFingerprint(QByteArray(GLOBALSYSTEMID_SEED), QByteArray(GLOBALSYSTEMID_SEED2));
 
-    sd_journal_send("MESSAGE=A hardware serial number has been generated",
-                    "MESSAGE_ID=58e62cc7dc29494386f767521eb4b82b",
-                    "PRIORITY=5",
-                    "REQUEST_SERVICE=%s", message().service().toLatin1().constData(),
-                    NULL);
+    createMissingPath();
+    QSaveFile idFile(idPath);
+    if (!idFile.open(QIODevice::WriteOnly) || idFile.write(id) != id.size() || !idFile.commit()) {
+        qWarning() << "Could not persist" << idPath << idFile.errorString();
+    }
 
-    return f;
+    return id;
+}
+
+void FingerprintsService::precomputeGlobalIds()
+{
+    if (m_globalHardwareId.isEmpty()) {
+        m_globalHardwareId = persistedGlobalId(FingerprintType::Hardware, QStringLiteral(GLOBALHARDWAREID_PATH),
+                                               QStringLiteral(HARDWAREFINGERPRINT_PATH));
+    }
+    if (m_globalSystemId.isEmpty()) {
+        m_globalSystemId = persistedGlobalId(FingerprintType::Stored, QStringLiteral(GLOBALSYSTEMID_PATH),
+                                             QStringLiteral(STOREDFINGERPRINT_PATH));
+    }
 }
 
 QByteArray FingerprintsService::GlobalHardwareId()
 {
     Q_EMIT activity();
-    QByteArray f = calculateHardwareFingerprint(QByteArray("ThisHardwareIdWillBePublicAndEveryoneWillSeeIt!"), QByteArray("HEMERA1_HWID1"));
+    if (m_globalHardwareId.isEmpty()) {
+        m_globalHardwareId = persistedGlobalId(FingerprintType::Hardware, QStringLiteral(GLOBALHARDWAREID_PATH),
+                                               QStringLiteral(HARDWAREFINGERPRINT_PATH));
+    }
 
-    return f;
+    return m_globalHardwareId;
 }
 
 QByteArray FingerprintsService::GlobalSystemId()
 {
     Q_EMIT activity();
-    QByteArray f = calculateStoredFingerprint(QByteArray("ThisSoftwareIdWillBePublicAndEveryoneWillSeeIt!!!"), QByteArray("HEMERA1_SYSID1"));
+    if (m_globalSystemId.isEmpty()) {
+        m_globalSystemId = persistedGlobalId(FingerprintType::Stored, QStringLiteral(GLOBALSYSTEMID_PATH),
+                                             QStringLiteral(STOREDFINGERPRINT_PATH));
+    }
+
+    return m_globalSystemId;
+}
+
+void FingerprintsService::setActivationLatency(qint64 msecs)
+{
+    m_activationLatency = msecs;
+}
 
-    return f;
+void FingerprintsService::setIdleTimer(AdaptiveIdleTimer *idleTimer)
+{
+    m_idleTimer = idleTimer;
+}
+
+QVariantMap FingerprintsService::Metrics() const
+{
+    QVariantMap result;
+    result.insert(QStringLiteral("activationLatency"), m_activationLatency);
+    result.insert(QStringLiteral("requests"), m_requests);
+    if (m_idleTimer) {
+        result.insert(QStringLiteral("idleTimeout"), m_idleTimer->timeout());
+        result.insert(QStringLiteral("meanInterval"), m_idleTimer->meanInterval());
+    }
+    return result;
 }
@@ -4,14 +4,22 @@
 #include <HemeraCore/AsyncInitObject>
 #include <QtCore/QStringList>
 #include <QtCore/QByteArray>
+#include <QtCore/QCache>
 #include <QtCore/QPointer>
+#include <QtCore/QVariantMap>
 
 #include <QtDBus/QDBusContext>
 
+#include "securememory.h"
+
 namespace Gravity {
+class CredentialsResolver;
 class FingerprintProviderPlugin;
 }
 
+class AdaptiveIdleTimer;
+class QFileSystemWatcher;
+
 class FingerprintsService : public Hemera::AsyncInitObject, protected QDBusContext
 {
     Q_OBJECT
@@ -23,13 +31,25 @@ public:
 
     QByteArray HardwareSerialNumber(const QByteArray &seed);
     QByteArray StoredSerialNumber(const QByteArray &seed);
+    QList< QByteArray > HardwareSerialNumbers(const QList< QByteArray > &seeds);
+    QList< QByteArray > StoredSerialNumbers(const QList< QByteArray > &seeds);
 
     QByteArray GlobalHardwareId();
     QByteArray GlobalSystemId();
 
+    QVariantMap Metrics() const;
+
     QByteArray calculateHardwareFingerprint(const QByteArray &seed, const QByteArray &seed2);
     QByteArray calculateStoredFingerprint(const QByteArray &seed, const QByteArray &seed2);
 
+    /// Drops every cached fingerprint and wipes the secrets from memory
+    void wipeSecrets();
+
+    /// Computes the global IDs ahead of time, unless they have been persisted already
+    void precomputeGlobalIds();
+    void setActivationLatency(qint64 msecs);
+    void setIdleTimer(AdaptiveIdleTimer *idleTimer);
+
 private Q_SLOTS:
     void initImpl() override final;
 
@@ -37,15 +57,44 @@ Q_SIGNALS:
     void activity();
 
 private:
-    QString usernameFromUid(uid_t uid);
+    enum class FingerprintType {
+        Stored,
+        Hardware
+    };
+
+    void sendFingerprints(FingerprintType type, const QList< QByteArray > &seeds, bool batched);
     void loadProviderPlugin();
 
     static void createMissingPath();
 
     QByteArray initStoredSerialNumber();
+    QByteArray initHardwareSerialNumber();
+
+    QByteArray persistedGlobalId(FingerprintType type, const QString &idPath, const QString &secretPath);
+
+    // Both return a view on the locked secret: don't keep it around.
+    QByteArray storedSecret();
+    QByteArray hardwareSecret();
+    void watchSecrets();
 
     QPointer< Gravity::FingerprintProviderPlugin > m_provider;
     Gravity::FingerprintProviderPlugin *m_fallbackProvider;
+    Gravity::CredentialsResolver *m_credentialsResolver;
+
+    // Secrets are read once, and kept in locked memory until they change or we go idle.
+    SecureBuffer m_storedSecret;
+    SecureBuffer m_hardwareSecret;
+    // Fingerprints are deterministic for a given pair of seeds. Seeds come from callers: keep only the most recent ones.
+    QCache< QByteArray, QByteArray > m_storedFingerprints;
+    QCache< QByteArray, QByteArray > m_hardwareFingerprints;
+    QFileSystemWatcher *m_secretsWatcher;
+    // Global IDs are public, and persisted next to the secrets they derive from.
+    QByteArray m_globalHardwareId;
+    QByteArray m_globalSystemId;
+
+    QPointer< AdaptiveIdleTimer > m_idleTimer;
+    qint64 m_activationLatency;
+    quint64 m_requests;
 };
 
 #endif // FINGERPRINTSSERVICE_H
@@ -4,60 +4,116 @@
 
 #include <QtCore/QCryptographicHash>
 #include <QtCore/QDebug>
-#include <QtCore/QFile>
 
-#include <libudev.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
 
-GenericFingerprintProvider::GenericFingerprintProvider(QObject* parent): FingerprintProviderPlugin(parent)
+namespace {
+
+// Reads a small sysfs/procfs attribute in one go, without any trailing whitespace.
+QByteArray readAttribute(const QByteArray &path)
 {
+    int fd = ::open(path.constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return QByteArray();
+    }
+
+    QByteArray result;
+    char buffer[4096];
+    ssize_t r;
+    do {
+        r = ::read(fd, buffer, sizeof(buffer));
+        if (r > 0) {
+            result.append(buffer, r);
+        }
+    } while (r > 0 || (r < 0 && errno == EINTR));
+    ::close(fd);
+
+    while (!result.isEmpty() && (result.endsWith('\n') || result.endsWith(' ') || result.endsWith('\0'))) {
+        result.chop(1);
+    }
 
+    return result;
 }
 
-GenericFingerprintProvider::~GenericFingerprintProvider()
+// Subsystem of the device backing a class device, or an empty string if it is virtual.
+QByteArray parentSubsystem(const QByteArray &classDevicePath, bool *hasParent)
 {
+    char link[PATH_MAX];
+    ssize_t size = ::readlink((classDevicePath + "/device/subsystem").constData(), link, sizeof(link) - 1);
+    *hasParent = size >= 0 || ::access((classDevicePath + "/device").constData(), F_OK) == 0;
+    if (size < 0) {
+        return QByteArray();
+    }
 
+    link[size] = '\0';
+    const char *name = strrchr(link, '/');
+    return QByteArray(name ? name + 1 : link);
 }
 
-QByteArray GenericFingerprintProvider::initHardwareSerialNumber()
+void collectAddresses(const char *classPath, QStringList *uidsList, QStringList *removableUidsList)
 {
-    QStringList uidsList;
-    QStringList removableUidsList;
+    DIR *dir = ::opendir(classPath);
+    if (!dir) {
+        return;
+    }
 
-    udev *ud = udev_new();
-    udev_enumerate *uenum = udev_enumerate_new(ud);
-    udev_enumerate_add_match_subsystem(uenum, "net");
-    udev_enumerate_add_match_subsystem(uenum, "bluetooth");
-    udev_enumerate_scan_devices(uenum);
-    udev_list_entry *dev_list_entry;
-    udev_list_entry *devices = udev_enumerate_get_list_entry(uenum);
-
-    udev_list_entry_foreach(dev_list_entry, devices) {
-        const char *path = udev_list_entry_get_name(dev_list_entry);
-        udev_device *dev = udev_device_new_from_syspath(ud, path);
-        //check if it is virtual: it has no ..\device path
-        udev_device *parentDev = udev_device_get_parent(dev);
-        if (!parentDev){
+    while (struct dirent *entry = ::readdir(dir)) {
+        if (entry->d_name[0] == '.') {
             continue;
         }
 
-        const char *parentSubsystems = udev_device_get_subsystem(parentDev);
+        QByteArray devicePath = QByteArray(classPath) + '/' + entry->d_name;
 
-        if (!parentSubsystems) {
-            qWarning() << "Found device without subsystem: " << udev_device_get_syspath(parentDev);
+        // Virtual devices have no backing device, and they don't identify the hardware.
+        bool hasParent;
+        QByteArray subsystem = parentSubsystem(devicePath, &hasParent);
+        if (!hasParent) {
+            continue;
         }
 
-        const char *addrSysAttr = udev_device_get_sysattr_value(dev, "address");
-        if (addrSysAttr) {
-            QString hwAddr = QString::fromLatin1(addrSysAttr);
-            if (parentSubsystems && QString::fromLatin1(parentSubsystems).contains(QStringLiteral("usb"))) {
-                removableUidsList.append(hwAddr);
-            } else {
-                uidsList.append(hwAddr);
-            }
+        if (subsystem.isEmpty()) {
+            qWarning() << "Found device without subsystem: " << devicePath;
+        }
+
+        QByteArray address = readAttribute(devicePath + "/address");
+        if (address.isEmpty()) {
+            continue;
+        }
+
+        if (subsystem.contains("usb")) {
+            removableUidsList->append(QString::fromLatin1(address));
+        } else {
+            uidsList->append(QString::fromLatin1(address));
         }
     }
 
-    //We need to free udev context
+    ::closedir(dir);
+}
+
+}
+
+GenericFingerprintProvider::GenericFingerprintProvider(QObject* parent): FingerprintProviderPlugin(parent)
+{
+
+}
+
+GenericFingerprintProvider::~GenericFingerprintProvider()
+{
+
+}
+
+QByteArray GenericFingerprintProvider::initHardwareSerialNumber()
+{
+    QStringList uidsList;
+    QStringList removableUidsList;
+
+    collectAddresses("/sys/class/net", &uidsList, &removableUidsList);
+    collectAddresses("/sys/class/bluetooth", &uidsList, &removableUidsList);
 
     QCryptographicHash hash(QCryptographicHash::Md5);
     uidsList.sort();
@@ -75,6 +131,13 @@ QByteArray GenericFingerprintProvider::initHardwareSerialNumber()
         }
     }
 
+    // Only units without any network hardware fall back to the board serial, to keep existing fingerprints stable.
+    if (uidsList.isEmpty() && removableUidsList.isEmpty()) {
+        QByteArray boardSerial = this->boardSerial();
+        qDebug() << "Board serial: " << boardSerial;
+        hash.addData(boardSerial);
+    }
+
     hash.addData(cpuValues().join(QStringLiteral(" ")).toLatin1());
 
     qDebug() << "Key: " << hash.result().toHex();
@@ -82,38 +145,56 @@ QByteArray GenericFingerprintProvider::initHardwareSerialNumber()
     return hash.result();
 }
 
+QByteArray GenericFingerprintProvider::boardSerial() const
+{
+    static const char * const serialPaths[] = { "/sys/firmware/devicetree/base/serial-number",
+                                                "/sys/class/dmi/id/product_serial",
+                                                "/sys/class/dmi/id/board_serial" };
+
+    for (const char *path : serialPaths) {
+        QByteArray serial = readAttribute(path);
+        if (!serial.isEmpty()) {
+            return serial;
+        }
+    }
+
+    return QByteArray();
+}
+
 QStringList GenericFingerprintProvider::cpuValues() const
 {
     QStringList list;
 
-    QFile cpuinfoFile(QStringLiteral("/proc/cpuinfo"));
-    if (!cpuinfoFile.open(QIODevice::ReadOnly)) {
+    QByteArray cpuinfo = readAttribute("/proc/cpuinfo");
+    if (cpuinfo.isEmpty()) {
         qWarning() << "Could not open cpuinfo!";
         return QStringList();
     }
 
-    QTextStream cpuinfo(&cpuinfoFile);
+    static const char * const interestingKeys[] = { "serial", "CPU implementer", "CPU architecture", "CPU variant", "CPU part",
+                                                    "CPU revision", "cpu family", "model" };
 
-    QStringList interstingKeys = { QStringLiteral("serial"), QStringLiteral("CPU implementer"), QStringLiteral("CPU architecture"),
-                                   QStringLiteral("CPU variant"), QStringLiteral("CPU part"), QStringLiteral("CPU revision"), QStringLiteral("cpu family"),
-                                   QStringLiteral("model") };
+    for (const QByteArray &line : cpuinfo.split('\n')) {
+        // Every key we care about starts with one of these.
+        if (line.isEmpty() || (line.at(0) != 's' && line.at(0) != 'C' && line.at(0) != 'c' && line.at(0) != 'm')) {
+            continue;
+        }
 
-    QString line;
-    do {
-        line = cpuinfo.readLine();
-
-        for (const QString &checkKey : interstingKeys) {
-            if (line.startsWith(checkKey)) {
-                QStringList sl = line.split(QLatin1Char(':'));
-                if (sl.count() != 2) {
-                    continue;
-                }
-                QString cpuValue = sl.at(1).simplified();
-                qDebug() << "CPU info: " << checkKey << ": " << cpuValue;
-                list.append(cpuValue);
+        for (const char *checkKey : interestingKeys) {
+            if (!line.startsWith(checkKey)) {
+                continue;
+            }
+
+            if (line.count(':') != 1) {
+                break;
             }
+
+            QString cpuValue = QString::fromLatin1(line.mid(line.indexOf(':') + 1).simplified());
+            qDebug() << "CPU info: " << checkKey << ": " << cpuValue;
+            list.append(cpuValue);
+            break;
         }
-    } while (!line.isNull());
+    }
 
     if (list.isEmpty()) {
         qWarning() << "no available CPU info";
@@ -16,6 +16,7 @@ public:
     virtual QByteArray initHardwareSerialNumber() override final;
 
 private:
+    QByteArray boardSerial() const;
     QStringList cpuValues() const;
 };
 
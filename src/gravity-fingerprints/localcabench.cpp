@@ -0,0 +1,142 @@
+/*
+ * Measures how many certificates the local CA signs per second.
+ *
+ * Usage: gravity-localca-bench [rsa|ec] [requests]
+ *
+ * A throwaway authority key and certificate request are generated on the fly, and the same request
+ * is signed over and over on one to QThread::idealThreadCount() threads, as SignSSLCertificate does.
+ */
+
+#include "localcertificateauthority.h"
+
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QTemporaryDir>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
+
+#include <QtConcurrent/QtConcurrentRun>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#include <atomic>
+#include <iostream>
+
+static EVP_PKEY *generateKey(bool rsa)
+{
+    EVP_PKEY_CTX *context = EVP_PKEY_CTX_new_id(rsa ? EVP_PKEY_RSA : EVP_PKEY_EC, nullptr);
+    EVP_PKEY *key = nullptr;
+
+    bool ok = EVP_PKEY_keygen_init(context) == 1 &&
+              (rsa ? EVP_PKEY_CTX_set_rsa_keygen_bits(context, 2048) == 1
+                   : EVP_PKEY_CTX_set_ec_paramgen_curve_nid(context, NID_X9_62_prime256v1) == 1) &&
+              EVP_PKEY_keygen(context, &key) == 1;
+    EVP_PKEY_CTX_free(context);
+
+    return ok ? key : nullptr;
+}
+
+static QByteArray privateKeyPem(EVP_PKEY *key)
+{
+    BIO *bio = BIO_new(BIO_s_mem());
+    QByteArray result;
+    if (PEM_write_bio_PrivateKey(bio, key, nullptr, nullptr, 0, nullptr, nullptr) == 1) {
+        char *data;
+        long size = BIO_get_mem_data(bio, &data);
+        result = QByteArray(data, size);
+    }
+    BIO_free(bio);
+
+    return result;
+}
+
+static QByteArray requestPem(EVP_PKEY *key)
+{
+    X509_REQ *request = X509_REQ_new();
+    X509_NAME *name = X509_REQ_get_subject_name(request);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast< const unsigned char* >("gravity-localca-bench"), -1, -1, 0);
+
+    BIO *bio = BIO_new(BIO_s_mem());
+    QByteArray result;
+    if (X509_REQ_set_pubkey(request, key) == 1 && X509_REQ_sign(request, key, EVP_sha256()) > 0 &&
+        PEM_write_bio_X509_REQ(bio, request) == 1) {
+        char *data;
+        long size = BIO_get_mem_data(bio, &data);
+        result = QByteArray(data, size);
+    }
+    BIO_free(bio);
+    X509_REQ_free(request);
+
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    bool rsa = argc < 2 || qstrcmp(argv[1], "ec") != 0;
+    int requests = argc > 2 ? QByteArray(argv[2]).toInt() : 2000;
+    if (requests <= 0) {
+        std::cerr << "Usage: " << argv[0] << " [rsa|ec] [requests]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    EVP_PKEY *authorityKey = generateKey(rsa);
+    EVP_PKEY *requestKey = generateKey(rsa);
+    if (!authorityKey || !requestKey) {
+        std::cerr << "Could not generate the keys." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    QByteArray privateKey = privateKeyPem(authorityKey);
+    QByteArray csr = requestPem(requestKey);
+    EVP_PKEY_free(authorityKey);
+    EVP_PKEY_free(requestKey);
+
+    // The CA certificate is created and cached on load: that's the cold start of the service.
+    QTemporaryDir cacheDir;
+    QString errorMessage;
+    LocalCertificateAuthority authority;
+    QElapsedTimer timer;
+    timer.start();
+    if (!authority.load(privateKey, QByteArray(), cacheDir.path() + QStringLiteral("/localca.crt"), &errorMessage)) {
+        std::cerr << "Could not load the authority: " << errorMessage.toLocal8Bit().constData() << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << (rsa ? "RSA 2048" : "EC P-256") << " authority loaded in " << timer.elapsed() << " ms" << std::endl;
+
+    for (int threads = 1; threads <= QThread::idealThreadCount(); threads *= 2) {
+        QThreadPool pool;
+        pool.setMaxThreadCount(threads);
+
+        std::atomic< int > signedCertificates(0);
+        QList< QFuture< void > > futures;
+        timer.restart();
+        for (int i = 0; i < threads; ++i) {
+            int share = requests / threads + (i < requests % threads ? 1 : 0);
+            futures.append(QtConcurrent::run(&pool, [&authority, &signedCertificates, csr, share] {
+                for (int j = 0; j < share; ++j) {
+                    QString error;
+                    if (!authority.sign(csr, 24 * 60 * 60, &error).isEmpty()) {
+                        ++signedCertificates;
+                    }
+                }
+            }));
+        }
+        for (QFuture< void > &future : futures) {
+            future.waitForFinished();
+        }
+
+        qint64 elapsed = qMax(Q_INT64_C(1), timer.elapsed());
+        int count = signedCertificates.load();
+        std::cout << threads << " thread(s): " << count << " certificates in " << elapsed << " ms, "
+                  << count * Q_INT64_C(1000) / elapsed << " signatures/s" << std::endl;
+
+        if (count != requests) {
+            std::cerr << "Some requests could not be signed!" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
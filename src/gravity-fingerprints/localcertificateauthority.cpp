@@ -0,0 +1,265 @@
+#include "localcertificateauthority.h"
+
+#include <QtCore/QDebug>
+#include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+
+#include <openssl/bn.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+/* 10 years */
+constexpr long caValidity() { return 10L * 365 * 24 * 60 * 60; }
+/* Tolerate clocks running a little behind ours */
+constexpr long clockSkew() { return 5 * 60; }
+
+namespace {
+
+QString openSslError(const char *what)
+{
+    QString message = QString::fromLatin1(what);
+    unsigned long error = ERR_get_error();
+    if (error != 0) {
+        char buffer[256];
+        ERR_error_string_n(error, buffer, sizeof(buffer));
+        message.append(QStringLiteral(": %1").arg(QLatin1String(buffer)));
+    }
+    // Don't leave anything behind for the next operation on this thread.
+    ERR_clear_error();
+
+    return message;
+}
+
+QByteArray toPem(X509 *certificate)
+{
+    BIO *bio = BIO_new(BIO_s_mem());
+    QByteArray result;
+    if (PEM_write_bio_X509(bio, certificate) == 1) {
+        char *data;
+        long size = BIO_get_mem_data(bio, &data);
+        result = QByteArray(data, size);
+    }
+    BIO_free(bio);
+
+    return result;
+}
+
+X509 *fromPem(const QByteArray &pem)
+{
+    if (pem.isEmpty()) {
+        return nullptr;
+    }
+
+    BIO *bio = BIO_new_mem_buf(pem.constData(), pem.size());
+    X509 *certificate = PEM_read_bio_X509(bio, nullptr, nullptr, nullptr);
+    BIO_free(bio);
+    ERR_clear_error();
+
+    return certificate;
+}
+
+bool addExtension(X509 *certificate, X509V3_CTX *context, int nid, const char *value)
+{
+    X509_EXTENSION *extension = X509V3_EXT_conf_nid(nullptr, context, nid, const_cast< char* >(value));
+    if (!extension) {
+        return false;
+    }
+
+    bool result = X509_add_ext(certificate, extension, -1) == 1;
+    X509_EXTENSION_free(extension);
+    return result;
+}
+
+bool setRandomSerial(X509 *certificate)
+{
+    BIGNUM *serial = BN_new();
+    bool result = BN_rand(serial, 127, BN_RAND_TOP_ANY, BN_RAND_BOTTOM_ANY) == 1 &&
+                  BN_to_ASN1_INTEGER(serial, X509_get_serialNumber(certificate)) != nullptr;
+    BN_free(serial);
+
+    return result;
+}
+
+const EVP_MD *digestFor(EVP_PKEY *key)
+{
+#ifdef EVP_PKEY_ED25519
+    // EdDSA keys carry their own digest
+    if (EVP_PKEY_id(key) == EVP_PKEY_ED25519) {
+        return nullptr;
+    }
+#endif
+    return EVP_sha256();
+}
+
+const char *keyUsageFor(EVP_PKEY *key)
+{
+    // Only RSA keys can encipher the key exchange, EC and EdDSA keys just sign it.
+    if (EVP_PKEY_id(key) == EVP_PKEY_RSA) {
+        return "critical,digitalSignature,keyEncipherment";
+    }
+    return "critical,digitalSignature";
+}
+
+}
+
+LocalCertificateAuthority::LocalCertificateAuthority()
+    : m_key(nullptr)
+    , m_certificate(nullptr)
+{
+}
+
+LocalCertificateAuthority::~LocalCertificateAuthority()
+{
+    X509_free(m_certificate);
+    EVP_PKEY_free(m_key);
+}
+
+bool LocalCertificateAuthority::isValid() const
+{
+    return m_key && m_certificate;
+}
+
+QByteArray LocalCertificateAuthority::certificate() const
+{
+    return m_certificatePem;
+}
+
+bool LocalCertificateAuthority::matchesKey(X509 *certificate) const
+{
+    bool result = certificate && X509_check_ca(certificate) > 0 && X509_check_private_key(certificate, m_key) == 1;
+    ERR_clear_error();
+    return result;
+}
+
+bool LocalCertificateAuthority::load(const QByteArray &privateKey, const QByteArray &certificate, const QString &cachePath,
+                                     QString *errorMessage)
+{
+    BIO *bio = BIO_new_mem_buf(privateKey.constData(), privateKey.size());
+    m_key = PEM_read_bio_PrivateKey(bio, nullptr, nullptr, nullptr);
+    BIO_free(bio);
+    if (!m_key) {
+        *errorMessage = openSslError("Could not parse the appliance private key");
+        return false;
+    }
+
+    // The appliance certificate is our CA only if it was issued as such.
+    m_certificate = fromPem(certificate);
+    if (!matchesKey(m_certificate)) {
+        X509_free(m_certificate);
+
+        QFile cache(cachePath);
+        m_certificate = cache.open(QIODevice::ReadOnly) ? fromPem(cache.readAll()) : nullptr;
+        cache.close();
+
+        if (!matchesKey(m_certificate)) {
+            X509_free(m_certificate);
+            m_certificate = createCertificate();
+            if (!m_certificate) {
+                *errorMessage = openSslError("Could not create the local CA certificate");
+                return false;
+            }
+
+            QDir().mkpath(QFileInfo(cachePath).absolutePath());
+            if (!cache.open(QIODevice::WriteOnly | QIODevice::Truncate) || cache.write(toPem(m_certificate)) < 0) {
+                qWarning() << "Could not cache the local CA certificate in" << cachePath << cache.errorString();
+            }
+        }
+    }
+
+    // Populate the extension cache now, so that signing threads only ever read from the certificate.
+    X509_check_purpose(m_certificate, -1, 0);
+    m_certificatePem = toPem(m_certificate);
+
+    return true;
+}
+
+X509 *LocalCertificateAuthority::createCertificate() const
+{
+    X509 *certificate = X509_new();
+
+    X509_NAME *name = X509_get_subject_name(certificate);
+    X509_NAME_add_entry_by_txt(name, "O", MBSTRING_ASC, reinterpret_cast< const unsigned char* >("Hemera"), -1, -1, 0);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, reinterpret_cast< const unsigned char* >("Hemera Appliance Local CA"), -1, -1, 0);
+
+    X509V3_CTX context;
+    X509V3_set_ctx(&context, certificate, certificate, nullptr, nullptr, 0);
+
+    bool ok = X509_set_version(certificate, 2) == 1 && setRandomSerial(certificate) &&
+              X509_set_issuer_name(certificate, name) == 1 &&
+              X509_gmtime_adj(X509_getm_notBefore(certificate), -clockSkew()) &&
+              X509_gmtime_adj(X509_getm_notAfter(certificate), caValidity()) &&
+              X509_set_pubkey(certificate, m_key) == 1 &&
+              addExtension(certificate, &context, NID_basic_constraints, "critical,CA:TRUE,pathlen:0") &&
+              addExtension(certificate, &context, NID_key_usage, "critical,keyCertSign,cRLSign") &&
+              addExtension(certificate, &context, NID_subject_key_identifier, "hash") &&
+              X509_sign(certificate, m_key, digestFor(m_key)) > 0;
+
+    if (!ok) {
+        X509_free(certificate);
+        return nullptr;
+    }
+
+    return certificate;
+}
+
+QByteArray LocalCertificateAuthority::sign(const QByteArray &csr, long validity, QString *errorMessage) const
+{
+    BIO *bio = BIO_new_mem_buf(csr.constData(), csr.size());
+    X509_REQ *request = PEM_read_bio_X509_REQ(bio, nullptr, nullptr, nullptr);
+    BIO_free(bio);
+    if (!request) {
+        *errorMessage = openSslError("Could not parse the certificate signing request");
+        return QByteArray();
+    }
+
+    EVP_PKEY *requestKey = X509_REQ_get_pubkey(request);
+    if (!requestKey || X509_REQ_verify(request, requestKey) != 1) {
+        *errorMessage = openSslError("The certificate signing request is not signed by its own key");
+        EVP_PKEY_free(requestKey);
+        X509_REQ_free(request);
+        return QByteArray();
+    }
+
+    X509 *certificate = X509_new();
+    X509V3_CTX context;
+    X509V3_set_ctx(&context, m_certificate, certificate, nullptr, nullptr, 0);
+
+    bool ok = X509_set_version(certificate, 2) == 1 && setRandomSerial(certificate) &&
+              X509_set_issuer_name(certificate, X509_get_subject_name(m_certificate)) == 1 &&
+              X509_set_subject_name(certificate, X509_REQ_get_subject_name(request)) == 1 &&
+              X509_gmtime_adj(X509_getm_notBefore(certificate), -clockSkew()) &&
+              X509_gmtime_adj(X509_getm_notAfter(certificate), validity) &&
+              X509_set_pubkey(certificate, requestKey) == 1 &&
+              addExtension(certificate, &context, NID_basic_constraints, "critical,CA:FALSE") &&
+              addExtension(certificate, &context, NID_key_usage, keyUsageFor(requestKey)) &&
+              addExtension(certificate, &context, NID_ext_key_usage, "serverAuth,clientAuth") &&
+              addExtension(certificate, &context, NID_subject_key_identifier, "hash") &&
+              addExtension(certificate, &context, NID_authority_key_identifier, "keyid");
+
+    // The only requested extension we honour is the subject alternative name.
+    STACK_OF(X509_EXTENSION) *requestedExtensions = X509_REQ_get_extensions(request);
+    for (int i = 0; ok && i < sk_X509_EXTENSION_num(requestedExtensions); ++i) {
+        X509_EXTENSION *extension = sk_X509_EXTENSION_value(requestedExtensions, i);
+        if (OBJ_obj2nid(X509_EXTENSION_get_object(extension)) == NID_subject_alt_name) {
+            ok = X509_add_ext(certificate, extension, -1) == 1;
+        }
+    }
+    sk_X509_EXTENSION_pop_free(requestedExtensions, X509_EXTENSION_free);
+
+    QByteArray result;
+    if (ok && X509_sign(certificate, m_key, digestFor(m_key)) > 0) {
+        result = toPem(certificate);
+    } else {
+        *errorMessage = openSslError("Could not sign the certificate");
+    }
+
+    X509_free(certificate);
+    EVP_PKEY_free(requestKey);
+    X509_REQ_free(request);
+
+    return result;
+}
@@ -0,0 +1,46 @@
+#ifndef LOCALCERTIFICATEAUTHORITY_H
+#define LOCALCERTIFICATEAUTHORITY_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QString>
+
+typedef struct evp_pkey_st EVP_PKEY;
+typedef struct x509_st X509;
+
+/**
+ * Signs certificate requests on behalf of the appliance.
+ *
+ * The signing key is parsed once, when the authority is loaded. Once loaded, sign() only reads
+ * the authority's state and can be called from any number of threads at the same time.
+ */
+class LocalCertificateAuthority
+{
+public:
+    LocalCertificateAuthority();
+    ~LocalCertificateAuthority();
+
+    /**
+     * Loads the authority from a PEM private key. @p certificate is used as the CA certificate
+     * if it is a CA certificate for that key, otherwise the one cached at @p cachePath is, and
+     * if that does not match either a new self-signed one is created and cached there.
+     */
+    bool load(const QByteArray &privateKey, const QByteArray &certificate, const QString &cachePath, QString *errorMessage);
+
+    bool isValid() const;
+    QByteArray certificate() const;
+
+    /// Signs the PEM request @p csr, and returns the PEM certificate, valid for @p validity seconds.
+    QByteArray sign(const QByteArray &csr, long validity, QString *errorMessage) const;
+
+private:
+    Q_DISABLE_COPY(LocalCertificateAuthority)
+
+    bool matchesKey(X509 *certificate) const;
+    X509 *createCertificate() const;
+
+    EVP_PKEY *m_key;
+    X509 *m_certificate;
+    QByteArray m_certificatePem;
+};
+
+#endif // LOCALCERTIFICATEAUTHORITY_H
@@ -1,19 +1,42 @@
 #include <QtCore/QCoreApplication>
+#include <QtCore/QFile>
 #include <QtCore/QTimer>
 
 #include <HemeraCore/Operation>
 #include <HemeraCore/CommonOperations>
 
+#include "adaptiveidletimer.h"
 #include "appliancecryptoservice.h"
 #include "fingerprintsservice.h"
 
 #include <systemd/sd-daemon.h>
 #include <systemd/sd-journal.h>
 
-#include <functional>
+#include <time.h>
+#include <unistd.h>
 
-/* 60 seconds */
-constexpr int killerInterval() { return 60 * 1000; }
+// How long it took since the process was spawned, in milliseconds
+static qint64 processAge()
+{
+    QFile stat(QStringLiteral("/proc/self/stat"));
+    if (!stat.open(QIODevice::ReadOnly)) {
+        return -1;
+    }
+
+    // The command name might contain spaces: fields are counted from its closing parenthesis.
+    QByteArray line = stat.readAll();
+    QList< QByteArray > fields = line.mid(line.lastIndexOf(')') + 2).split(' ');
+    if (fields.size() < 20) {
+        return -1;
+    }
+
+    // starttime, field 22, is in clock ticks since boot.
+    qint64 startTime = fields.at(19).toLongLong() * 1000 / sysconf(_SC_CLK_TCK);
+
+    struct timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    return static_cast< qint64 >(now.tv_sec) * 1000 + now.tv_nsec / 1000000 - startTime;
+}
 
 int main(int argc, char **argv)
 {
@@ -30,21 +53,26 @@ int main(int argc, char **argv)
             return;
         }
 
+        fingerprintsService->setActivationLatency(processAge());
+
         // Activity monitoring
-        QTimer *killerTimer = new QTimer;
-        QObject::connect(killerTimer, &QTimer::timeout, [killerTimer] {
+        AdaptiveIdleTimer *idleTimer = new AdaptiveIdleTimer;
+        QObject::connect(idleTimer, &AdaptiveIdleTimer::idle, [idleTimer, fingerprintsService, applianceCryptoService] {
             sd_notify(0, "STATUS=hemera-fingerprints is shutting down due to inactivity.\n");
-            killerTimer->deleteLater();
+            fingerprintsService->wipeSecrets();
+            applianceCryptoService->wipeStore();
+            idleTimer->deleteLater();
             QCoreApplication::instance()->quit();
         });
-        killerTimer->setInterval(killerInterval());
-        killerTimer->setSingleShot(true);
 
-        auto timerStart = (void (QTimer::*)())&QTimer::start;
-        QObject::connect(fingerprintsService, &FingerprintsService::activity, killerTimer, timerStart);
-        QObject::connect(applianceCryptoService, &ApplianceCryptoService::activity, killerTimer, timerStart);
+        QObject::connect(fingerprintsService, &FingerprintsService::activity, idleTimer, &AdaptiveIdleTimer::activity);
+        QObject::connect(applianceCryptoService, &ApplianceCryptoService::activity, idleTimer, &AdaptiveIdleTimer::activity);
+        fingerprintsService->setIdleTimer(idleTimer);
+
+        idleTimer->start();
 
-        killerTimer->start();
+        // Whoever activated us is likely to need the global IDs, now or soon.
+        QTimer::singleShot(0, fingerprintsService, &FingerprintsService::precomputeGlobalIds);
 
         sd_notify(0, "STATUS=hemera-fingerprints is active.\n");
     });
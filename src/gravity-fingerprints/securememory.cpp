@@ -0,0 +1,73 @@
+#include "securememory.h"
+
+#include <QtCore/QDebug>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+SecureBuffer::SecureBuffer()
+    : m_data(Q_NULLPTR)
+    , m_size(0)
+    , m_capacity(0)
+{
+}
+
+SecureBuffer::~SecureBuffer()
+{
+    wipe();
+}
+
+void SecureBuffer::take(QByteArray &secret)
+{
+    wipe();
+
+    if (!secret.isEmpty()) {
+        // Whole pages, so that nothing else shares them
+        size_t pageSize = sysconf(_SC_PAGESIZE);
+        size_t capacity = ((secret.size() + pageSize - 1) / pageSize) * pageSize;
+
+        void *data = mmap(Q_NULLPTR, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED) {
+            qWarning() << "Could not allocate memory for a secret:" << strerror(errno);
+        } else {
+            // Don't let the secret hit the swap, or a core dump
+            if (mlock(data, capacity) < 0) {
+                qDebug() << "Could not lock a secret in memory:" << strerror(errno);
+            }
+            madvise(data, capacity, MADV_DONTDUMP);
+
+            m_data = static_cast< char* >(data);
+            m_capacity = capacity;
+            m_size = secret.size();
+            memcpy(m_data, secret.constData(), m_size);
+        }
+    }
+
+    // Writing to shared data would only zero a detached copy, and leave the original around.
+    if (secret.isDetached()) {
+        explicit_bzero(secret.data(), secret.size());
+    }
+    secret.clear();
+}
+
+void SecureBuffer::wipe()
+{
+    if (!m_data) {
+        return;
+    }
+
+    explicit_bzero(m_data, m_capacity);
+    munlock(m_data, m_capacity);
+    munmap(m_data, m_capacity);
+
+    m_data = Q_NULLPTR;
+    m_size = 0;
+    m_capacity = 0;
+}
+
+QByteArray SecureBuffer::data() const
+{
+    return QByteArray::fromRawData(m_data, m_size);
+}
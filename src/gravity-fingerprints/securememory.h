@@ -0,0 +1,40 @@
+#ifndef SECUREMEMORY_H
+#define SECUREMEMORY_H
+
+#include <QtCore/QByteArray>
+
+/**
+ * Holds a secret in pages of its own, locked in memory and left out of core dumps.
+ *
+ * Since the pages hold nothing else, locking and unlocking them never affects other data. The secret
+ * is zeroed before its pages are unlocked and given back to the system.
+ */
+class SecureBuffer
+{
+    Q_DISABLE_COPY(SecureBuffer)
+
+public:
+    SecureBuffer();
+    ~SecureBuffer();
+
+    /**
+     * Moves @p secret in the buffer, replacing what it held. @p secret is zeroed if nobody else
+     * shares its data, and cleared in any case.
+     */
+    void take(QByteArray &secret);
+    /// Zeroes the secret, and gives its memory back
+    void wipe();
+
+    inline bool isEmpty() const { return m_size == 0; }
+    inline int size() const { return m_size; }
+
+    /// The secret, without copies: the returned array is valid only until the buffer is wiped or replaced
+    QByteArray data() const;
+
+private:
+    char *m_data;
+    int m_size;
+    size_t m_capacity;
+};
+
+#endif // SECUREMEMORY_H
@@ -0,0 +1,65 @@
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDebug>
+#include <QtCore/QStringList>
+
+#include <HemeraCore/Operation>
+
+#include <GravitySupermassive/Operations>
+
+/*
+ * Usage: gravity-package-mount mount <package> <mount point> [device key]
+ *        gravity-package-mount unmount <mount point>
+ *
+ * Exit codes are the ones of the mount-squash-package and umount-squash-package scripts it replaces:
+ * 120 when mounting or unmounting fails, 121 when the loop device can't be set up, 122 when the package can't
+ * be decrypted.
+ */
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    app.setApplicationName(QStringLiteral("Gravity Package Mount"));
+    app.setOrganizationDomain(QStringLiteral("com.ispirata.Hemera"));
+    app.setOrganizationName(QStringLiteral("Ispirata"));
+    app.setApplicationVersion(QStringLiteral(HEMERA_GRAVITY_VERSION));
+
+    QStringList arguments = app.arguments().mid(1);
+    Hemera::Operation *op = Q_NULLPTR;
+
+    if (arguments.size() >= 3 && arguments.size() <= 4 && arguments.first() == QStringLiteral("mount")) {
+        QByteArray deviceKey = arguments.size() == 4 ? arguments.at(3).toLocal8Bit() : QByteArray();
+        op = new Gravity::MountPackageOperation(arguments.at(1), arguments.at(2), deviceKey);
+    } else if (arguments.size() >= 2 && arguments.size() <= 3 && arguments.first() == QStringLiteral("unmount")) {
+        // The device key is not needed anymore, but the old scripts took it.
+        op = new Gravity::UnmountPackageOperation(arguments.at(1));
+    } else {
+        qWarning() << "Usage: gravity-package-mount mount <package> <mount point> [device key]";
+        qWarning() << "       gravity-package-mount unmount <mount point>";
+        return EXIT_FAILURE;
+    }
+
+    QObject::connect(op, &Hemera::Operation::finished, [op] {
+        if (!op->isError()) {
+            QCoreApplication::exit(EXIT_SUCCESS);
+            return;
+        }
+
+        qWarning() << "Failed:" << op->errorName() << op->errorMessage();
+
+        Gravity::MountPackageOperation *mountOp = qobject_cast< Gravity::MountPackageOperation* >(op);
+        switch (mountOp ? mountOp->failedStep() : Gravity::MountPackageOperation::Step::Mount) {
+            case Gravity::MountPackageOperation::Step::LoopDevice:
+                QCoreApplication::exit(121);
+                break;
+            case Gravity::MountPackageOperation::Step::CryptDevice:
+                QCoreApplication::exit(122);
+                break;
+            default:
+                QCoreApplication::exit(120);
+                break;
+        }
+    });
+
+    return app.exec();
+}
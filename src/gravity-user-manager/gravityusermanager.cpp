@@ -6,11 +6,16 @@
 
 #include <QtCore/QCoreApplication>
 #include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
 #include <QtCore/QFile>
 #include <QtCore/QHash>
 #include <QtCore/QProcess>
+#include <QtCore/QSaveFile>
 #include <QtCore/QTimer>
 #include <QtCore/QCryptographicHash>
+#include <QtCore/QVector>
+
+#include <QtConcurrent/QtConcurrentMap>
 
 #include <HemeraCore/Literals>
 
@@ -66,37 +71,6 @@ void GravityUserManager::notifyErrorAndQuit(const QString& error)
     QCoreApplication::exit(EXIT_FAILURE);
 }
 
-qint32 GravityUserManager::uidFor(const QString &username, qint32 baseUid, bool returnCorrectUid)
-{
-    lu_ent *ent = lu_ent_new();
-    struct lu_error *error = NULL;
-
-    // First of all, let's check the user actually exists
-    if (lu_user_lookup_name(m_luctx, username.toLatin1().constData(), ent, &error) == TRUE) {
-        // The user exists indeed.
-        qint32 uid;
-        if (!returnCorrectUid) {
-            // Return 0, which means update.
-            uid = 0;
-        } else {
-            // Return correct uid.
-            uid = lu_ent_get_first_id(ent, LU_UIDNUMBER);
-        }
-        lu_ent_free(ent);
-        return uid;
-    }
-
-    // Ok, let's look for the first valid uid then.
-    qint32 uid = baseUid;
-    while (lu_user_lookup_id(m_luctx, uid, ent, &error) == TRUE) {
-        ++uid;
-    }
-
-    lu_ent_free(ent);
-
-    return uid;
-}
-
 void GravityUserManager::initImpl()
 {
     std::cout << "Gravity User Manager version " << QCoreApplication::applicationVersion().toLatin1().constData()
@@ -113,6 +87,15 @@ void GravityUserManager::initImpl()
         return;
     }
 
+    // Load users and groups once: from now on, we keep the index up to date ourselves.
+    m_index.registerRange(ORBIT_USER_BASE_UID, STAR_USER_BASE_UID - ORBIT_USER_BASE_UID);
+    m_index.registerRange(STAR_USER_BASE_UID, STAR_USER_BASE_UID - ORBIT_USER_BASE_UID);
+    QString indexError;
+    if (!m_index.load(m_luctx, &indexError)) {
+        setInitError(Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest()), indexError);
+        return;
+    }
+
     // Verify each file exists and it's readable
     for (const QString &file : m_files) {
         QByteArray content = payload(file);
@@ -165,6 +148,7 @@ bool GravityUserManager::createUser(qint32 uid, const QString &baseGroup, const
         notifyErrorAndQuit(QStringLiteral("Account creation failed for %1: %2").arg(user, QLatin1String(lu_strerror(error))));
         return false;
     }
+    m_index.addUser(user, uid);
 
     if (lu_homedir_populate(m_luctx, NULL, homeDirectory.toLatin1().constData(),
                             uid, gidNumber, 0700, &error) == FALSE) {
@@ -172,7 +156,6 @@ bool GravityUserManager::createUser(qint32 uid, const QString &baseGroup, const
         return false;
     }
 
-    lu_nscd_flush_cache(LU_NSCD_CACHE_PASSWD);
     lu_ent_free(ent);
 
     // Create tmpfiles.d entry in /etc (not from package) and Add to groups
@@ -193,6 +176,7 @@ bool GravityUserManager::deleteUser(const QString& user)
         notifyErrorAndQuit(QStringLiteral("User %1 deletion failed: %2").arg(user, QLatin1String(lu_strerror(error))));
         return false;
     }
+    m_index.removeUser(user);
 
     if (lu_homedir_remove_for_user(ent, &error) == FALSE) {
         notifyErrorAndQuit(QStringLiteral("Could not remove home directory for %1: %2").arg(user, QLatin1String(lu_strerror(error))));
@@ -209,17 +193,16 @@ bool GravityUserManager::deleteUser(const QString& user)
 
 qint32 GravityUserManager::createGroup(const QString& groupName, qint32 uid)
 {
-    lu_ent *ent = lu_ent_new();
-    struct lu_error *error = NULL;
-
     // Lookup if the group already exists
-    if (lu_group_lookup_name(m_luctx, groupName.toLatin1().constData(), ent, &error) == TRUE) {
+    qint32 existingId = m_index.gid(groupName);
+    if (existingId >= 0) {
         // It does.
-        qint32 id = lu_ent_get_first_id(ent, LU_GIDNUMBER);
-        lu_ent_free(ent);
-        return id;
+        return existingId;
     }
 
+    lu_ent *ent = lu_ent_new();
+    struct lu_error *error = NULL;
+
     /* Create a group entity object holding sensible defaults for a
      * new group. */
     lu_group_default(m_luctx, groupName.toLatin1().constData(), FALSE, ent);
@@ -237,15 +220,37 @@ qint32 GravityUserManager::createGroup(const QString& groupName, qint32 uid)
     }
 
     qint32 id = lu_ent_get_first_id(ent, LU_GIDNUMBER);
+    m_index.addGroup(groupName, id);
 
-    lu_nscd_flush_cache(LU_NSCD_CACHE_GROUP);
     lu_ent_free(ent);
 
     return id;
 }
 
-static bool modifyGroup(struct lu_context *luctx, const QString& user, const QStringList& groups,
-                        void (*modifyFunction) (struct lu_ent *ent, const char *attr, const GValue *value))
+bool GravityUserManager::modifyGroups(const QString& user, const QStringList& groups, bool add)
+{
+    for (const QString &group : groups) {
+        // Lookup the group
+        if (m_index.gid(group) < 0) {
+            return false;
+        }
+
+        MembershipChanges &changes = m_pendingMemberships[group];
+        if (add) {
+            changes.removed.remove(user);
+            changes.added.insert(user);
+            m_index.addMember(group, user);
+        } else {
+            changes.added.remove(user);
+            changes.removed.insert(user);
+            m_index.removeMember(group, user);
+        }
+    }
+
+    return true;
+}
+
+bool GravityUserManager::commitMemberships()
 {
     struct lu_error *error = NULL;
     GValue val;
@@ -254,67 +259,77 @@ static bool modifyGroup(struct lu_context *luctx, const QString& user, const QSt
     // Initialize G-String.
     memset(&val, 0, sizeof(val));
     g_value_init(&val, G_TYPE_STRING);
-    g_value_set_string(&val, user.toLatin1().constData());
 
-    for (const QString &group : groups) {
+    bool result = true;
+    for (QHash< QString, MembershipChanges >::const_iterator i = m_pendingMemberships.constBegin(); i != m_pendingMemberships.constEnd(); ++i) {
         // Lookup the group
-        if (lu_group_lookup_name(luctx, group.toLatin1().constData(), ent, &error) == FALSE) {
-            return false;
+        if (lu_group_lookup_name(m_luctx, i.key().toLatin1().constData(), ent, &error) == FALSE) {
+            notifyErrorAndQuit(QStringLiteral("Group %1 disappeared while compiling: %2").arg(i.key(), QLatin1String(lu_strerror(error))));
+            result = false;
+            break;
         }
 
-        modifyFunction(ent, LU_MEMBERNAME, &val);
-        if (lu_group_modify(luctx, ent, &error) == FALSE) {
-            GravityUserManager::notifyErrorAndQuit(QStringLiteral("Error modifying group members for %1: %2").arg(group, QLatin1String(lu_strerror(error))));
-            return false;
+        for (const QString &user : i.value().added) {
+            g_value_set_string(&val, user.toLatin1().constData());
+            lu_ent_add(ent, LU_MEMBERNAME, &val);
+        }
+        for (const QString &user : i.value().removed) {
+            g_value_set_string(&val, user.toLatin1().constData());
+            lu_ent_del(ent, LU_MEMBERNAME, &val);
         }
+
+        // A single write per group, no matter how many users joined or left it.
+        if (lu_group_modify(m_luctx, ent, &error) == FALSE) {
+            notifyErrorAndQuit(QStringLiteral("Error modifying group members for %1: %2").arg(i.key(), QLatin1String(lu_strerror(error))));
+            result = false;
+            break;
+        }
+        lu_ent_clear_all(ent);
     }
 
     g_value_reset(&val);
     g_value_unset(&val);
-
-    lu_nscd_flush_cache(LU_NSCD_CACHE_GROUP);
     lu_ent_free(ent);
 
-    return true;
+    m_pendingMemberships.clear();
+    return result;
+}
+
+void GravityUserManager::addPhaseTime(const char *phase, qint64 msecs)
+{
+    if (!m_phaseTimes.contains(phase)) {
+        m_phases.append(phase);
+    }
+    m_phaseTimes[phase] += msecs;
 }
 
 bool GravityUserManager::addToGroups(const QString& user, const QStringList& groups)
 {
-    return modifyGroup(m_luctx, user, groups, lu_ent_add);
+    return modifyGroups(user, groups, true);
 }
 
 bool GravityUserManager::removeFromGroups(const QString& user, const QStringList& groups)
 {
-    return modifyGroup(m_luctx, user, groups, lu_ent_del);
+    return modifyGroups(user, groups, false);
 }
 
 bool GravityUserManager::setGroups(const QString& user, const QStringList& groups)
 {
-    struct lu_error *error = NULL;
-    QStringList groupsToAdd = groups;
-    QStringList groupsToRemove;
-
-    // Lookup groups for user.
-    GValueArray *groupNames = lu_groups_enumerate_by_user(m_luctx, user.toLatin1().constData(), &error);
-    if (error != NULL) {
-        notifyErrorAndQuit(QStringLiteral("Trying to modify user %1, but it does not exist. %2").arg(user, QLatin1String(lu_strerror(error))));
+    if (m_index.uid(user) < 0) {
+        notifyErrorAndQuit(QStringLiteral("Trying to modify user %1, but it does not exist.").arg(user));
         return false;
     }
-    if (groupNames != NULL) {
-        size_t i;
 
-        for (i = 0; i < groupNames->n_values; i++) {
-            GValue *value;
+    QStringList groupsToAdd = groups;
+    QStringList groupsToRemove;
 
-            value = g_value_array_get_nth(groupNames, i);
-            QString groupName = QLatin1String(g_value_get_string(value));
-            if (groups.contains(groupName)) {
-                groupsToAdd.removeOne(groupName);
-            } else {
-                groupsToRemove.append(groupName);
-            }
+    // Lookup groups for user.
+    for (const QString &groupName : m_index.groupsOf(user)) {
+        if (groups.contains(groupName)) {
+            groupsToAdd.removeOne(groupName);
+        } else {
+            groupsToRemove.append(groupName);
         }
-        g_value_array_free(groupNames);
     }
 
     // Do
@@ -328,57 +343,116 @@ bool GravityUserManager::setGroups(const QString& user, const QStringList& group
     return result;
 }
 
-bool GravityUserManager::replaceInFile(const QString& filename, const QHash< QByteArray, QByteArray >& replacementHash)
+bool GravityUserManager::replaceInFile(const QString& filename, const QByteArray& toReplace, const QByteArray& replacement)
 {
     if (!QFile::exists(filename)) {
         notifyErrorAndQuit(QStringLiteral("Trying to modify file %1, but it does not exist.").arg(filename));
         return false;
     }
 
-    // Read payload
+    // Files are rewritten once, at the end of the compilation.
+    m_replacements[filename].append(qMakePair(toReplace, replacement));
+    return true;
+}
+
+QByteArray GravityUserManager::applyReplacements(const QByteArray &payload, const Replacements &replacements)
+{
+    // Where each key occurs next, from the current position onwards.
+    QVector< int > next(replacements.size());
+    for (int i = 0; i < replacements.size(); ++i) {
+        next[i] = replacements.at(i).first.isEmpty() ? -1 : payload.indexOf(replacements.at(i).first);
+    }
+
+    QByteArray result;
+    result.reserve(payload.size());
+
+    int position = 0;
+    forever {
+        // Leftmost match wins, the first queued one on ties.
+        int match = -1;
+        for (int i = 0; i < replacements.size(); ++i) {
+            if (next.at(i) >= 0 && next.at(i) < position) {
+                next[i] = payload.indexOf(replacements.at(i).first, position);
+            }
+            if (next.at(i) >= 0 && (match < 0 || next.at(i) < next.at(match))) {
+                match = i;
+            }
+        }
+
+        if (match < 0) {
+            break;
+        }
+
+        result.append(payload.constData() + position, next.at(match) - position);
+        result.append(replacements.at(match).second);
+        position = next.at(match) + replacements.at(match).first.size();
+    }
+
+    result.append(payload.constData() + position, payload.size() - position);
+    return result;
+}
+
+QString GravityUserManager::rewriteFile(const QString &filename, const Replacements &replacements)
+{
     QByteArray payload;
     {
         QFile f(filename);
         if (!f.open(QIODevice::ReadOnly)) {
-            notifyErrorAndQuit(QStringLiteral("Could not open file %1 for modification.").arg(filename));
-            return false;
+            return QStringLiteral("Could not open file %1 for modification.").arg(filename);
         }
 
         payload = f.readAll();
         f.close();
     }
 
-    // Replace in payload
-    for (QHash< QByteArray, QByteArray >::const_iterator i = replacementHash.constBegin(); i != replacementHash.constEnd(); ++i) {
-        payload.replace(i.key(), i.value());
+    QByteArray result = applyReplacements(payload, replacements);
+    if (result == payload) {
+        return QString();
     }
 
-    // Write payload
-    {
-        QFile f(filename);
-        if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
-            notifyErrorAndQuit(QStringLiteral("Could not open file %1 for modification.").arg(filename));
-            return false;
-        }
-
-        if (f.write(payload) != payload.size()) {
-            notifyErrorAndQuit(QStringLiteral("Error writing to %1.").arg(filename));
-            return false;
-        }
+    // Write to a temporary file and rename it over the original: a crash never leaves a half written file behind.
+    QSaveFile f(filename);
+    if (!f.open(QIODevice::WriteOnly)) {
+        return QStringLiteral("Could not open file %1 for modification.").arg(filename);
+    }
 
-        f.flush();
-        f.close();
+    if (f.write(result) != result.size() || !f.commit()) {
+        return QStringLiteral("Error writing to %1: %2").arg(filename, f.errorString());
     }
 
-    return true;
+    return QString();
 }
 
-
-bool GravityUserManager::replaceInFile(const QString& filename, const QByteArray& toReplace, const QByteArray& replacement)
+bool GravityUserManager::commitReplacements()
 {
-    QHash< QByteArray, QByteArray > rh;
-    rh.insert(toReplace, replacement);
-    return replaceInFile(filename, rh);
+    struct Rewrite {
+        QString filename;
+        Replacements replacements;
+        QString error;
+    };
+
+    QList< Rewrite > rewrites;
+    for (QHash< QString, Replacements >::const_iterator i = m_replacements.constBegin(); i != m_replacements.constEnd(); ++i) {
+        Rewrite rewrite;
+        rewrite.filename = i.key();
+        rewrite.replacements = i.value();
+        rewrites.append(rewrite);
+    }
+    m_replacements.clear();
+
+    // Files are independent from each other.
+    QtConcurrent::blockingMap(rewrites, [] (Rewrite &rewrite) {
+        rewrite.error = rewriteFile(rewrite.filename, rewrite.replacements);
+    });
+
+    for (const Rewrite &rewrite : rewrites) {
+        if (!rewrite.error.isEmpty()) {
+            notifyErrorAndQuit(rewrite.error);
+            return false;
+        }
+    }
+
+    return true;
 }
 
 bool GravityUserManager::createTmpfilesEntry(const QString &user, const QString &homeDirectory)
@@ -395,11 +469,46 @@ bool GravityUserManager::createTmpfilesEntry(const QString &user, const QString
     return true;
 }
 
+bool GravityUserManager::commitPending()
+{
+    QElapsedTimer phaseTimer;
+    phaseTimer.start();
+
+    bool result = commitReplacements();
+    addPhaseTime("Service and policy files", phaseTimer.restart());
+
+    // Memberships go in even if some file could not be rewritten: the accounts exist already.
+    result = commitMemberships() && result;
+    addPhaseTime("Group memberships", phaseTimer.restart());
+
+    // Everything has been written, let nscd know once.
+    lu_nscd_flush_cache(LU_NSCD_CACHE_PASSWD);
+    lu_nscd_flush_cache(LU_NSCD_CACHE_GROUP);
+    addPhaseTime("Name service cache flush", phaseTimer.elapsed());
+
+    return result;
+}
+
+void GravityUserManager::abortCompilation(const QString &error)
+{
+    notifyErrorAndQuit(error);
+
+    // Accounts created by the files compiled so far are there to stay: don't leave them without their groups and files.
+    commitPending();
+}
+
 void GravityUserManager::compileNext()
 {
     if (m_payloads.isEmpty()) {
+        if (!commitPending()) {
+            return;
+        }
+
         // Yay!
         std::cout << std::endl << "All files successfully compiled." << std::endl;
+        for (const QByteArray &phase : m_phases) {
+            std::cout << "\t" << phase.constData() << ": " << m_phaseTimes.value(phase) << " ms" << std::endl;
+        }
 
         // Update systemd, if needed.
         if (sd_booted() > 0) {
@@ -416,6 +525,9 @@ void GravityUserManager::compileNext()
 
     std::cout << "\tCompiling " << file.split(QLatin1Char('/')).last().toLatin1().constData() << ":" << std::endl;
 
+    QElapsedTimer phaseTimer;
+    phaseTimer.start();
+
     QHash< QString, QPair< QString, QStringList > > starUsers;
     QHash< QString, QPair< QString, QStringList > > orbitUsers;
 
@@ -447,7 +559,7 @@ void GravityUserManager::compileNext()
         QStringList pair = line.split(QLatin1Char(':'));
         if (pair.size() != 2) {
             // File malformed.
-            notifyErrorAndQuit(QStringLiteral("File malformed! Not a key-value file."));
+            abortCompilation(QStringLiteral("File malformed! Not a key-value file."));
             return;
         }
 
@@ -464,15 +576,20 @@ void GravityUserManager::compileNext()
             starUsers.insert(pair.first(), qMakePair(normalizeUser(pair.first()), groups));
         } else {
             // File malformed.
-            notifyErrorAndQuit(QStringLiteral("File malformed! It contains a user which is neither a star nor an orbit!"));
+            abortCompilation(QStringLiteral("File malformed! It contains a user which is neither a star nor an orbit!"));
             return;
         }
     }
 
+    addPhaseTime("Parsing", phaseTimer.elapsed());
+
     auto doCreateUser = [this] (qint32 baseUid, const QString &baseGroup, const QString &user,
                                 const QString &userOrig, const QStringList &groups) -> bool {
-        quint32 uid = uidFor(user, baseUid);
-        if (uid == 0) {
+        QElapsedTimer timer;
+        timer.start();
+
+        qint32 uid = m_index.uid(user);
+        if (uid >= 0) {
             // Update user
             std::cout << "\t\tUpdating user " << user.toLatin1().constData() << "...";
             std::cout.flush();
@@ -485,18 +602,17 @@ void GravityUserManager::compileNext()
             if (!setGroups(user, groups)) {
                 return false;
             }
-        } else if (uid > 0) {
+        } else {
             // Create user
             std::cout << "\t\tCreating user " << user.toLatin1().constData() << "...";
             std::cout.flush();
 
+            uid = m_index.firstFreeUid(baseUid);
             if (!createUser(uid, baseGroup, user, groups)) {
                 return false;
             }
-        } else {
-            notifyErrorAndQuit(QStringLiteral("Retrieving system user information failed! This is really, really wrong!"));
-            return false;
         }
+        addPhaseTime("Accounts", timer.restart());
 
         // Update service files
         QString serviceFile;
@@ -507,7 +623,7 @@ void GravityUserManager::compileNext()
         }
 
         if (!replaceInFile(QStringLiteral("%1%2").arg(QLatin1String(SYSTEMD_SYSTEM_PATH), serviceFile), "@USER@",
-                           QString::number(uidFor(user, baseUid, true)).toLatin1())) {
+                           QString::number(uid).toLatin1())) {
             return false;
         }
         // Also, the policy files.
@@ -532,7 +648,7 @@ void GravityUserManager::compileNext()
             }
 
             if (!replaceInFile(QStringLiteral("%1%2").arg(QLatin1String(SYSTEMD_SYSTEM_PATH), serviceDebugFile), "@USER@",
-                               QString::number(uidFor(user, baseUid, true)).toLatin1())) {
+                               QString::number(uid).toLatin1())) {
                 return false;
             }
         }
@@ -545,6 +661,15 @@ void GravityUserManager::compileNext()
         std::cout << "\t\tDeleting user " << user.toLatin1().constData() << "...";
         std::cout.flush();
 
+        qint32 uid = m_index.uid(user);
+        if (uid < 0) {
+            notifyErrorAndQuit(QStringLiteral("Trying to delete user %1, but it does not exist.").arg(user));
+            return false;
+        }
+
+        QElapsedTimer timer;
+        timer.start();
+
         // Un-replace files
         QString serviceFile;
         if (user.startsWith(QStringLiteral("orbit-"))) {
@@ -554,7 +679,7 @@ void GravityUserManager::compileNext()
         }
 
         if (!replaceInFile(QStringLiteral("%1%2").arg(QLatin1String(SYSTEMD_SYSTEM_PATH), serviceFile),
-                           QString::number(uidFor(user, 0, true)).toLatin1(), "@USER@")) {
+                           QString::number(uid).toLatin1(), "@USER@")) {
             return false;
         }
         // Also, the policy files.
@@ -578,14 +703,16 @@ void GravityUserManager::compileNext()
             }
 
             if (!replaceInFile(QStringLiteral("%1%2").arg(QLatin1String(SYSTEMD_SYSTEM_PATH), serviceDebugFile),
-                               QString::number(uidFor(user, 0, true)).toLatin1(), "@USER@")) {
+                               QString::number(uid).toLatin1(), "@USER@")) {
                 return false;
             }
         }
 
+        timer.restart();
         if (!deleteUser(user)) {
             return false;
         }
+        addPhaseTime("Accounts", timer.elapsed());
 
         std::cout << " Success!" << std::endl;
         return true;
@@ -595,12 +722,12 @@ void GravityUserManager::compileNext()
         if (m_create) {
             // Create users
             if (!doCreateUser(STAR_USER_BASE_UID, i.value().first, i.value().first, i.key(), i.value().second)) {
-                notifyErrorAndQuit(tr("Could not create user! Verify groups and user name are consistent."));
+                abortCompilation(tr("Could not create user! Verify groups and user name are consistent."));
                 return;
             }
         } else {
             if (!doDeleteUser(i.key(), i.value().first)) {
-                notifyErrorAndQuit(tr("Could not delete user!"));
+                abortCompilation(tr("Could not delete user!"));
                 return;
             }
         }
@@ -609,12 +736,12 @@ void GravityUserManager::compileNext()
         if (m_create) {
             // Create users
             if (!doCreateUser(ORBIT_USER_BASE_UID, QStringLiteral("hemera-orbits"), i.value().first, i.key(), i.value().second)) {
-                notifyErrorAndQuit(tr("Could not create user! Verify groups and user name are consistent."));
+                abortCompilation(tr("Could not create user! Verify groups and user name are consistent."));
                 return;
             }
         } else {
             if (!doDeleteUser(i.key(), i.value().first)) {
-                notifyErrorAndQuit(tr("Could not delete user!"));
+                abortCompilation(tr("Could not delete user!"));
                 return;
             }
         }
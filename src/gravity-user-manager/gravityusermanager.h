@@ -9,6 +9,8 @@
 
 #include <QtCore/QStringList>
 
+#include "userindex.h"
+
 struct lu_context;
 
 class GravityUserManager : public Hemera::AsyncInitObject
@@ -40,13 +42,37 @@ private:
     bool setGroups(const QString &user, const QStringList &groups);
     bool createTmpfilesEntry(const QString &user, const QString &homeDirectory);
 
-    static bool replaceInFile(const QString &file, const QHash< QByteArray, QByteArray > &replacementHash);
-    static bool replaceInFile(const QString &file, const QByteArray &toReplace, const QByteArray &replacement);
+    // Replacements are queued, and every file is rewritten once in commitReplacements.
+    typedef QList< QPair< QByteArray, QByteArray > > Replacements;
+    bool replaceInFile(const QString &file, const QByteArray &toReplace, const QByteArray &replacement);
+    bool commitReplacements();
+
+    static QByteArray applyReplacements(const QByteArray &payload, const Replacements &replacements);
+    static QString rewriteFile(const QString &file, const Replacements &replacements);
+
+    bool modifyGroups(const QString &user, const QStringList &groups, bool add);
+    bool commitMemberships();
+
+    // Writes whatever has been queued so far. Runs at the end, and when the compilation stops half way.
+    bool commitPending();
+    void abortCompilation(const QString &error);
 
-    // 0 means user exists.
-    qint32 uidFor(const QString &username, qint32 baseUid, bool returnCorrectUid = false);
+    void addPhaseTime(const char *phase, qint64 msecs);
 
     struct lu_context *m_luctx;
+    UserIndex m_index;
+
+    // Membership changes are accumulated during the whole compilation, and written once per group at the end,
+    // or as soon as the compilation fails.
+    struct MembershipChanges {
+        QSet< QString > added;
+        QSet< QString > removed;
+    };
+    QHash< QString, MembershipChanges > m_pendingMemberships;
+    QHash< QString, Replacements > m_replacements;
+
+    QList< QByteArray > m_phases;
+    QHash< QByteArray, qint64 > m_phaseTimes;
 
     QStringList m_files;
     QHash< QString, QString > m_payloads;
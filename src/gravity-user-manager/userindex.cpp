@@ -0,0 +1,167 @@
+/*
+ *
+ */
+
+#include "userindex.h"
+
+#include <libuser/entity.h>
+#include <libuser/user.h>
+
+UserIndex::UserIndex()
+{
+}
+
+void UserIndex::registerRange(qint32 baseUid, qint32 size)
+{
+    Range range;
+    range.used = QBitArray(size);
+    range.firstCandidate = 0;
+    m_ranges.insert(baseUid, range);
+}
+
+bool UserIndex::load(struct lu_context *luctx, QString *errorMessage)
+{
+    struct lu_error *error = NULL;
+
+    GPtrArray *users = lu_users_enumerate_full(luctx, "*", &error);
+    if (error != NULL) {
+        *errorMessage = QStringLiteral("Could not enumerate users: %1").arg(QLatin1String(lu_strerror(error)));
+        lu_error_free(&error);
+        return false;
+    }
+    if (users != NULL) {
+        for (guint i = 0; i < users->len; ++i) {
+            lu_ent *ent = static_cast< lu_ent* >(g_ptr_array_index(users, i));
+            addUser(QLatin1String(lu_ent_get_first_string(ent, LU_USERNAME)), lu_ent_get_first_id(ent, LU_UIDNUMBER));
+            lu_ent_free(ent);
+        }
+        g_ptr_array_free(users, TRUE);
+    }
+
+    GPtrArray *groups = lu_groups_enumerate_full(luctx, "*", &error);
+    if (error != NULL) {
+        *errorMessage = QStringLiteral("Could not enumerate groups: %1").arg(QLatin1String(lu_strerror(error)));
+        lu_error_free(&error);
+        return false;
+    }
+    if (groups != NULL) {
+        for (guint i = 0; i < groups->len; ++i) {
+            lu_ent *ent = static_cast< lu_ent* >(g_ptr_array_index(groups, i));
+            QString group = QLatin1String(lu_ent_get_first_string(ent, LU_GROUPNAME));
+            addGroup(group, lu_ent_get_first_id(ent, LU_GIDNUMBER));
+
+            GValueArray *members = lu_ent_get(ent, LU_MEMBERNAME);
+            for (guint j = 0; members != NULL && j < members->n_values; ++j) {
+                addMember(group, QLatin1String(g_value_get_string(g_value_array_get_nth(members, j))));
+            }
+            lu_ent_free(ent);
+        }
+        g_ptr_array_free(groups, TRUE);
+    }
+
+    return true;
+}
+
+qint32 UserIndex::uid(const QString &user) const
+{
+    return m_users.value(user, -1);
+}
+
+qint32 UserIndex::gid(const QString &group) const
+{
+    return m_groups.value(group, -1);
+}
+
+QStringList UserIndex::groupsOf(const QString &user) const
+{
+    return m_memberships.value(user).toList();
+}
+
+qint32 UserIndex::firstFreeUid(qint32 baseUid)
+{
+    qint32 uid = baseUid;
+
+    QHash< qint32, Range >::iterator range = m_ranges.find(baseUid);
+    if (range != m_ranges.end()) {
+        // Allocation only ever moves forward, unless a user is removed.
+        while (range->firstCandidate < range->used.size() && range->used.testBit(range->firstCandidate)) {
+            ++range->firstCandidate;
+        }
+        uid += range->firstCandidate;
+    }
+
+    // Out of the range, or no range at all: probe one by one.
+    while (m_uids.contains(uid)) {
+        ++uid;
+    }
+
+    return uid;
+}
+
+void UserIndex::setUidUsed(qint32 uid, bool used)
+{
+    // Several names might share the same uid
+    if (used) {
+        if (m_uids[uid]++ > 0) {
+            return;
+        }
+    } else {
+        QHash< qint32, int >::iterator i = m_uids.find(uid);
+        if (i == m_uids.end() || --i.value() > 0) {
+            return;
+        }
+        m_uids.erase(i);
+    }
+
+    for (QHash< qint32, Range >::iterator i = m_ranges.begin(); i != m_ranges.end(); ++i) {
+        qint32 index = uid - i.key();
+        if (index < 0 || index >= i->used.size()) {
+            continue;
+        }
+
+        i->used.setBit(index, used);
+        if (!used && index < i->firstCandidate) {
+            i->firstCandidate = index;
+        }
+    }
+}
+
+void UserIndex::addUser(const QString &user, qint32 uid)
+{
+    removeUser(user);
+    m_users.insert(user, uid);
+    setUidUsed(uid, true);
+}
+
+void UserIndex::removeUser(const QString &user)
+{
+    if (!m_users.contains(user)) {
+        return;
+    }
+
+    // Group memberships are left alone, just like libuser does.
+    setUidUsed(m_users.take(user), false);
+}
+
+void UserIndex::addGroup(const QString &group, qint32 gid)
+{
+    m_groups.insert(group, gid);
+}
+
+void UserIndex::addMember(const QString &group, const QString &user)
+{
+    m_memberships[user].insert(group);
+}
+
+void UserIndex::removeMember(const QString &group, const QString &user)
+{
+    QHash< QString, QSet< QString > >::iterator i = m_memberships.find(user);
+    if (i == m_memberships.end()) {
+        return;
+    }
+
+    i->remove(group);
+    if (i->isEmpty()) {
+        m_memberships.erase(i);
+    }
+}
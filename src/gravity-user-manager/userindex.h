@@ -0,0 +1,63 @@
+/*
+ *
+ */
+
+#ifndef USERINDEX_H
+#define USERINDEX_H
+
+#include <QtCore/QBitArray>
+#include <QtCore/QHash>
+#include <QtCore/QSet>
+#include <QtCore/QStringList>
+
+struct lu_context;
+
+/**
+ * An in-memory copy of the users and groups known to libuser.
+ *
+ * The index is loaded once, and must be kept up to date by whoever changes the underlying database.
+ * Lookups are hash lookups, and uids inside a registered range are allocated from a bitmap.
+ */
+class UserIndex
+{
+public:
+    UserIndex();
+
+    /// Uids from @p baseUid to @p baseUid + @p size - 1 will be allocated from a bitmap.
+    void registerRange(qint32 baseUid, qint32 size);
+    bool load(struct lu_context *luctx, QString *errorMessage);
+
+    /// @returns -1 if the user does not exist
+    qint32 uid(const QString &user) const;
+    /// @returns -1 if the group does not exist
+    qint32 gid(const QString &group) const;
+    /// Groups @p user is an explicit member of
+    QStringList groupsOf(const QString &user) const;
+
+    /// @returns The lowest uid not in use which is not lower than @p baseUid
+    qint32 firstFreeUid(qint32 baseUid);
+
+    void addUser(const QString &user, qint32 uid);
+    void removeUser(const QString &user);
+    void addGroup(const QString &group, qint32 gid);
+    void addMember(const QString &group, const QString &user);
+    void removeMember(const QString &group, const QString &user);
+
+private:
+    struct Range {
+        QBitArray used;
+        // Every uid below this one is in use
+        int firstCandidate;
+    };
+
+    void setUidUsed(qint32 uid, bool used);
+
+    QHash< QString, qint32 > m_users;
+    QHash< QString, qint32 > m_groups;
+    QHash< QString, QSet< QString > > m_memberships;
+    // uid -> how many users have it
+    QHash< qint32, int > m_uids;
+    QHash< qint32, Range > m_ranges;
+};
+
+#endif // USERINDEX_H
@@ -2,6 +2,8 @@
 
 #include <GravitySupermassive/Application>
 #include <GravitySupermassive/ApplicationHandler>
+#include <GravitySupermassive/MemoryPressureManager>
+#include <GravitySupermassive/StarSequence>
 
 #include <HemeraCore/CommonOperations>
 #include <HemeraCore/Literals>
@@ -22,15 +24,18 @@
 #include "dbusobjectinterface.h"
 
 #include "parsecadaptor.h"
+#include "parsecmetricsadaptor.h"
 
 class ParsecCore::Private
 {
 public:
-    Private(ParsecCore *q) : q(q), shuttingDown(false) {}
+    Private(ParsecCore *q) : q(q), applicationHandler(Q_NULLPTR), memoryPressureManager(Q_NULLPTR), starSequenceInterface(Q_NULLPTR)
+                           , starSequenceObjectInterface(Q_NULLPTR), onPrivateBus(false), shuttingDown(false) {}
 
     ParsecCore *q;
 
     Gravity::ApplicationHandler *applicationHandler;
+    Gravity::MemoryPressureManager *memoryPressureManager;
     com::ispirata::Hemera::Gravity::StarSequence *starSequenceInterface;
     com::ispirata::Hemera::DBusObject *starSequenceObjectInterface;
 
@@ -42,12 +47,113 @@ public:
     QVariantMap inhibitionReasons;
     uint phase;
 
+    // Link to Gravity Center: the private peer connection when it's up, the system bus otherwise.
+    bool onPrivateBus;
+    void connectToGravityCenter();
+    void checkGravityCenterLink();
+    bool setupStarSequenceInterfaces();
+    void updateProperties(const QVariantMap &changed);
+
     bool shuttingDown;
 
+    QPointer< QDBusServiceWatcher > gravityCenterWatcher;
     QPointer< QDBusServiceWatcher > busWatcher;
     QHash< QString, uint > serviceToInhibitionCookie;
 };
 
+void ParsecCore::Private::connectToGravityCenter()
+{
+    // Drop whatever is left of a previous link first
+    QDBusConnection::disconnectFromPeer(QStringLiteral("gravitycenter"));
+
+    onPrivateBus = QDBusConnection::connectToPeer(Gravity::StarSequence::privateBusAddress(starName),
+                                                  QStringLiteral("gravitycenter")).isConnected();
+    if (onPrivateBus) {
+        qDebug() << "Connected to Gravity Center through the private bus";
+    } else {
+        QDBusConnection::disconnectFromPeer(QStringLiteral("gravitycenter"));
+    }
+}
+
+void ParsecCore::Private::checkGravityCenterLink()
+{
+    if (onPrivateBus && QDBusConnection(QStringLiteral("gravitycenter")).isConnected()) {
+        return;
+    }
+
+    bool wasOnPrivateBus = onPrivateBus;
+    connectToGravityCenter();
+    if (!wasOnPrivateBus && !onPrivateBus) {
+        // Still nobody on the other side: the system bus keeps working meanwhile.
+        return;
+    }
+
+    if (wasOnPrivateBus && !onPrivateBus) {
+        qWarning() << "Lost the private link to Gravity Center, going through the system bus until it is back";
+    }
+
+    if (!setupStarSequenceInterfaces()) {
+        qWarning() << "The remote Star Sequence is not available after reconnecting to Gravity Center";
+        return;
+    }
+    if (applicationHandler) {
+        applicationHandler->reconnectToGravityCenter();
+    }
+
+    // Catch up with whatever happened while we were not listening
+    Hemera::DBusVariantMapOperation *operation = new Hemera::DBusVariantMapOperation(starSequenceObjectInterface->allProperties(), q);
+    QObject::connect(operation, &Hemera::Operation::finished, q, [this, operation] {
+        if (!operation->isError()) {
+            updateProperties(operation->result());
+        }
+    });
+}
+
+bool ParsecCore::Private::setupStarSequenceInterfaces()
+{
+    QDBusConnection gravityCenterConnection = QDBusConnection::systemBus();
+    QString gravityCenterService = Hemera::Literals::literal(Hemera::Literals::DBus::gravityCenterService());
+    if (onPrivateBus) {
+        gravityCenterConnection = QDBusConnection(QStringLiteral("gravitycenter"));
+        gravityCenterService.clear();
+    }
+
+    if (starSequenceInterface) {
+        starSequenceInterface->deleteLater();
+        starSequenceObjectInterface->deleteLater();
+    }
+
+    QString starSequencePath = QString::fromLatin1(Hemera::Literals::DBus::starSequencePath()).arg(starName);
+    starSequenceInterface = new com::ispirata::Hemera::Gravity::StarSequence(gravityCenterService, starSequencePath, gravityCenterConnection, q);
+    starSequenceObjectInterface = new com::ispirata::Hemera::DBusObject(gravityCenterService, starSequencePath, gravityCenterConnection, q);
+
+    QObject::connect(starSequenceObjectInterface, &com::ispirata::Hemera::DBusObject::propertiesChanged, q, [this] (const QVariantMap &changed) {
+        updateProperties(changed);
+    });
+
+    return starSequenceInterface->isValid() && starSequenceObjectInterface->isValid();
+}
+
+void ParsecCore::Private::updateProperties(const QVariantMap &changed)
+{
+    if (changed.contains(QStringLiteral("activeOrbit"))) {
+        activeOrbit = changed.value(QStringLiteral("activeOrbit")).toString();
+        Q_EMIT q->activeOrbitChanged();
+    }
+    if (changed.contains(QStringLiteral("inhibitionReasons"))) {
+        inhibitionReasons = changed.value(QStringLiteral("inhibitionReasons")).toMap();
+        Q_EMIT q->inhibitionChanged();
+    }
+    if (changed.contains(QStringLiteral("isOrbitSwitchInhibited"))) {
+        isInhibited = changed.value(QStringLiteral("isOrbitSwitchInhibited")).toBool();
+        Q_EMIT q->inhibitionChanged();
+    }
+    if (changed.contains(QStringLiteral("phase"))) {
+        phase = changed.value(QStringLiteral("phase")).toUInt();
+        Q_EMIT q->phaseChanged();
+    }
+}
+
 ParsecCore::ParsecCore(QObject* parent)
     : AsyncInitDBusObject(parent)
     , d(new Private(this))
@@ -108,6 +214,16 @@ void ParsecCore::initImpl()
         watchdogTimer->start();
     }
 
+    // Talk to Gravity Center through our private link if it's there. Otherwise, it's the system bus.
+    d->connectToGravityCenter();
+
+    // Gravity Center might restart: when its name shows up again, so does its private link.
+    d->gravityCenterWatcher = new QDBusServiceWatcher(Hemera::Literals::literal(Hemera::Literals::DBus::gravityCenterService()),
+                                                      QDBusConnection::systemBus(), QDBusServiceWatcher::WatchForRegistration, this);
+    connect(d->gravityCenterWatcher.data(), &QDBusServiceWatcher::serviceRegistered, this, [this] {
+        d->checkGravityCenterLink();
+    });
+
     // Bus watcher
     d->busWatcher = new QDBusServiceWatcher(this);
     d->busWatcher.data()->setConnection(starBusConnection);
@@ -129,10 +245,18 @@ void ParsecCore::initImpl()
     connect(d->applicationHandler, &Gravity::ApplicationHandler::applicationUnregistered, this, &ParsecCore::updateSystemdStatus);
     Hemera::Operation *op = d->applicationHandler->init();
 
-    connect(op, &Hemera::Operation::finished, [this, op] {
+    connect(op, &Hemera::Operation::finished, [this, op, starBusConnection] {
         if (op->isError()) {
             setInitError(op->errorName(), op->errorMessage());
         } else {
+            // Memory pressure handling is best effort: the star works fine without it.
+            d->memoryPressureManager = new Gravity::MemoryPressureManager(d->applicationHandler, starBusConnection, this);
+            connect(d->memoryPressureManager->init(), &Hemera::Operation::finished, this, [] (Hemera::Operation *mop) {
+                if (mop->isError()) {
+                    qWarning() << "Memory pressure manager could not be initialized:" << mop->errorName() << mop->errorMessage();
+                }
+            });
+
             setOnePartIsReady();
             // It is now time to trigger the Star's ignition
             qDebug() << "Triggering star ignition";
@@ -141,17 +265,7 @@ void ParsecCore::initImpl()
     });
 
     // Star sequence interface
-    QString starSequencePath = QString::fromLatin1(Hemera::Literals::DBus::starSequencePath()).arg(d->starName);
-    d->starSequenceInterface = new com::ispirata::Hemera::Gravity::StarSequence(Hemera::Literals::literal(Hemera::Literals::DBus::gravityCenterService()),
-                                                                                starSequencePath, QDBusConnection::systemBus(), this);
-    if (!d->starSequenceInterface->isValid()) {
-        setInitError(Hemera::Literals::literal(Hemera::Literals::Errors::interfaceNotAvailable()),
-                     QStringLiteral("The remote Star Sequence is not available. The daemon is probably not running."));
-        return;
-    }
-    d->starSequenceObjectInterface = new com::ispirata::Hemera::DBusObject(Hemera::Literals::literal(Hemera::Literals::DBus::gravityCenterService()),
-                                                                           starSequencePath, QDBusConnection::systemBus(), this);
-    if (!d->starSequenceObjectInterface->isValid()) {
+    if (!d->setupStarSequenceInterfaces()) {
         setInitError(Hemera::Literals::literal(Hemera::Literals::Errors::interfaceNotAvailable()),
                      QStringLiteral("The remote Star Sequence is not available. The daemon is probably not running."));
         return;
@@ -177,26 +291,8 @@ void ParsecCore::initImpl()
         setOnePartIsReady();
     });
 
-    connect(d->starSequenceObjectInterface, &com::ispirata::Hemera::DBusObject::propertiesChanged, [this] (const QVariantMap &changed) {
-        if (changed.contains(QStringLiteral("activeOrbit"))) {
-            d->activeOrbit = changed.value(QStringLiteral("activeOrbit")).toString();
-            Q_EMIT activeOrbitChanged();
-        }
-        if (changed.contains(QStringLiteral("inhibitionReasons"))) {
-            d->inhibitionReasons = changed.value(QStringLiteral("inhibitionReasons")).toMap();
-            Q_EMIT inhibitionChanged();
-        }
-        if (changed.contains(QStringLiteral("isOrbitSwitchInhibited"))) {
-            d->isInhibited = changed.value(QStringLiteral("isOrbitSwitchInhibited")).toBool();
-            Q_EMIT inhibitionChanged();
-        }
-        if (changed.contains(QStringLiteral("phase"))) {
-            d->phase = changed.value(QStringLiteral("phase")).toUInt();
-            Q_EMIT phaseChanged();
-        }
-    });
-
     new ParsecAdaptor(this);
+    new ParsecMetricsAdaptor(this);
 
     setOnePartIsReady();
 }
@@ -265,6 +361,11 @@ bool ParsecCore::AmIASatellite()
     return d->applicationHandler->appIsSatellite(message().service());
 }
 
+QVariantMap ParsecCore::LifecycleMetrics() const
+{
+    return d->applicationHandler->lifecycleMetrics();
+}
+
 void ParsecCore::inhibitOrbitSwitch(const QString &reason)
 {
     if (!calledFromDBus()) {
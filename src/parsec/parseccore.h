@@ -37,6 +37,8 @@ public Q_SLOTS:
 
     bool AmIASatellite();
 
+    QVariantMap LifecycleMetrics() const;
+
     void openURL(const QString &url, bool tryActivation);
 
     /// Those are here to please DBus